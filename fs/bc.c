@@ -10,6 +10,31 @@ diskaddr(uint32_t blockno)
 	return (char*) (DISKMAP + blockno * BLKSIZE);
 }
 
+// Is this virtual address mapped?
+bool
+va_is_mapped(void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+// Is this virtual address dirty?
+bool
+va_is_dirty(void *va)
+{
+	return (uvpt[PGNUM(va)] & PTE_D) != 0;
+}
+
+// Clear the PTE_D bit of the block cache page at 'va', which now
+// matches the disk, by mapping the page over itself.
+static void
+bc_clean(void *va)
+{
+	int r;
+
+	if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+		panic("in bc_clean, sys_page_map: %e", r);
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -45,8 +70,83 @@ bc_pgfault(struct UTrapframe *utf)
    // Read block from disk and insert into page
    if ((error = ide_read(secno, algn_addr, PGSIZE / SECTSIZE)) < 0)
       panic("bc_pgfault: ide_read %d", error);
+
+   // Reading it in dirtied the page, but it matches the disk
+   bc_clean(algn_addr);
 }
 
+// Flush the contents of the block containing VA out to disk if
+// necessary, then clear the PTE_D bit using sys_page_map.
+// If the block is not in the block cache or is not dirty, does
+// nothing.
+void
+flush_block(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int r;
+
+	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+		panic("flush_block of bad va %08x", addr);
+
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	if (!va_is_mapped(addr) || !va_is_dirty(addr))
+		return;
+	if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
+		panic("in flush_block, ide_write: %e", r);
+	bc_clean(addr);
+}
+
+// If anyone else has the block cache page at 'va' mapped (FSREQ_MAP
+// hands them out read-only), replace ours with a private copy, so that
+// writing to it can't change what they see.  The copy isn't marked
+// dirty, so the caller must be about to write it.
+// Returns 0 on success, < 0 on error.
+int
+bc_unshare(void *va)
+{
+	int r;
+
+	if (!va_is_mapped(va) || pageref(va) <= 1)
+		return 0;
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	memmove(UTEMP, va, BLKSIZE);
+	r = sys_page_map(0, UTEMP, 0, va, PTE_P|PTE_U|PTE_W);
+	sys_page_unmap(0, UTEMP);
+	return r;
+}
+
+// Write every dirty block in the cache back to disk, in block order.
+// Each run of consecutive dirty blocks goes out as one ide_write of up
+// to BC_MAXRUN blocks, rather than a write per block.
+void
+bc_sync(void)
+{
+	uint32_t blockno, n, i;
+	void *va;
+	int r;
+
+	for (blockno = 1; blockno < super->s_nblocks; blockno += n) {
+		va = diskaddr(blockno);
+		n = 1;
+		// Nothing is cached under an empty page directory entry
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			n = NPTENTRIES - PTX(va);
+			continue;
+		}
+		if (!(uvpt[PGNUM(va)] & PTE_P) || !va_is_dirty(va))
+			continue;
+
+		while (n < BC_MAXRUN && blockno + n < super->s_nblocks
+		       && va_is_mapped(diskaddr(blockno + n))
+		       && va_is_dirty(diskaddr(blockno + n)))
+			n++;
+		if ((r = ide_write(blockno * BLKSECTS, va, n * BLKSECTS)) < 0)
+			panic("in bc_sync, ide_write: %e", r);
+		for (i = 0; i < n; i++)
+			bc_clean(diskaddr(blockno + i));
+	}
+}
 
 void
 bc_init(void)
@@ -19,6 +19,90 @@ check_super(void)
 	cprintf("superblock is good\n");
 }
 
+// --------------------------------------------------------------
+// Free block bitmap
+// --------------------------------------------------------------
+
+// Check to see if the block bitmap indicates that block 'blockno' is free.
+// Return 1 if the block is free, 0 if not.
+bool
+block_is_free(uint32_t blockno)
+{
+	if (super == 0 || blockno >= super->s_nblocks)
+		return 0;
+	if (bitmap[blockno / 32] & (1 << (blockno % 32)))
+		return 1;
+	return 0;
+}
+
+// Mark a block free in the bitmap, and drop it from the block cache so
+// that it isn't written back.
+void
+free_block(uint32_t blockno)
+{
+	// Blockno zero is the null pointer of block numbers.
+	if (blockno == 0)
+		panic("attempt to free zero block");
+	bitmap[blockno/32] |= 1<<(blockno%32);
+	(void) sys_page_unmap(0, diskaddr(blockno));
+}
+
+// Search the bitmap for a free block and allocate it.  Like every
+// other change, the bitmap goes to disk with the next fs_sync.  The
+// new block starts out as a dirty page of zeros in the block cache,
+// rather than being read in from disk.
+//
+// Return block number allocated on success,
+// -E_NO_DISK if we are out of blocks.
+int
+alloc_block(void)
+{
+	static uint32_t next;	// Bitmap word the last search stopped at
+	uint32_t nwords, i, w, b, blockno;
+	int r;
+
+	nwords = (super->s_nblocks + 31) / 32;
+	for (i = 0; i < nwords; i++) {
+		w = (next + i) % nwords;
+		if (bitmap[w] == 0)
+			continue;
+		for (b = 0; !(bitmap[w] & (1 << b)); b++)
+			;
+		// The last word's spare bits are "free" past the disk's end
+		if ((blockno = w * 32 + b) >= super->s_nblocks)
+			continue;
+
+		if ((r = sys_page_alloc(0, diskaddr(blockno),
+					PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		*(volatile char *) diskaddr(blockno) = 0;	// Dirty it
+		bitmap[w] &= ~(1 << b);
+		next = w;
+		return blockno;
+	}
+	return -E_NO_DISK;
+}
+
+// Validate the file system bitmap.
+//
+// Check that all reserved blocks -- 0, 1, and the bitmap blocks
+// themselves -- are all marked as in-use.
+void
+check_bitmap(void)
+{
+	uint32_t i;
+
+	// Make sure all bitmap blocks are marked in-use
+	for (i = 0; i * BLKBITSIZE < super->s_nblocks; i++)
+		assert(!block_is_free(2+i));
+
+	// Make sure the reserved and root blocks are marked in-use.
+	assert(!block_is_free(0));
+	assert(!block_is_free(1));
+
+	cprintf("bitmap is good\n");
+}
+
 
 // --------------------------------------------------------------
 // File system structures
@@ -41,6 +125,10 @@ fs_init(void)
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+
+	// Set "bitmap" to the beginning of the first bitmap block.
+	bitmap = diskaddr(2);
+	check_bitmap();
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
@@ -70,7 +158,11 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 		ptr = &f->f_direct[filebno];
 	else if (filebno < NDIRECT + NINDIRECT) {
 		if (f->f_indirect == 0) {
-			return -E_NOT_FOUND;
+			if (!alloc)
+				return -E_NOT_FOUND;
+			if ((r = alloc_block()) < 0)
+				return r;
+			f->f_indirect = r;
 		}
 		ptr = (uint32_t*)diskaddr(f->f_indirect) + filebno - NDIRECT;
 	} else
@@ -96,7 +188,9 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 	if ((r = file_block_walk(f, filebno, &ptr, 1)) < 0)
 		return r;
 	if (*ptr == 0) {
-		return -E_NOT_FOUND;
+		if ((r = alloc_block()) < 0)
+			return r;
+		*ptr = r;
 	}
 	*blk = diskaddr(*ptr);
 	return 0;
@@ -132,6 +226,36 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
+// Set *file to point at a free File structure in dir.  The caller is
+// responsible for filling in the File fields.
+static int
+dir_alloc_file(struct File *dir, struct File **file)
+{
+	int r;
+	uint32_t nblock, i, j;
+	char *blk;
+	struct File *f;
+
+	assert((dir->f_size % BLKSIZE) == 0);
+	nblock = dir->f_size / BLKSIZE;
+	for (i = 0; i < nblock; i++) {
+		if ((r = file_get_block(dir, i, &blk)) < 0)
+			return r;
+		f = (struct File*) blk;
+		for (j = 0; j < BLKFILES; j++)
+			if (f[j].f_name[0] == '\0') {
+				*file = &f[j];
+				return 0;
+			}
+	}
+	dir->f_size += BLKSIZE;
+	if ((r = file_get_block(dir, i, &blk)) < 0)
+		return r;
+	f = (struct File*) blk;
+	*file = &f[0];
+	return 0;
+}
+
 
 // Skip over slashes.
 static const char*
@@ -203,6 +327,27 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 // --------------------------------------------------------------
 
 
+// Create "path".  On success set *pf to point at the file and return 0.
+// On error return < 0.
+int
+file_create(const char *path, struct File **pf)
+{
+	char name[MAXNAMELEN];
+	int r;
+	struct File *dir, *f;
+
+	if ((r = walk_path(path, &dir, &f, name)) == 0)
+		return -E_FILE_EXISTS;
+	if (r != -E_NOT_FOUND || dir == 0)
+		return r;
+	if ((r = dir_alloc_file(dir, &f)) < 0)
+		return r;
+
+	strcpy(f->f_name, name);
+	*pf = f;
+	return 0;
+}
+
 // Open "path".  On success set *pf to point at the file and return 0.
 // On error return < 0.
 int
@@ -239,4 +384,102 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 }
 
 
+// Write count bytes from buf into f, starting at seek position
+// offset.  This is meant to mimic the standard pwrite function.
+// Extends the file if necessary.  The blocks are only dirtied in the
+// block cache; fs_sync writes them out.
+// Returns the number of bytes written, < 0 on error.
+int
+file_write(struct File *f, const void *buf, size_t count, off_t offset)
+{
+	int r, bn;
+	off_t pos;
+	char *blk;
+
+	if (offset < 0 || offset + count > MAXFILESIZE)
+		return -E_INVAL;
+
+	// Extend file if necessary
+	if (offset + count > f->f_size)
+		if ((r = file_set_size(f, offset + count)) < 0)
+			return r;
+
+	for (pos = offset; pos < offset + count; ) {
+		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+			return r;
+		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		// A block we overwrite whole needn't be read in first
+		if (bn == BLKSIZE && !va_is_mapped(blk)
+		    && (r = sys_page_alloc(0, blk, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if ((r = bc_unshare(blk)) < 0)
+			return r;
+		memmove(blk + pos % BLKSIZE, buf, bn);
+		pos += bn;
+		buf += bn;
+	}
 
+	return count;
+}
+
+// Remove a block from file f.  If it's not there, just silently succeed.
+// Returns 0 on success, < 0 on error.
+static int
+file_free_block(struct File *f, uint32_t filebno)
+{
+	int r;
+	uint32_t *ptr;
+
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+		return r == -E_NOT_FOUND ? 0 : r;
+	if (*ptr) {
+		free_block(*ptr);
+		*ptr = 0;
+	}
+	return 0;
+}
+
+// Remove any blocks currently used by file 'f',
+// but not necessary for a file of size 'newsize'.
+// For both the old and new sizes, figure out the number of blocks required,
+// and then clear the blocks from new_nblocks to old_nblocks.
+// If the new_nblocks is no more than NDIRECT, and the indirect block has
+// been allocated (f->f_indirect != 0), then free the indirect block too.
+// (Remember to clear the f->f_indirect pointer so you'll know
+// whether it's valid!)
+static void
+file_truncate_blocks(struct File *f, off_t newsize)
+{
+	int r;
+	uint32_t bno, old_nblocks, new_nblocks;
+
+	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+	for (bno = new_nblocks; bno < old_nblocks; bno++)
+		if ((r = file_free_block(f, bno)) < 0)
+			cprintf("warning: file_free_block: %e", r);
+
+	if (new_nblocks <= NDIRECT && f->f_indirect) {
+		free_block(f->f_indirect);
+		f->f_indirect = 0;
+	}
+}
+
+// Set the size of file f, truncating or extending as necessary.
+int
+file_set_size(struct File *f, off_t newsize)
+{
+	if (newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
+	if (f->f_size > newsize)
+		file_truncate_blocks(f, newsize);
+	f->f_size = newsize;
+	return 0;
+}
+
+// Sync the entire file system.  A big hammer.
+void
+fs_sync(void)
+{
+	bc_sync();
+}
@@ -4,6 +4,9 @@
 #define SECTSIZE	512			// bytes per disk sector
 #define BLKSECTS	(BLKSIZE / SECTSIZE)	// sectors per block
 
+// Most blocks fs_sync writes with one ide_write (256 sectors at most)
+#define BC_MAXRUN	(256 / BLKSECTS)
+
 /* Disk block n, when in memory, is mapped into the file system
  * server's address space at DISKMAP + (n*BLKSIZE). */
 #define DISKMAP		0x10000000
@@ -25,6 +28,8 @@ void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+int	bc_unshare(void *va);
+void	bc_sync(void);
 void	bc_init(void);
 
 /* fs.c */
@@ -41,6 +46,7 @@ void	fs_sync(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
+void	free_block(uint32_t blockno);
 int	alloc_block(void);
 
 /* test.c */
@@ -11,6 +11,8 @@
 
 #define debug 0
 
+#define SYNCPERIOD	1000	// ms between write-backs of dirty blocks
+
 // The file system server maintains three structures
 // for each open file.
 //
@@ -46,13 +48,20 @@ struct OpenFile opentab[MAXOPEN] = {
 };
 
 // Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// The data pages of a large request follow, up to DISKMAP.
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - (1 + FSLARGE_MAXPAGES) * PGSIZE);
+
+// Our registration's generation, which every open Fd carries, so that
+// clients can tell our files from those of a file server before us
+uint32_t fsgen;
 
 void
 serve_init(void)
 {
 	int i;
 	uintptr_t va = FILEVA;
+
+	ipc_find_service(ENV_TYPE_FS, &fsgen);
 	for (i = 0; i < MAXOPEN; i++) {
 		opentab[i].o_fileid = i;
 		opentab[i].o_fd = (struct Fd*) va;
@@ -124,16 +133,33 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	}
 	fileid = r;
 
-	if (req->req_omode != 0) {
-		if (debug)
-			cprintf("file_open omode 0x%x unsupported", req->req_omode);
-		return -E_INVAL;
+	// Open the file
+	if (req->req_omode & O_CREAT) {
+		if ((r = file_create(path, &f)) < 0) {
+			if (!(req->req_omode & O_EXCL) && r == -E_FILE_EXISTS)
+				goto try_open;
+			if (debug)
+				cprintf("file_create failed: %e", r);
+			return r;
+		}
+		if (req->req_omode & O_MKDIR)
+			f->f_type = FTYPE_DIR;
+	} else {
+try_open:
+		if ((r = file_open(path, &f)) < 0) {
+			if (debug)
+				cprintf("file_open failed: %e", r);
+			return r;
+		}
 	}
 
-	if ((r = file_open(path, &f)) < 0) {
-		if (debug)
-			cprintf("file_open failed: %e", r);
-		return r;
+	// Truncate
+	if (req->req_omode & O_TRUNC) {
+		if ((r = file_set_size(f, 0)) < 0) {
+			if (debug)
+				cprintf("file_set_size failed: %e", r);
+			return r;
+		}
 	}
 
 	// Save the file pointer
@@ -141,6 +167,7 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
+	o->o_fd->fd_file.gen = fsgen;
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
@@ -157,6 +184,24 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 }
 
 
+// Set the size of req->req_fileid to exactly set_size->req_size bytes,
+// truncating or extending the file as necessary.
+int
+serve_set_size(envid_t envid, struct Fsreq_set_size *req)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_set_size %08x %08x %08x\n", envid, req->req_fileid, req->req_size);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	return file_set_size(o->o_file, req->req_size);
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -191,6 +236,108 @@ serve_read(envid_t envid, union Fsipc *ipc)
 
 
 
+// Read at most req->req_n bytes from req->req_fileid into the 'npages'
+// data pages that came after the request, at the current seek position.
+// Returns the number of bytes read, or < 0 on error.
+int
+serve_read_large(envid_t envid, struct Fsreq_read *req, size_t npages)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_large %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((r = file_read(o->o_file, (char *) fsreq + PGSIZE,
+			   MIN(req->req_n, npages * PGSIZE),
+			   o->o_fd->fd_offset)) < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Write req->req_n bytes from req->req_buf to req_fileid, starting at
+// the current seek position, and update the seek position
+// accordingly.  Extend the file if necessary.  Returns the number of
+// bytes written, or < 0 on error.
+int
+serve_write(envid_t envid, struct Fsreq_write *req)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_write %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	if ((r = file_write(o->o_file, req->req_buf,
+			    MIN(req->req_n, sizeof(req->req_buf)),
+			    o->o_fd->fd_offset)) < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Write req->req_n bytes from the 'npages' data pages that came after
+// the request to req->req_fileid, at the current seek position.
+// Returns the number of bytes written, or < 0 on error.
+int
+serve_write_large(envid_t envid, struct Fsreq_write *req, size_t npages)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_write_large %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	if ((r = file_write(o->o_file, (char *) fsreq + PGSIZE,
+			    MIN(req->req_n, npages * PGSIZE),
+			    o->o_fd->fd_offset)) < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Map the block cache page holding the page of req->req_fileid at
+// page-aligned offset req->req_offset into the caller, read-only, so
+// that programs can be paged in without copying (see lib/pager.c).
+// This is our own copy of the block, so the caller must not rely on
+// what follows the end of the file in it.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE
+	    || req->req_offset >= o->o_file->f_size)
+		return -E_INVAL;
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+
+	// Fault the block into the cache before handing it out
+	(void) *(volatile char *) blk;
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return 0;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -214,13 +361,22 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 }
 
 
-// Our read-only file system do nothing for flush
+// Nothing to do when a file is closed: its dirty blocks go back to
+// disk with the rest, on the syncer's next FSREQ_SYNC or a sync().
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
 {
 	return 0;
 }
 
+// Write all dirty blocks back to disk.
+int
+serve_sync(envid_t envid, union Fsipc *req)
+{
+	fs_sync();
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -229,41 +385,81 @@ fshandler handlers[] = {
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
+	[FSREQ_WRITE] =		(fshandler)serve_write,
+	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
+	[FSREQ_SYNC] =		serve_sync,
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
 void
 serve(void)
 {
+	struct IpcSeg reply, window = { fsreq, 1 + FSLARGE_MAXPAGES, 0 };
 	uint32_t req, whom;
-	int perm, r;
+	int r, rperm;
+	size_t npages;
 	void *pg;
 
+	// Each reply goes out with the wait for the next request
+	whom = 0;
+	r = rperm = 0;
+	pg = NULL;
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		reply = (struct IpcSeg) { pg, 1, rperm };
+		req = ipc_reply_recvv(whom, r, &reply, pg ? 1 : 0,
+				      (int32_t *) &whom, &window, &npages);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
 		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		if (!npages) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
+			whom = 0;
 			continue; // just leave it hanging...
 		}
 
 		pg = NULL;
+		rperm = 0;
 		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &rperm);
+		} else if (req == FSREQ_MAP) {
+			r = serve_map(whom, (struct Fsreq_map*)fsreq, &pg, &rperm);
+		} else if (req == FSREQ_READ_LARGE) {
+			r = serve_read_large(whom, &fsreq->read, npages - 1);
+		} else if (req == FSREQ_WRITE_LARGE) {
+			r = serve_write_large(whom, &fsreq->write, npages - 1);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		sys_page_unmap_range(0, fsreq, npages * PGSIZE);
+	}
+}
+
+// Fork off an env that asks us for an FSREQ_SYNC every SYNCPERIOD ms,
+// so dirty blocks reach the disk without any write waiting for it.
+// This happens before fs_init, while there's no block cache to copy.
+static void
+start_syncer(void)
+{
+	static union Fsipc syncreq __attribute__((aligned(PGSIZE)));
+	envid_t fsenv = sys_getenvid(), r;
+	uint32_t never = 0;
+
+	if ((r = fork()) < 0)
+		panic("fork syncer: %e", r);
+	if (r > 0)
+		return;
+
+	binaryname = "fs-sync";
+	while (1) {
+		sys_futex_wait(&never, 0, SYNCPERIOD);
+		ipc_call(fsenv, FSREQ_SYNC, &syncreq, PTE_P|PTE_U|PTE_W,
+			 NULL, NULL);
 	}
 }
 
@@ -279,7 +475,9 @@ umain(int argc, char **argv)
 	cprintf("FS can do I/O\n");
 
 	serve_init();
+	start_syncer();
 	fs_init();
+	fs_test();
 	serve();
 }
 
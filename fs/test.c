@@ -0,0 +1,65 @@
+// Checks of the write-back block cache against what's on the disk,
+// run once at startup before we serve any requests.
+
+#include "fs.h"
+
+// More blocks than bc_sync writes with one ide_write
+#define NTEST	(BC_MAXRUN + 8)
+
+static char diskbuf[BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+// Check that block 'blockno' on the disk matches the block cache.
+static void
+check_disk(uint32_t blockno)
+{
+	int r;
+
+	if ((r = ide_read(blockno * BLKSECTS, diskbuf, BLKSECTS)) < 0)
+		panic("ide_read block %d: %e", blockno, r);
+	if (memcmp(diskbuf, diskaddr(blockno), BLKSIZE) != 0)
+		panic("block %d on disk doesn't match the cache", blockno);
+}
+
+void
+fs_test(void)
+{
+	uint32_t blocks[NTEST];
+	int i, r;
+
+	// Dirty a run of newly allocated blocks, which bc_sync should
+	// write out, in pieces of at most BC_MAXRUN blocks
+	for (i = 0; i < NTEST; i++) {
+		if ((r = alloc_block()) < 0)
+			panic("alloc_block: %e", r);
+		blocks[i] = r;
+		memset(diskaddr(blocks[i]), i + 1, BLKSIZE);
+		assert(va_is_dirty(diskaddr(blocks[i])));
+	}
+	bc_sync();
+	for (i = 0; i < NTEST; i++) {
+		assert(!va_is_dirty(diskaddr(blocks[i])));
+		check_disk(blocks[i]);
+	}
+	cprintf("bc_sync is good\n");
+
+	// flush_block writes just the one block
+	strcpy(diskaddr(blocks[0]), "flush_block");
+	assert(va_is_dirty(diskaddr(blocks[0])));
+	assert(!va_is_dirty(diskaddr(blocks[1])));
+	flush_block(diskaddr(blocks[0]));
+	assert(!va_is_dirty(diskaddr(blocks[0])));
+	check_disk(blocks[0]);
+	cprintf("flush_block is good\n");
+
+	// Dropping a block from the cache and faulting it back in reads
+	// what was written
+	sys_page_unmap(0, diskaddr(blocks[0]));
+	assert(!va_is_mapped(diskaddr(blocks[0])));
+	assert(strcmp(diskaddr(blocks[0]), "flush_block") == 0);
+	assert(!va_is_dirty(diskaddr(blocks[0])));
+	cprintf("block cache reread is good\n");
+
+	for (i = 0; i < NTEST; i++)
+		free_block(blocks[i]);
+	bc_sync();
+}
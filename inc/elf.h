@@ -52,6 +52,7 @@ struct Secthdr {
 #define ELF_PROG_FLAG_EXEC	1
 #define ELF_PROG_FLAG_WRITE	2
 #define ELF_PROG_FLAG_READ	4
+#define ELF_PROG_FLAG_EAGER	0x00100000	// JOS: never demand paged
 
 // Values for Secthdr::sh_type
 #define ELF_SHT_NULL		0
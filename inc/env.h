@@ -47,6 +47,17 @@ enum EnvType {
 	ENV_TYPE_FLEX,		// FlexSC thread
 };
 
+// The kernel's table of servers, mapped read-only at USERVICES and
+// indexed by the env type they serve (the types before ENV_TYPE_FLEX).
+// sv_gen goes up whenever a type's server comes or goes, and is odd
+// while the kernel is changing the entry.
+#define NSERVICE	ENV_TYPE_FLEX
+
+struct Service {
+	envid_t sv_env;		// The registered server, or 0
+	uint32_t sv_gen;	// Changes whenever sv_env does
+};
+
 // Scheduling Priorities
 enum EnvPriority {
    ENV_PR_HIGHEST = 1,
@@ -56,6 +67,28 @@ enum EnvPriority {
    ENV_PR_LOWEST
 };
 
+// IPC mailboxes: messages sent while the receiver isn't blocked in
+// sys_ipc_recv wait in its queue, oldest first.  Once the queue is
+// full, sys_ipc_send blocks its caller on the receiver's list of
+// waiting senders.
+#define IPC_QMAX		16	// Slots in every env's queue
+#define IPC_QDEPTH		4	// Slots a new env may use
+
+struct IpcMsg {
+	envid_t im_from;		// envid of the sender
+	uint32_t im_value;		// Data value sent
+	struct PageInfo *im_page;	// Page sent (holding a reference), or NULL
+	int im_perm;			// Perm for im_page
+	uint32_t im_npages;		// Pages sent: 0, 1 (im_page) or more
+	struct PageInfo *im_run;	// If more, page of their struct IpcPages
+};
+
+// One page of a multi-page message, holding a reference
+struct IpcPage {
+	struct PageInfo *ip_page;
+	int ip_perm;
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -75,13 +108,40 @@ struct Env {
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
+	uint32_t env_ipc_dstmax;	// Pages we'll take there
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	uint32_t env_ipc_npages;	// Pages mapped at env_ipc_dstva
+	struct IpcMsg env_ipc_queue[IPC_QMAX];	// Messages waiting for us
+	uint8_t env_ipc_qhead;		// Index of the oldest message
+	uint8_t env_ipc_qlen;		// Messages in the queue
+	uint8_t env_ipc_qdepth;		// Messages allowed before sends fail
+	struct IpcMsg env_ipc_sendmsg;	// Message we're blocked sending
+	envid_t env_ipc_sendto;		// Env we're blocked sending to, or 0
+	bool env_ipc_calling;		// ... and then will wait for a reply
+	envid_t env_ipc_callee;		// Blocked for a reply from this env only
+	struct Env *env_ipc_sendnext;	// Next sender blocked on the same env
+	struct Env *env_ipc_waithead;	// Senders blocked on our full queue,
+	struct Env *env_ipc_waittail;	//   oldest first
+
+	// Notifications (see sys_env_notify)
+	uint32_t env_notify_pending;	// Bits posted to us, not yet taken
+	uint32_t env_notify_waiting;	// Bits we're blocked waiting for
+
+	// Futex wait (see kern/futex.c)
+	physaddr_t env_futex_pa;	// Word we're asleep on, or 0
+	uint32_t env_futex_deadline;	// time_msec() to give up at, or 0
+	struct Env *env_futex_next;	// Next waiter in the same bucket
 
    // Lab 4 Challenge: Fixed priority scheduling
    enum EnvPriority env_priority;
 
+   // Memory accounting
+   uint32_t env_npages;       // User pages mapped below UTOP
+   uint32_t env_page_limit;   // Most pages the alloc and map syscalls
+                              // may bring it to, or 0 for no limit
+
    // FlexSC
    struct FscPage *scpage;    // Page where syscalls will be posted on
    struct Env *link;          // Links user process and its syscall thread
@@ -33,6 +33,9 @@ enum {
 
    // FlexSC
 	E_BLOCKED	,	// Used by FlexSC only: we're blocked on I/O
+
+	E_WOULD_BLOCK	,	// Nonblocking operation would have had to wait
+	E_TIMEOUT	,	// Wait timed out
 	MAXERROR
 };
 
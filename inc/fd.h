@@ -25,10 +25,12 @@ struct Dev {
 
 struct FdFile {
 	int id;
+	uint32_t gen;	// sv_gen of the file server that opened it
 };
 
 struct FdSock {
 	int sockid;
+	uint32_t gen;	// sv_gen of the network server that made it
 };
 
 struct Fd {
@@ -50,6 +52,9 @@ struct Stat {
 	struct Dev *st_dev;
 };
 
+// Bytes of data pages each fd may map from fd2data(fd) on
+#define FDDATASIZE	(32 * PGSIZE)
+
 char*	fd2data(struct Fd *fd);
 int	fd2num(struct Fd *fd);
 int	fd_alloc(struct Fd **fd_store);
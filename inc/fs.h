@@ -70,9 +70,19 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns the file's block cache page, read-only
+	FSREQ_MAP,
+	// A large read passes a Fsreq_read followed by up to
+	// FSLARGE_MAXPAGES writable pages, and the data is read into them
+	FSREQ_READ_LARGE,
+	// A large write passes a Fsreq_write followed by up to
+	// FSLARGE_MAXPAGES pages holding the data
+	FSREQ_WRITE_LARGE
 };
 
+#define FSLARGE_MAXPAGES	256	// Most data pages in a large request
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -108,6 +118,10 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -21,6 +21,7 @@
 #include <inc/fd.h>
 #include <inc/args.h>
 #include <inc/malloc.h>
+#include <inc/ring.h>
 #include <inc/ns.h>
 #include <inc/flexsc.h>
 
@@ -32,8 +33,14 @@ void	umain(int argc, char **argv);
 // libmain.c or entry.S
 extern const char *binaryname;
 extern const volatile struct Env *thisenv;
+
+// Thread-local variables live in pages of their own, which every thread
+// created with sfork() has a private copy of (see user/user.ld).
+#define THREADLOCAL	__attribute__((section(".tls")))
+extern char tls_start[], tls_end[];
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
+extern const volatile struct Service services[NSERVICE];
 
 // exit.c
 void	exit(void);
@@ -51,15 +58,46 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_page_limit(envid_t env, uint32_t limit);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_large(envid_t env, void *va, int perm);
+int	sys_page_alloc_range(envid_t env, void *va, size_t len, int perm);
+int	sys_page_map_range(envid_t src_env, void *src_va,
+			   envid_t dst_env, void *dst_va, size_t len);
+int	sys_page_unmap_range(envid_t env, void *va, size_t len);
+int	sys_page_protect_range(envid_t env, void *va, size_t len, int perm);
+int	sys_page_map_batch(envid_t src_env, envid_t dst_env,
+			   const struct PageMapReq *reqs, size_t n);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
+int	sys_ipc_sendv(envid_t to_env, uint32_t value, const struct IpcSeg *segs,
+		      size_t nsegs);
+int	sys_ipc_callv(envid_t to_env, uint32_t value, const struct IpcSeg *segs,
+		      size_t nsegs, const struct IpcSeg *dst);
+int	sys_ipc_reply_waitv(envid_t to_env, uint32_t value,
+			    const struct IpcSeg *segs, size_t nsegs,
+			    const struct IpcSeg *dst);
+int	sys_ipc_set_queue(unsigned depth);
+int	sys_env_notify(envid_t env, uint32_t bits);
+int	sys_notify_wait(uint32_t mask);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected,
+		       uint32_t timeout);
+int	sys_futex_wake(volatile uint32_t *addr, uint32_t n);
+int	sys_page_give(volatile uint32_t *addr, void *srcva, int perm);
+int	sys_page_take(volatile uint32_t *addr, void *dstva);
+int	sys_service_register(enum EnvType type);
 int   sys_env_set_priority(envid_t env, int priority);
 int   sys_net_send_pckt(void *src, uint32_t len);
 int   sys_net_recv_pckt(void *dstva);
@@ -102,13 +140,31 @@ sys_exofork(void)
 }
 
 // ipc.c
+// lib/file.c and lib/nsipc.c keep the data pages of their large
+// requests at these addresses between calls (see ipc_buffer).
+#define FSBIGBUF	0xE0000000
+#define NSBIGBUF	(FSBIGBUF + PTSIZE)
+
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t ipc_callv(envid_t to_env, uint32_t value, const struct IpcSeg *segs,
+		  size_t nsegs, const struct IpcSeg *dst, size_t *npages_store);
+int32_t ipc_reply_recvv(envid_t to_env, uint32_t value,
+			const struct IpcSeg *segs, size_t nsegs,
+			envid_t *from_env_store, const struct IpcSeg *dst,
+			size_t *npages_store);
+int	ipc_buffer(void *va, size_t npages);
 envid_t	ipc_find_env(enum EnvType type);
+envid_t	ipc_find_service(enum EnvType type, uint32_t *gen_store);
 
 // fork.c
 #define	PTE_SHARE	0x400
 envid_t	fork(void);
+envid_t	ufork(void);	// Copy-on-write fork done in user space
 envid_t	sfork(void);	// Challenge!
 
 // fd.c
@@ -124,6 +180,7 @@ int	stat(const char *path, struct Stat *statbuf);
 
 // file.c
 int	open(const char *path, int mode);
+int	read_map(int fd, off_t offset, void *dstva);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
@@ -154,6 +211,31 @@ int     nsipc_socket(int domain, int type, int protocol);
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
 
+// pager.c
+// spawn leaves the file-backed pages of a program unmapped, to be paged
+// in on first touch, and describes them in a struct PagerMap at PAGERMAP.
+#define PAGERMAP	(PFTEMP - 4 * PGSIZE)	// struct PagerMap, read-only
+#define PAGERFD		(PAGERMAP + PGSIZE)	// Fd page keeping the file open
+#define PAGERREQ	(PAGERMAP + 2 * PGSIZE)	// Request to the file server
+#define PAGERTEMP	(PAGERMAP + 3 * PGSIZE)	// Block cache page received
+#define PAGER_MAXSEGS	8
+
+struct PagerSeg {
+	uintptr_t ps_va;	// Page-aligned start of the segment
+	size_t ps_filesz;	// Bytes from the file, starting at ps_va
+	off_t ps_offset;	// File offset of ps_va (page-aligned)
+	int ps_perm;		// PTE_P | PTE_U, plus PTE_W if writable
+};
+
+struct PagerMap {
+	uint32_t pm_fsgen;	// The program file's fd_file.gen
+	int pm_fileid;		// The program's open file
+	int pm_nsegs;
+	struct PagerSeg pm_segs[PAGER_MAXSEGS];
+};
+
+void	pager_init(void);
+
 // console.c
 void	cputchar(int c);
 int	getchar(void);
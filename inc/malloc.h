@@ -2,6 +2,37 @@
 #define JOS_INC_MALLOC_H 1
 
 void *malloc(size_t size);
+void *calloc(size_t nmemb, size_t size);
+void *realloc(void *addr, size_t size);
 void free(void *addr);
 
+// Size classes are 16 << i bytes; bigger allocations are "large",
+// counted in the last slot.
+#define MALLOC_NCLASS		7
+#define MALLOC_SITE_DEPTH	4	// Return addresses kept per call site
+
+struct MallocStats {
+	size_t ms_live[MALLOC_NCLASS + 1];	// Live allocations per class
+	size_t ms_live_bytes[MALLOC_NCLASS + 1];// ... and their rounded-up bytes
+	size_t ms_in_use;		// Bytes handed out, rounded up
+	size_t ms_peak;			// High-water mark of ms_in_use
+	size_t ms_mapped_pages;		// Pages mapped for the heap
+	size_t ms_cached_pages;		// ... of which are free and cached
+	uint32_t ms_nmalloc;		// Successful mallocs
+	uint32_t ms_nfree;		// Frees
+	uint32_t ms_nfail;		// Failed mallocs
+};
+
+// A call site seen by malloc_profile's sampling
+struct MallocSite {
+	uintptr_t pc[MALLOC_SITE_DEPTH];	// Return addresses, innermost first
+	uint32_t count;			// Sampled allocations
+	size_t bytes;			// ... and the bytes they asked for
+};
+
+void malloc_stats(struct MallocStats *ms);
+void malloc_profile(uint32_t every);
+int malloc_sites(struct MallocSite *sites, int n);
+void malloc_stats_dump(int fd);
+
 #endif
@@ -50,7 +50,7 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |  RO ENVS (services at top)   | R-/R-  PTSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -123,6 +123,8 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only copy of the service table, in the last page of UENVS
+#define USERVICES	(UENVS + PTSIZE - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -194,7 +196,22 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state (see kern/pmap.c).  pp_order is the order
+	// of the block this page heads; pp_flags holds the PP_* bits below.
+	uint8_t pp_order;
+	uint8_t pp_flags;
 };
 
+// Values of pp_flags in struct PageInfo
+#define PP_BUDDYFREE	0x01	// Page heads a free block in the buddy pool
+
+// Physical pages whose page numbers agree modulo PAGE_NCOLORS have the
+// same "color": they fall in the same sets of a physically indexed
+// cache.  The kernel gives a page the color of the virtual page it is
+// allocated for, so pages that are contiguous in virtual memory don't
+// compete for cache sets.
+#define PAGE_NCOLORS	16
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
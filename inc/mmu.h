@@ -65,6 +65,7 @@
 #define PTE_PS		0x080	// Page Size
 #define PTE_G		0x100	// Global
 #define PTE_SHARE   0x400  // This enables sharing of pages from kernel to user
+#define PTE_COW     0x800  // Copy-on-write; resolved by the kernel on a write fault
 
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
 // hardware, so user processes are allowed to set them arbitrarily.
@@ -97,6 +98,9 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// CPUID leaf 1 feature flags (in EDX)
+#define CPUID_PSE	0x00000008	// Page Size Extensions
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
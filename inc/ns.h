@@ -26,6 +26,10 @@ enum {
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
+	// These pass a Nsreq_send or Nsreq_recv followed by up to
+	// NSLARGE_MAXPAGES pages holding the data, with req_buf unused
+	NSREQ_SEND_LARGE,
+	NSREQ_RECV_LARGE,
 
 	// The following two messages pass a page containing a struct jif_pkt
 	NSREQ_INPUT,
@@ -37,6 +41,8 @@ enum {
 	NSREQ_TIMER,
 };
 
+#define NSLARGE_MAXPAGES	256	// Most data pages in a large request
+
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
@@ -0,0 +1,48 @@
+#ifndef JOS_INC_RING_H
+#define JOS_INC_RING_H 1
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// Shared-memory rings of fixed-size slots between environments.  A ring
+// is a header page followed by the slot pages, all mapped PTE_SHARE so
+// fork and spawn pass it on.  Producers copy messages in and the one
+// consumer copies them out without any system call; only a side that
+// finds the ring full or empty sleeps, in sys_notify_wait, until the
+// other side posts RING_NOTIFY to it.
+
+#define RING_MPSC	0x1	// Any number of producers (else just one)
+
+#define RING_MAXSLOTS	512	// Most slots in a ring
+#define RING_NWAIT	8	// Producers that can sleep on a full ring
+#define RING_NOTIFY	0x1	// Notification bit rings wake sleepers with
+
+struct RingHdr;
+
+// One env's handle on a ring; the layout is read from the header once
+// so a misbehaving peer can't move our copies out of the ring.
+struct Ring {
+	struct RingHdr *r_hdr;
+	uint8_t *r_slots;		// First slot page
+	uint32_t r_slotsize;		// Bytes per slot
+	uint32_t r_mask;		// Slots - 1
+	uint32_t r_npages;		// Pages, header included
+	int r_flags;
+};
+
+// Pages a ring with these slots takes, header included
+#define RING_NPAGES(slotsize, nslots) \
+	(1 + ROUNDUP((slotsize) * (nslots), PGSIZE) / PGSIZE)
+
+int	ring_create(struct Ring *r, void *va, size_t slotsize, size_t nslots,
+		    int flags);
+int	ring_attach(struct Ring *r, void *va);
+int	ring_share(struct Ring *r, envid_t dst);
+int	ring_accept(struct Ring *r, void *va, envid_t *from_env_store);
+size_t	ring_maxmsg(struct Ring *r);
+int	ring_try_send(struct Ring *r, const void *msg, size_t len);
+int	ring_send(struct Ring *r, const void *msg, size_t len);
+int	ring_try_recv(struct Ring *r, void *buf, size_t len);
+int	ring_recv(struct Ring *r, void *buf, size_t len);
+
+#endif	// !JOS_INC_RING_H
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -21,9 +23,52 @@ enum {
    SYS_net_send_pckt,
    SYS_net_recv_pckt,
    SYS_env_set_priority,   // Challenge
+   SYS_page_alloc_large,
+   SYS_page_alloc_range,
+   SYS_page_map_range,
+   SYS_page_unmap_range,
+   SYS_page_protect_range,
+   SYS_page_map_batch,
+   SYS_fork,
+   SYS_env_set_page_limit,
+   SYS_ipc_set_queue,
+   SYS_ipc_send,
+   SYS_ipc_call,
+   SYS_ipc_reply_wait,
+   SYS_env_notify,
+   SYS_notify_wait,
+   SYS_futex_wait,
+   SYS_futex_wake,
+   SYS_ipc_sendv,
+   SYS_ipc_callv,
+   SYS_ipc_reply_waitv,
+   SYS_page_give,
+   SYS_page_take,
+   SYS_service_register,
    FLEXSC_register,        // FlexSC
    FLEXSC_wait,            // FlexSC
 	NSYSCALLS
 };
 
+// One mapping for sys_page_map_batch, with the meaning of the
+// matching sys_page_map arguments.
+struct PageMapReq {
+	void *srcva;
+	void *dstva;
+	int perm;
+};
+
+#define PAGEMAP_BATCH_MAX	256	// Most requests per sys_page_map_batch
+
+// A run of 'npages' pages starting at 'va', for the multi-page IPC
+// calls.  A run sent goes with 'perm'; a run received into is where
+// the pages sent are mapped, and its perm is ignored.
+struct IpcSeg {
+	void *va;
+	size_t npages;
+	int perm;
+};
+
+#define IPC_MAXPAGES		512	// Most pages in one message
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -293,4 +293,18 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically set *addr to newval if it holds oldval.
+// Returns the value *addr held before.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (oldval) :
+			"cc", "memory");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -23,6 +23,9 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	pde_t *cpu_pgdir;               // Page directory loaded in CR3
+	volatile uint32_t cpu_tlb_flush;     // Another CPU changed cpu_pgdir
+	volatile uint32_t cpu_interruptible; // Out of the kernel, can take IPIs
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +45,6 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
 
 #endif
@@ -16,8 +16,13 @@
 #include <kern/spinlock.h>
 #include <kern/e1000.h>
 #include <kern/flexsc.h>
+#include <kern/futex.h>
 
 struct Env *envs = NULL;		// All environments
+struct Service *services = NULL;	// Servers by env type
+static envid_t service_last[NSERVICE];	// Last server of each type
+
+static void check_service(void);
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
@@ -146,6 +151,8 @@ env_init(void)
 
    env_free_list = envs;
 
+   check_service();
+
 	// Per-CPU part of the initialization
 	env_init_percpu();
 }
@@ -263,12 +270,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 {
 	int32_t generation;
 	int r;
-	struct Env *e;
+	struct Env *e, *parent;
 
 	if (!(e = env_free_list))
    	return -E_NO_FREE_ENV;
 
 	// Allocate and set up the page directory for this environment.
+	e->env_npages = 0;
 	if ((r = env_setup_vm(e)) < 0)
 		return r;
 
@@ -287,6 +295,11 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
    // Lab4 Challenge: fixed priority scheduling
    e->env_priority = ENV_PR_MEDIUM;
 
+   // Children live under their parent's page limit
+   e->env_page_limit = 0;
+   if (parent_id && envid2env(parent_id, &parent, 0) == 0)
+      e->env_page_limit = parent->env_page_limit;
+
 	// Clear out all the saved register state,
 	// to prevent the register values
 	// of a prior environment inhabiting this Env structure
@@ -315,8 +328,17 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag and empty the mailbox.
 	e->env_ipc_recving = 0;
+	e->env_ipc_qhead = 0;
+	e->env_ipc_qlen = 0;
+	e->env_ipc_qdepth = IPC_QDEPTH;
+	e->env_ipc_sendto = 0;
+	e->env_ipc_calling = 0;
+	e->env_ipc_callee = 0;
+	e->env_ipc_waithead = e->env_ipc_waittail = NULL;
+	e->env_notify_pending = e->env_notify_waiting = 0;
+	e->env_futex_pa = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -351,7 +373,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 
    for (; cur_va < end; cur_va+=PGSIZE) {
       // Allocate a page
-      if (!(page = page_alloc(0)))
+      if (!(page = page_alloc_va(0, (void *)cur_va)))
          panic("region_alloc: %e\n", -E_NO_MEM);
       
       // Insert and map it in pgdir 
@@ -361,6 +383,28 @@ region_alloc(struct Env *e, void *va, size_t len)
    }
 }
 
+//
+// Map the shared zero page copy-on-write over [va, va+len) of env's
+// address space, leaving any pages already mapped there alone.
+// Panic if a page table can't be allocated.
+//
+static void
+region_alloc_zero(struct Env *e, void *va, size_t len)
+{
+   uintptr_t cur_va, end;
+
+   cur_va = (uintptr_t)ROUNDDOWN(va, PGSIZE);
+   end = (uintptr_t)ROUNDUP((uintptr_t)va + len, PGSIZE);
+
+   for (; cur_va < end; cur_va += PGSIZE) {
+      if (page_lookup(e->env_pgdir, (void *)cur_va, NULL))
+         continue;
+      if (page_insert_zero(e->env_pgdir, (void *)cur_va,
+          PTE_U | PTE_W | PTE_P) != 0)
+         panic("region_alloc_zero: %e\n", -E_NO_MEM);
+   }
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -419,7 +463,7 @@ load_icode(struct Env *e, uint8_t *binary)
    struct Elf *elfh = (struct Elf *)binary;
    struct Proghdr *cur_ph, *end;
    struct PageInfo *page;
-   uint8_t *sect;
+   uint8_t *sect, *va;
 
    // Check for valid ELF
    if (elfh->e_magic != ELF_MAGIC)
@@ -430,18 +474,25 @@ load_icode(struct Env *e, uint8_t *binary)
    end = cur_ph + elfh->e_phnum;
 
    // Switch to the env pgdir so we can directly copy to it
-   lcr3(PADDR(e->env_pgdir));
+   pgdir_load(e->env_pgdir);
    for (; cur_ph < end; cur_ph++) {
       if (cur_ph->p_type == ELF_PROG_LOAD) {
 
          sect = binary + cur_ph->p_offset;
-         region_alloc(e, (void *)cur_ph->p_va, cur_ph->p_memsz);
-         memset((void *)cur_ph->p_va, 0, cur_ph->p_memsz);
-         memmove((void *)cur_ph->p_va, sect, cur_ph->p_filesz);
+         va = (uint8_t *)cur_ph->p_va;
+         // Only the pages holding file data need memory of their own;
+         // the rest of the .bss is the zero page until it is written
+         if (cur_ph->p_filesz) {
+            region_alloc(e, va, cur_ph->p_filesz);
+            memset(ROUNDDOWN(va, PGSIZE), 0,
+                   ROUNDUP(va + cur_ph->p_filesz, PGSIZE) - ROUNDDOWN(va, PGSIZE));
+            memmove(va, sect, cur_ph->p_filesz);
+         }
+         region_alloc_zero(e, va, cur_ph->p_memsz);
       }  
    }   
    // Done copying now switch back to kern_pgdir
-   lcr3(PADDR(kern_pgdir));
+   pgdir_load(kern_pgdir);
 
 	// Now map one page for the program's initial stack
 	// at virtual address USTACKTOP - PGSIZE.
@@ -476,10 +527,129 @@ env_create(uint8_t *binary, enum EnvType type)
    if (type == ENV_TYPE_FS)
       e->env_tf.tf_eflags |= FL_IOPL_MASK;
 
+   if (type != ENV_TYPE_USER && (r = service_register(e, type)) < 0)
+      panic("env_create: %e\n", r);
    e->env_type = type;
    load_icode(e, binary); 
 }
 
+// Point sv at 'env'.  sv_gen is odd while we do, and user readers
+// retry until they see the same even sv_gen on both sides of reading
+// sv_env (see ipc_find_service), so they never pair one server with
+// another's generation.
+static void
+service_set(struct Service *sv, envid_t env)
+{
+   sv->sv_gen++;
+   asm volatile("" : : : "memory");
+   sv->sv_env = env;
+   asm volatile("" : : : "memory");
+   sv->sv_gen++;
+}
+
+// Make e the server for 'type' in the service table, and make it that
+// type of env, with that type's privileges: a file server that takes
+// over from another gets I/O privileges, as env_create gives the first.
+// Another live server keeps the slot.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if type isn't a server type.
+//	-E_BAD_ENV if another env is registered for 'type'.
+int
+service_register(struct Env *e, enum EnvType type)
+{
+   struct Service *sv = &services[type];
+
+   if (type <= ENV_TYPE_USER || type >= NSERVICE)
+      return -E_INVAL;
+   if (sv->sv_env && sv->sv_env != e->env_id)
+      return -E_BAD_ENV;
+   if (sv->sv_env != e->env_id) {
+      service_set(sv, e->env_id);
+      service_last[type] = e->env_id;
+   }
+   e->env_type = type;
+   if (type == ENV_TYPE_FS)
+      e->env_tf.tf_eflags |= FL_IOPL_MASK;
+   return 0;
+}
+
+// May e register itself as the server for 'type'?  Only an env that is
+// already that type, as the kernel creates its servers, or a child of
+// the last server of that type, which that server started to succeed
+// it, may.  Anything else could take over a free slot.
+bool
+service_may_register(struct Env *e, enum EnvType type)
+{
+   if (type <= ENV_TYPE_USER || type >= NSERVICE)
+      return false;
+   return e->env_type == type
+      || (service_last[type] && e->env_parent_id == service_last[type]);
+}
+
+// Take e, which is going away, out of the service table.
+static void
+service_unregister(struct Env *e)
+{
+   struct Service *sv = &services[e->env_type];
+
+   if (e->env_type > ENV_TYPE_USER && e->env_type < NSERVICE
+       && sv->sv_env == e->env_id)
+      service_set(sv, 0);
+}
+
+// Check service registration and succession on made-up envs, leaving
+// the table as it was.
+static void
+check_service(void)
+{
+   struct Service saved[NSERVICE];
+   envid_t saved_last[NSERVICE];
+   struct Env server, heir, other;
+   struct Service *sv = &services[ENV_TYPE_FS];
+   uint32_t gen;
+
+   memmove(saved, services, sizeof(saved));
+   memmove(saved_last, service_last, sizeof(saved_last));
+   memset(&server, 0, sizeof(server));
+   memset(&heir, 0, sizeof(heir));
+   memset(&other, 0, sizeof(other));
+   server.env_id = 0x7f001;
+   server.env_type = ENV_TYPE_FS;	// As env_create makes it
+   heir.env_id = 0x7f002;
+   heir.env_parent_id = server.env_id;
+   other.env_id = 0x7f003;
+   other.env_parent_id = 0x7f004;
+   services[ENV_TYPE_FS].sv_env = 0;
+   service_last[ENV_TYPE_FS] = 0;
+
+   // Only the kernel's server can take a free slot to begin with
+   assert(service_may_register(&server, ENV_TYPE_FS));
+   assert(!service_may_register(&heir, ENV_TYPE_FS));
+   assert(!service_may_register(&server, ENV_TYPE_NS));
+   gen = sv->sv_gen;
+   assert(service_register(&server, ENV_TYPE_FS) == 0);
+   assert(sv->sv_env == server.env_id && sv->sv_gen == gen + 2);
+
+   // A live server keeps its slot, even from its child
+   assert(service_may_register(&heir, ENV_TYPE_FS));
+   assert(service_register(&heir, ENV_TYPE_FS) == -E_BAD_ENV);
+
+   // Once it's gone its child takes over, with its privileges, but
+   // nobody else may
+   service_unregister(&server);
+   assert(sv->sv_env == 0 && sv->sv_gen == gen + 4);
+   assert(!service_may_register(&other, ENV_TYPE_FS));
+   assert(service_may_register(&heir, ENV_TYPE_FS));
+   assert(service_register(&heir, ENV_TYPE_FS) == 0);
+   assert(sv->sv_env == heir.env_id && heir.env_type == ENV_TYPE_FS);
+   assert((heir.env_tf.tf_eflags & FL_IOPL_MASK) == FL_IOPL_3);
+   assert(!(sv->sv_gen & 1));
+
+   memmove(services, saved, sizeof(saved));
+   memmove(service_last, saved_last, sizeof(saved_last));
+   cprintf("check_service() succeeded!\n");
+}
+
 // Create a FlexSC kernel thread environment
 void env_create_flex(void *func, uintptr_t arg)
 {
@@ -504,6 +674,81 @@ void env_create_flex(void *func, uintptr_t arg)
    }
 }
 
+//
+// Drops the page references held by an IPC message nobody will receive.
+//
+void
+ipc_msg_free(struct IpcMsg *msg)
+{
+	struct IpcPage *run;
+	uint32_t i;
+
+	if (msg->im_page)
+		page_decref(msg->im_page);
+	if (msg->im_run) {
+		run = page2kva(msg->im_run);
+		for (i = 0; i < msg->im_npages; i++)
+			page_decref(run[i].ip_page);
+		page_decref(msg->im_run);
+	}
+	msg->im_page = msg->im_run = NULL;
+	msg->im_npages = 0;
+}
+
+//
+// Tears down e's part in IPC: drops the pages of messages nobody will
+// receive, takes e off the wait list of the env it was blocked sending
+// to, and fails the sends of envs blocked sending to e.
+//
+static void
+env_ipc_free(struct Env *e)
+{
+	struct Env *dst, **pp, *w;
+
+	for (; e->env_ipc_qlen; e->env_ipc_qlen--) {
+		ipc_msg_free(&e->env_ipc_queue[e->env_ipc_qhead]);
+		e->env_ipc_qhead = (e->env_ipc_qhead + 1) % IPC_QMAX;
+	}
+
+	if (e->env_ipc_sendto) {
+		if (envid2env(e->env_ipc_sendto, &dst, 0) == 0) {
+			w = NULL;
+			for (pp = &dst->env_ipc_waithead; *pp; pp = &(*pp)->env_ipc_sendnext) {
+				if (*pp == e) {
+					*pp = e->env_ipc_sendnext;
+					break;
+				}
+				w = *pp;
+			}
+			if (dst->env_ipc_waittail == e)
+				dst->env_ipc_waittail = w;
+		}
+		ipc_msg_free(&e->env_ipc_sendmsg);
+		e->env_ipc_sendto = 0;
+		e->env_ipc_calling = 0;
+	}
+
+	while ((w = e->env_ipc_waithead)) {
+		e->env_ipc_waithead = w->env_ipc_sendnext;
+		ipc_msg_free(&w->env_ipc_sendmsg);
+		w->env_ipc_sendto = 0;
+		w->env_ipc_calling = 0;
+		w->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		if (w->env_status == ENV_NOT_RUNNABLE)
+			w->env_status = ENV_RUNNABLE;
+	}
+	e->env_ipc_waittail = NULL;
+
+	// Callers waiting for our reply won't get one
+	for (w = envs; w < envs + NENV; w++)
+		if (w->env_ipc_recving && w->env_ipc_callee == e->env_id) {
+			w->env_ipc_recving = 0;
+			w->env_ipc_callee = 0;
+			w->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			w->env_status = ENV_RUNNABLE;
+		}
+}
+
 //
 // Frees env e and all memory it uses.
 //
@@ -518,11 +763,15 @@ env_free(struct Env *e)
 	// before freeing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+		pgdir_load(kern_pgdir);
 
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	env_ipc_free(e);
+	futex_cancel(e);
+	service_unregister(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -531,6 +780,12 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// large pages have no page table to free
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -555,6 +810,9 @@ env_free(struct Env *e)
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
+
+	// Wake anyone in wait() for e
+	futex_wake_kva(&e->env_status);
 }
 
 //
@@ -669,9 +927,14 @@ env_run(struct Env *e)
    curenv = e; 
    curenv->env_status = ENV_RUNNING;
    curenv->env_runs++; 
-	lcr3(PADDR(curenv->env_pgdir));
+	pgdir_load(curenv->env_pgdir);
+
+   // Other CPUs must drop stale mappings before anyone else can
+   // reuse the pages behind them
+   tlb_shootdown();
 
    // Unlock kernel before switching back to user mode
+   xchg(&thiscpu->cpu_interruptible, 1);
    unlock_kernel();
 
    // Run FlexSC kernel thread, does not return
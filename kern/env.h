@@ -7,6 +7,7 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
+extern struct Service *services;	// Servers by env type
 #define curenv (thiscpu->cpu_env)		// Current environment
 #define URBUFMAP 0x0F0D0000   // Receive buffer map in user space
 extern struct Segdesc gdt[];
@@ -17,6 +18,9 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	ipc_msg_free(struct IpcMsg *msg);
+int	service_register(struct Env *e, enum EnvType type);
+bool	service_may_register(struct Env *e, enum EnvType type);
 
 void  env_buf_map(struct Env *e);
 
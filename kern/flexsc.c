@@ -88,6 +88,12 @@ int scthread_spawn(struct Env *parent)
       if (!(page = page_lookup(parent->env_pgdir, addr, &ptEntry)))
          continue;
       perm = *ptEntry & 0xFFF; 
+      if (perm & PTE_PS) {
+         // Large pages are mapped whole, from their first page
+         if (!((uintptr_t)addr & (PTSIZE - 1)))
+            page_insert_large(e->env_pgdir, page, addr, perm & ~PTE_PS);
+         continue;
+      }
       if ((r = page_insert(e->env_pgdir, page, addr, perm)) < 0)
          return r;
    } 
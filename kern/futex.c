@@ -0,0 +1,191 @@
+// Futexes: an env sleeps on a word of user memory until another env
+// wakes it, or a timeout passes.  Waiters are keyed on the physical
+// address of the word, so envs that share a page through PTE_SHARE
+// (or read the kernel's envs[] array) meet on the same key.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+#include <kern/futex.h>
+
+#define FUTEX_HASH(pa)	(PGNUM(pa) % FUTEX_NHASH)
+
+// Waiters in each bucket, oldest first, linked through env_futex_next
+static struct Env *futex_hash[FUTEX_NHASH];
+static uint32_t futex_nwaiting;		// Envs asleep on some futex
+static uint32_t futex_ntimed;		// ... of which have a deadline
+
+// Find the key for 'addr' in curenv's address space.  A copy-on-write
+// page is copied first, so the word doesn't move when someone writes it.
+// Returns 0 on success, -E_INVAL for a bad addr, -E_NO_MEM.
+int
+futex_key(volatile uint32_t *addr, physaddr_t *pa)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	if ((uintptr_t) addr & 3
+	    || user_mem_check(curenv, (void *) addr, sizeof(*addr), PTE_U) < 0)
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pgdir, (void *) addr, &pte)))
+		return -E_INVAL;
+	if (*pte & PTE_COW) {
+		if ((r = page_cow_fault(curenv->env_pgdir, (void *) addr)) < 0)
+			return r;
+		pp = page_lookup(curenv->env_pgdir, (void *) addr, &pte);
+	}
+	*pa = page2pa(pp) + PGOFF(addr);
+	return 0;
+}
+
+// Take the waiter *pp off its list and let it run, returning 'ret'
+// from its sys_futex_wait.
+static void
+futex_unlink(struct Env **pp, int ret)
+{
+	struct Env *e = *pp;
+
+	*pp = e->env_futex_next;
+	e->env_futex_pa = 0;
+	if (e->env_futex_deadline)
+		futex_ntimed--;
+	e->env_futex_deadline = 0;
+	futex_nwaiting--;
+	e->env_tf.tf_regs.reg_eax = ret;
+	e->env_status = ENV_RUNNABLE;
+}
+
+// Put curenv to sleep on 'addr', if it still holds 'expected', for at
+// most 'timeout' milliseconds (0, or 2^31 or more, for no limit).
+// Returns 0 once woken; see sys_futex_wait for the errors.
+int
+futex_wait(volatile uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+	struct Env **pp;
+	physaddr_t pa;
+	int r;
+
+	if ((r = futex_key(addr, &pa)) < 0)
+		return r;
+	if (*addr != expected)
+		return -E_WOULD_BLOCK;
+
+	curenv->env_futex_pa = pa;
+	curenv->env_futex_deadline = 0;
+	if (timeout && timeout < 0x80000000) {
+		curenv->env_futex_deadline = MAX(time_msec() + timeout, 1);
+		futex_ntimed++;
+	}
+	curenv->env_futex_next = NULL;
+	for (pp = &futex_hash[FUTEX_HASH(pa)]; *pp; pp = &(*pp)->env_futex_next)
+		;
+	*pp = curenv;
+	futex_nwaiting++;
+
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
+// Wake up to 'n' waiters on physical address 'pa', oldest first.
+static int
+futex_wake_pa(physaddr_t pa, uint32_t n)
+{
+	struct Env **pp;
+	uint32_t woken = 0;
+
+	pp = &futex_hash[FUTEX_HASH(pa)];
+	while (*pp && woken < n) {
+		if ((*pp)->env_futex_pa == pa) {
+			futex_unlink(pp, 0);
+			woken++;
+		} else
+			pp = &(*pp)->env_futex_next;
+	}
+	return woken;
+}
+
+// Wake up to 'n' envs asleep on 'addr' in curenv's address space.
+// Returns the number woken, or -E_INVAL for a bad addr.
+int
+futex_wake(volatile uint32_t *addr, uint32_t n)
+{
+	physaddr_t pa;
+	int r;
+
+	if ((r = futex_key(addr, &pa)) < 0)
+		return r;
+	return futex_wake_pa(pa, n);
+}
+
+// Wake every env asleep on the kernel word at 'kva', which users see
+// through a read-only mapping such as UENVS.
+void
+futex_wake_kva(volatile void *kva)
+{
+	if (futex_nwaiting)
+		futex_wake_pa(PADDR((void *) kva), ~0);
+}
+
+// Wake every env asleep anywhere in the page at 'pa'.  Called when a
+// mapping of the page goes away, since that changes its reference
+// count, which users like pipes watch.
+void
+futex_wake_page(physaddr_t pa)
+{
+	struct Env **pp;
+
+	if (!futex_nwaiting)
+		return;
+	pp = &futex_hash[FUTEX_HASH(pa)];
+	while (*pp) {
+		if (PGNUM((*pp)->env_futex_pa) == PGNUM(pa))
+			futex_unlink(pp, 0);
+		else
+			pp = &(*pp)->env_futex_next;
+	}
+}
+
+// Wake the waiters whose timeouts have passed.  Called every tick.
+void
+futex_expire(void)
+{
+	struct Env **pp;
+	uint32_t now;
+	int i;
+
+	if (!futex_ntimed)
+		return;
+	now = time_msec();
+	for (i = 0; i < FUTEX_NHASH; i++) {
+		pp = &futex_hash[i];
+		while (*pp) {
+			if ((*pp)->env_futex_deadline
+			    && (int32_t) ((*pp)->env_futex_deadline - now) <= 0)
+				futex_unlink(pp, -E_TIMEOUT);
+			else
+				pp = &(*pp)->env_futex_next;
+		}
+	}
+}
+
+// Take e, which is being freed, off whatever futex it's asleep on.
+void
+futex_cancel(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_futex_pa)
+		return;
+	for (pp = &futex_hash[FUTEX_HASH(e->env_futex_pa)]; *pp;
+	     pp = &(*pp)->env_futex_next)
+		if (*pp == e) {
+			futex_unlink(pp, 0);
+			return;
+		}
+}
@@ -0,0 +1,19 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+#define FUTEX_NHASH	64	// Buckets of waiters, hashed by page
+
+int	futex_key(volatile uint32_t *addr, physaddr_t *pa);
+int	futex_wait(volatile uint32_t *addr, uint32_t expected, uint32_t timeout);
+int	futex_wake(volatile uint32_t *addr, uint32_t n);
+void	futex_wake_kva(volatile void *kva);
+void	futex_wake_page(physaddr_t pa);
+void	futex_expire(void);
+void	futex_cancel(struct Env *e);
+
+#endif /* !JOS_KERN_FUTEX_H */
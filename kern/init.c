@@ -140,6 +140,9 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
+	// (turning on 4MB pages first if the BSP mapped KERNBASE with them)
+	if (pse_enabled)
+		lcr4(rcr4() | CR4_PSE);
 	lcr3(PADDR(kern_pgdir));
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
@@ -13,6 +13,7 @@
 #include <kern/trap.h>
 
 #include <kern/pmap.h>  // For page alloc/free commands
+#include <kern/env.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -31,6 +32,12 @@ static struct Command commands[] = {
    { "page_status", "Check if a page is allocated", page_status },
    { "free_page", "Free a page", free_page },
    { "list_used", "List all used pages and their refs", list_used },
+   { "buddyinfo", "Show buddy allocator free blocks and fragmentation", buddyinfo },
+   { "zeroinfo", "Show pre-zeroed page pool and shared zero page use", zeroinfo },
+   { "tlbinfo", "Show TLB shootdowns sent to other CPUs", tlbinfo },
+   { "mergeinfo", "Show same-page merging; 'mergeinfo on|off' toggles it", mergeinfo },
+   { "envmem", "Show pages mapped by each env and its page limit", envmem },
+   { "colorinfo", "Show free pages of each cache color", colorinfo },
    { "ss", "Make a single step after a breakpoint", ss },
    { "cont", "Continue from a breakpoint", cont }
 };
@@ -165,6 +172,101 @@ int list_used(int argc, char **argv, struct Trapframe *tf) {
    return 0; 
 }
 
+int buddyinfo(int argc, char **argv, struct Trapframe *tf) {
+   struct BuddyStats bs;
+   size_t below = 0, largest = 0;
+   int order;
+
+   buddy_stats(&bs);
+   cprintf("pool %d pages, %d free\n", bs.bs_pool_pages, bs.bs_free_pages);
+   cprintf("order  blocks  unusable%%\n");
+   for (order = 0; order <= BUDDY_MAXORDER; order++) {
+      // Unusable free space index: share of free pages sitting in
+      // blocks too small to satisfy an allocation of this order
+      cprintf("%5d  %6d  %8d\n", order, bs.bs_nfree[order],
+       bs.bs_free_pages ? below * 100 / bs.bs_free_pages : 0);
+      below += bs.bs_nfree[order] << order;
+      if (bs.bs_nfree[order])
+         largest = 1 << order;
+   }
+   cprintf("largest free block %d pages\n", largest);
+   cprintf("allocs %d fails %d splits %d merges %d\n",
+    bs.bs_allocs, bs.bs_fails, bs.bs_splits, bs.bs_merges);
+   return 0;
+}
+
+int zeroinfo(int argc, char **argv, struct Trapframe *tf) {
+   struct PageZeroStats pz;
+   uint32_t total;
+
+   page_zero_stats(&pz);
+   total = pz.pz_hits + pz.pz_misses;
+   cprintf("pre-zeroed pages %d (max %d), %d zeroed while idle\n",
+    pz.pz_npages, PAGE_ZERO_MAX, pz.pz_zeroed);
+   cprintf("ALLOC_ZERO hits %d misses %d (%d%% hit rate)\n",
+    pz.pz_hits, pz.pz_misses, total ? pz.pz_hits * 100 / total : 0);
+   cprintf("shared zero page mapped %d times\n", pz.pz_zero_maps);
+   return 0;
+}
+
+int tlbinfo(int argc, char **argv, struct Trapframe *tf) {
+   struct TlbStats ts;
+
+   tlb_stats(&ts);
+   cprintf("TLB shootdowns %d, %d IPIs sent\n", ts.ts_shootdowns, ts.ts_ipis);
+   return 0;
+}
+
+int mergeinfo(int argc, char **argv, struct Trapframe *tf) {
+   struct PageMergeStats pm;
+
+   if (argc > 1)
+      page_merge_enabled = strcmp(argv[1], "off") != 0;
+
+   page_merge_stats(&pm);
+   cprintf("same-page merging %s, %d passes, %d pages hashed\n",
+    page_merge_enabled ? "on" : "off", pm.pm_passes, pm.pm_scanned);
+   cprintf("%d merged pages mapped %d times, %d pages saved\n",
+    pm.pm_shared, pm.pm_sharing, pm.pm_sharing - pm.pm_shared);
+   cprintf("%d mappings merged, %d onto the zero page\n",
+    pm.pm_merged + pm.pm_zero, pm.pm_zero);
+   return 0;
+}
+
+int envmem(int argc, char **argv, struct Trapframe *tf) {
+   struct Env *e;
+   uint32_t total = 0;
+
+   cprintf("env       type pages  limit\n");
+   for (e = envs; e < envs + NENV; e++) {
+      if (e->env_status == ENV_FREE)
+         continue;
+      cprintf("%08x  %4d %5d  ", e->env_id, e->env_type, e->env_npages);
+      if (e->env_page_limit)
+         cprintf("%5d\n", e->env_page_limit);
+      else
+         cprintf("    -\n");
+      total += e->env_npages;
+   }
+   cprintf("%d pages mapped in all\n", total);
+   return 0;
+}
+
+int colorinfo(int argc, char **argv, struct Trapframe *tf) {
+   struct PageColorStats pc;
+   uint32_t total;
+   int i;
+
+   page_color_stats(&pc);
+   cprintf("color  free  zeroed\n");
+   for (i = 0; i < PAGE_NCOLORS; i++)
+      cprintf("%5d %5d %7d\n", i, pc.pc_nfree[i], pc.pc_nzero[i]);
+   total = pc.pc_hits + pc.pc_misses;
+   cprintf("page_alloc_va got its color %d times, another %d times (%d%%)\n",
+    pc.pc_hits, pc.pc_misses, total ? pc.pc_hits * 100 / total : 0);
+   return 0;
+}
+
 int ss(int argc, char **argv, struct Trapframe *tf) {
 
    // Turn on the trap flag
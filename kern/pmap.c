@@ -10,8 +10,11 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 #include <kern/e1000.h>
 #include <kern/flexsc.h>
+#include <kern/futex.h>
+#include <kern/splice.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -22,6 +25,49 @@ pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
 
+// Once mem_init is done with its checks, free pages are kept on one
+// list per cache color instead (see page_color_init).
+static bool page_colored;
+static struct PageInfo *page_color_list[PAGE_NCOLORS];
+static struct PageInfo *page_zero_list[PAGE_NCOLORS];	// Already zeroed
+static unsigned page_color_next;	// Color for the next unhinted page
+static struct PageColorStats page_color_stat;
+static struct PageZeroStats page_zero_stat;
+static struct PageInfo *zero_page;	// Shared read-only page of zeros
+static uint32_t zero_page_maps;		// References to it, not in pp_ref
+
+// Same-page merging (see page_merge_idle).  The stable table holds the
+// pages merged so far, each with a reference of its own.  The unstable
+// table holds candidates seen during this pass, which are only trusted
+// while they are still mapped write-protected where they were found.
+struct MergeSlot {
+	uint32_t ms_hash;
+	struct PageInfo *ms_page;
+	envid_t ms_envid;		// Unstable only: where ms_page was
+	uintptr_t ms_va;
+};
+static struct MergeSlot merge_stable[PAGE_MERGE_STABLE];
+static struct MergeSlot merge_unstable[PAGE_MERGE_UNSTABLE];
+static uint32_t merge_zero_hash;
+static size_t merge_envx;		// Scan position: env index and va
+static uintptr_t merge_va;
+static struct PageMergeStats page_merge_stat;
+bool page_merge_enabled = 0;	// Off until "mergeinfo on"
+bool pse_enabled;		// 4MB pages are on (CR4_PSE)
+
+// Last env found by pgdir_env()
+static struct Env *pgdir_env_last;
+
+// CPUs each CPU owes a TLB shootdown, sent by tlb_shootdown()
+static uint32_t tlb_pending[NCPU];
+static struct TlbStats tlb_stat;
+
+// Buddy allocator pool, set up in buddy_init().  The pool is the page
+// range [buddy_start, buddy_end), aligned to the largest block size.
+static size_t buddy_start, buddy_end;
+static struct PageInfo *buddy_free_list[BUDDY_MAXORDER + 1];
+static struct BuddyStats buddy_stat;
+
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -65,8 +111,12 @@ static void mem_init_mp(void);
 static void kthrstk_map(void);
 static void buf_map(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
+static void buddy_init(void);
+static void page_color_init(void);
+static void check_buddy(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
@@ -129,6 +179,7 @@ void
 mem_init(void)
 {
 	uint32_t cr0;
+	uint32_t eax, ebx, ecx, edx;
 	size_t n;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
@@ -171,6 +222,10 @@ mem_init(void)
    for (n = 0; n < NENV; n++)
       memset(envs + n, 0, sizeof(struct Env));
 
+   // And the service table, a page of its own
+   services = boot_alloc(PGSIZE);
+   memset(services, 0, PGSIZE);
+
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -183,6 +238,10 @@ mem_init(void)
 	check_page_alloc();
 	check_page();
 
+	// Hand the top of physical memory over to the buddy allocator
+	buddy_init();
+	check_buddy();
+
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
 
@@ -202,9 +261,13 @@ mem_init(void)
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
 
+   static_assert(NENV * sizeof(struct Env) <= USERVICES - UENVS);
    boot_map_region(kern_pgdir, UENVS,
     ROUNDUP(NENV * sizeof(struct Env), PGSIZE),
     PADDR(envs), PTE_U | PTE_P); 
+   static_assert(NSERVICE * sizeof(struct Service) <= PGSIZE);
+   boot_map_region(kern_pgdir, USERVICES, PGSIZE, PADDR(services),
+                   PTE_U | PTE_P);
    
 	//////////////////////////////////////////////////////////////////////
    
@@ -238,8 +301,19 @@ mem_init(void)
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
    
-   boot_map_region(kern_pgdir, KERNBASE, 
-    (0xFFFFFFFF - KERNBASE) + 1, 0x0, PTE_W | PTE_P); 
+   // Use 4MB pages for this if the CPU has PSE, which saves 64 page
+   // tables and lots of TLB entries.  Regions above KERNBASE that get
+   // remapped later are split back into 4KB pages by pgdir_walk.
+   cpuid(1, &eax, &ebx, &ecx, &edx);
+   if (edx & CPUID_PSE) {
+      pse_enabled = 1;
+      lcr4(rcr4() | CR4_PSE);
+      boot_map_region_large(kern_pgdir, KERNBASE,
+       (0xFFFFFFFF - KERNBASE) + 1, 0x0, PTE_W | PTE_P);
+   }
+   else
+      boot_map_region(kern_pgdir, KERNBASE, 
+       (0xFFFFFFFF - KERNBASE) + 1, 0x0, PTE_W | PTE_P); 
    // Set the write perms for > KERNBASE dir entries
 //   for (n = PDX(KERNBASE); n < NPDENTRIES; n++)
 //      kern_pgdir[n] = kern_pgdir[n] | PTE_W;
@@ -276,6 +350,16 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// The shared zero page keeps a reference of its own, and
+	// page_incref and page_decref never change it, so the page is
+	// never freed however many times it's mapped.
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: no memory for the zero page");
+	zero_page->pp_ref++;
+
+	// From here on free pages are kept by cache color
+	page_color_init();
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -408,6 +492,93 @@ page_init(void)
 	}
 }
 
+//
+// Move every page on page_free_list to the list for its color.  Called
+// at the end of mem_init, once the checks that work on page_free_list
+// directly are done.
+//
+static void
+page_color_init(void)
+{
+   struct PageInfo *page;
+
+   while ((page = page_free_list)) {
+      page_free_list = page->pp_link;
+      page->pp_link = page_color_list[PAGE_COLOR(page)];
+      page_color_list[PAGE_COLOR(page)] = page;
+      page_color_stat.pc_nfree[PAGE_COLOR(page)]++;
+   }
+   page_colored = 1;
+}
+
+// Take a page of 'color' off one of the per-color 'lists', or if
+// 'any' is set, of the nearest color that has one.
+static struct PageInfo *
+page_color_pop(struct PageInfo **lists, size_t *counts, unsigned color, bool any)
+{
+   struct PageInfo *page;
+   unsigned i, c;
+
+   for (i = 0; i < (any ? PAGE_NCOLORS : 1); i++) {
+      c = (color + i) % PAGE_NCOLORS;
+      if ((page = lists[c])) {
+         lists[c] = page->pp_link;
+         page->pp_link = NULL;
+         counts[c]--;
+         return page;
+      }
+   }
+   return NULL;
+}
+
+//
+// page_alloc once pages are kept by color.  Getting 'color' comes
+// before getting a page that is already zeroed, and pre-zeroed pages
+// are used for other requests rather than fail.
+//
+static struct PageInfo *
+page_alloc_color(int alloc_flags, unsigned color)
+{
+   struct PageInfo **want = page_color_list, **other = page_zero_list;
+   size_t *nwant = page_color_stat.pc_nfree, *nother = page_color_stat.pc_nzero;
+   struct PageInfo *page;
+   bool zeroed;
+
+   if (alloc_flags & ALLOC_ZERO) {
+      want = page_zero_list;
+      other = page_color_list;
+      nwant = page_color_stat.pc_nzero;
+      nother = page_color_stat.pc_nfree;
+   }
+
+   if ((page = page_color_pop(want, nwant, color, 0)))
+      zeroed = want == page_zero_list;
+   else if ((page = page_color_pop(other, nother, color, 0)))
+      zeroed = other == page_zero_list;
+   else if ((page = page_color_pop(want, nwant, color, 1)))
+      zeroed = want == page_zero_list;
+   else if ((page = page_color_pop(other, nother, color, 1)))
+      zeroed = other == page_zero_list;
+   else {
+      // Fall back on the buddy pool once the free lists run dry
+      if (alloc_flags & ALLOC_ZERO)
+         page_zero_stat.pz_misses++;
+      return buddy_alloc(alloc_flags, 0);
+   }
+
+   if (zeroed)
+      page_zero_stat.pz_npages--;
+   if (alloc_flags & ALLOC_ZERO) {
+      if (zeroed)
+         page_zero_stat.pz_hits++;
+      else {
+         page_zero_stat.pz_misses++;
+         memset(page2kva(page), 0, PGSIZE);
+      }
+   }
+   return page;
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -420,14 +591,23 @@ page_init(void)
 // Returns NULL if out of free memory.
 //
 // Hint: use page2kva and memset
+// Zeroed requests are served from the pre-zeroed list first, which idle
+// CPUs keep topped up (see page_zero_idle).
+//
+// Pages are handed out round-robin by color; see page_alloc_va.
+//
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-   if (page_free_list == NULL)
-      return NULL;   // Out of free memory
-
    struct PageInfo *page;
 
+   if (page_colored)
+      return page_alloc_color(alloc_flags, page_color_next++ % PAGE_NCOLORS);
+
+   // Fall back on the buddy pool once the free list runs dry
+   if (page_free_list == NULL)
+      return buddy_alloc(alloc_flags, 0);
+
    // Remove a PageInfo from the beginning of the list
    page = page_free_list;
    page_free_list = page->pp_link;
@@ -439,6 +619,26 @@ page_alloc(int alloc_flags)
 	return page;
 }
 
+//
+// Allocate a physical page to be mapped at 'va', of the same cache
+// color as 'va' if there is a free one.  Otherwise like page_alloc.
+//
+struct PageInfo *
+page_alloc_va(int alloc_flags, const void *va)
+{
+   struct PageInfo *page;
+
+   if (!page_colored)
+      return page_alloc(alloc_flags);
+   if ((page = page_alloc_color(alloc_flags, VA_COLOR(va)))) {
+      if (PAGE_COLOR(page) == VA_COLOR(va))
+         page_color_stat.pc_hits++;
+      else
+         page_color_stat.pc_misses++;
+   }
+   return page;
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -452,11 +652,300 @@ page_free(struct PageInfo *pp)
 
    if (pp->pp_ref != 0 || pp->pp_link != NULL)
       panic("page_free: pp_ref not 0 or pp_link not NULL");
+
+   // Page handoffs keyed in this page can never be taken now
+   splice_drop_page(page2pa(pp));
+
+   // Pages from the buddy pool go back to it so they can coalesce.
+   // A large page is freed through its first page, which still
+   // records the order it was allocated with.
+   if (PGNUM(page2pa(pp)) >= buddy_start && PGNUM(page2pa(pp)) < buddy_end) {
+      buddy_free(pp, pp->pp_order);
+      return;
+   }
    
+   if (page_colored) {
+      pp->pp_link = page_color_list[PAGE_COLOR(pp)];
+      page_color_list[PAGE_COLOR(pp)] = pp;
+      page_color_stat.pc_nfree[PAGE_COLOR(pp)]++;
+      return;
+   }
    pp->pp_link = page_free_list;
    page_free_list = pp;
 }
 
+//
+// Move up to 'n' free pages to the pre-zeroed lists, taking them from
+// each color in turn.  Called by idle CPUs from sched_halt with the
+// kernel lock held.  The pages are taken off the free lists first and
+// the lock is dropped while they are zeroed, so the other CPUs are not
+// held up by the memsets.
+//
+void
+page_zero_idle(int n)
+{
+   static unsigned color;
+   struct PageInfo *batch = NULL, *page, *next;
+   size_t count = 0;
+
+   if (!page_colored)
+      return;
+   while (n-- > 0 && page_zero_stat.pz_npages + count < PAGE_ZERO_MAX
+          && (page = page_color_pop(page_color_list, page_color_stat.pc_nfree,
+                                    color++ % PAGE_NCOLORS, 1))) {
+      page->pp_link = batch;
+      batch = page;
+      count++;
+   }
+   if (!batch)
+      return;
+
+   unlock_kernel();
+   for (page = batch; page; page = page->pp_link)
+      memset(page2kva(page), 0, PGSIZE);
+   lock_kernel();
+   tlb_shootdown_ack();
+
+   for (page = batch; page; page = next) {
+      next = page->pp_link;
+      page->pp_link = page_zero_list[PAGE_COLOR(page)];
+      page_zero_list[PAGE_COLOR(page)] = page;
+      page_color_stat.pc_nzero[PAGE_COLOR(page)]++;
+   }
+   page_zero_stat.pz_npages += count;
+   page_zero_stat.pz_zeroed += count;
+}
+
+// Copy out the per-color free page counts.
+void
+page_color_stats(struct PageColorStats *pc)
+{
+   *pc = page_color_stat;
+}
+
+// Copy out the pre-zeroed page counters.
+void
+page_zero_stats(struct PageZeroStats *pz)
+{
+   *pz = page_zero_stat;
+   pz->pz_zero_maps = zero_page_maps;
+}
+
+//
+// Map the shared zero page at 'va' in place of a freshly zeroed page.
+// A writable mapping is made copy-on-write, so a real page is only
+// allocated once the page is first written.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated
+//
+int
+page_insert_zero(pde_t *pgdir, void *va, int perm)
+{
+   if (perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+   return page_insert(pgdir, zero_page, va, perm);
+}
+
+// FNV-1a over the words of a page
+static uint32_t
+page_hash(struct PageInfo *pp)
+{
+   uint32_t *word = page2kva(pp);
+   uint32_t hash = 2166136261u;
+   int i;
+
+   for (i = 0; i < PGSIZE / 4; i++)
+      hash = (hash ^ word[i]) * 16777619;
+   return hash;
+}
+
+static bool
+page_same(struct PageInfo *a, struct PageInfo *b)
+{
+   return memcmp(page2kva(a), page2kva(b), PGSIZE) == 0;
+}
+
+// Can the page mapped by 'pte' be merged?  Only private pages mapped
+// once qualify: anything shared, large or not RAM is left alone.
+static bool
+page_merge_candidate(pte_t pte)
+{
+   if ((pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U)
+       || pte & (PTE_SHARE | PTE_PS) || PGNUM(pte) >= npages
+       || pa2page(PTE_ADDR(pte)) == zero_page)
+      return 0;
+   return pa2page(PTE_ADDR(pte))->pp_ref == 1;
+}
+
+// Is the unstable candidate still mapped, alone and write-protected,
+// where we found it?
+static bool
+page_merge_unstable_ok(struct MergeSlot *ms)
+{
+   struct Env *e;
+   pte_t *ptEntry;
+
+   if (!ms->ms_page || envid2env(ms->ms_envid, &e, 0) < 0)
+      return 0;
+   ptEntry = pgdir_walk(e->env_pgdir, (void *)ms->ms_va, 0);
+   return ptEntry && page_merge_candidate(*ptEntry) && !(*ptEntry & PTE_W)
+          && PTE_ADDR(*ptEntry) == page2pa(ms->ms_page);
+}
+
+// Drop the stable table's reference to a page nobody maps any more
+static void
+page_merge_release(struct MergeSlot *ms)
+{
+   if (ms->ms_page && ms->ms_page->pp_ref == 1) {
+      page_decref(ms->ms_page);
+      ms->ms_page = NULL;
+   }
+}
+
+// Merge the write-protected page mapped at 'va' in 'e' with an
+// identical one, if we know of one.
+static void
+page_merge_one(struct Env *e, uintptr_t va)
+{
+   struct MergeSlot *stable, *unstable;
+   struct PageInfo *page, *same = NULL;
+   pte_t *ptEntry;
+   uint32_t hash;
+
+   page = page_lookup(e->env_pgdir, (void *)va, &ptEntry);
+   hash = page_hash(page);
+   page_merge_stat.pm_scanned++;
+
+   stable = &merge_stable[hash % PAGE_MERGE_STABLE];
+   unstable = &merge_unstable[hash % PAGE_MERGE_UNSTABLE];
+   page_merge_release(stable);
+
+   if (hash == merge_zero_hash && page_same(page, zero_page)) {
+      same = zero_page;
+      page_merge_stat.pm_zero++;
+   }
+   else if (stable->ms_page && stable->ms_hash == hash
+            && page_same(page, stable->ms_page))
+      same = stable->ms_page;
+   else if (!stable->ms_page && unstable->ms_hash == hash
+            && unstable->ms_page != page && page_merge_unstable_ok(unstable)
+            && page_same(page, unstable->ms_page)) {
+      // Seen twice now: it becomes a stable page
+      same = stable->ms_page = unstable->ms_page;
+      stable->ms_hash = hash;
+      same->pp_ref++;
+      unstable->ms_page = NULL;
+   }
+   else {
+      unstable->ms_hash = hash;
+      unstable->ms_page = page;
+      unstable->ms_envid = e->env_id;
+      unstable->ms_va = va;
+      return;
+   }
+
+   if (same != zero_page)
+      page_merge_stat.pm_merged++;
+   // Can't fail: the page table is already there
+   page_insert(e->env_pgdir, same, (void *)va, *ptEntry & PTE_SYSCALL);
+}
+
+// Start another pass over every env
+static void
+page_merge_pass(void)
+{
+   int i;
+
+   for (i = 0; i < PAGE_MERGE_STABLE; i++)
+      page_merge_release(&merge_stable[i]);
+   for (i = 0; i < PAGE_MERGE_UNSTABLE; i++)
+      merge_unstable[i].ms_page = NULL;
+   page_merge_stat.pm_passes++;
+}
+
+//
+// Look for up to 'n' private user pages that match another page and
+// map them copy-on-write to a single copy.  Called by idle CPUs from
+// sched_halt with the kernel lock held.
+//
+// Each call picks up where the last one left off in a walk over every
+// env's address space below UTOP.  Candidates are write-protected and
+// flushed from every TLB before they are hashed, so a page can't change
+// after it is compared; a write to one that isn't merged takes a
+// copy-on-write fault that just makes it writable again.
+//
+void
+page_merge_idle(int n)
+{
+   struct {
+      struct Env *env;
+      uintptr_t va;
+   } batch[PAGE_MERGE_BATCH];
+   int nbatch = 0, scan = PAGE_MERGE_SCAN, i;
+   struct Env *e;
+   pte_t *ptEntry;
+   pde_t pdEntry;
+
+   if (!page_merge_enabled)
+      return;
+   if (!merge_zero_hash)
+      merge_zero_hash = page_hash(zero_page);
+
+   while (nbatch < MIN(n, PAGE_MERGE_BATCH) && scan-- > 0) {
+      e = &envs[merge_envx];
+      // The file server's pages are its block cache, whose dirty
+      // bits say what to write back, so they are left alone
+      if (e->env_status == ENV_FREE || e->env_pgdir == kern_pgdir
+          || e->env_type == ENV_TYPE_FS || merge_va >= UTOP) {
+         merge_va = 0;
+         if (++merge_envx == NENV) {
+            merge_envx = 0;
+            page_merge_pass();
+         }
+         continue;
+      }
+
+      pdEntry = e->env_pgdir[PDX(merge_va)];
+      if (!(pdEntry & PTE_P) || pdEntry & PTE_PS) {
+         merge_va = ROUNDDOWN(merge_va, PTSIZE) + PTSIZE;
+         continue;
+      }
+      ptEntry = (pte_t *)KADDR(PTE_ADDR(pdEntry)) + PTX(merge_va);
+      if (page_merge_candidate(*ptEntry)) {
+         if (*ptEntry & PTE_W) {
+            *ptEntry = (*ptEntry & ~PTE_W) | PTE_COW;
+            tlb_invalidate(e->env_pgdir, (void *)merge_va);
+         }
+         batch[nbatch].env = e;
+         batch[nbatch].va = merge_va;
+         nbatch++;
+      }
+      merge_va += PGSIZE;
+   }
+
+   tlb_shootdown();
+   for (i = 0; i < nbatch; i++)
+      page_merge_one(batch[i].env, batch[i].va);
+   tlb_shootdown();
+}
+
+// Copy out the same-page merging counters.
+void
+page_merge_stats(struct PageMergeStats *pm)
+{
+   int i;
+
+   *pm = page_merge_stat;
+   pm->pm_shared = pm->pm_sharing = 0;
+   for (i = 0; i < PAGE_MERGE_STABLE; i++)
+      if (merge_stable[i].ms_page) {
+         pm->pm_shared++;
+         pm->pm_sharing += merge_stable[i].ms_page->pp_ref - 1;
+      }
+}
+
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
@@ -464,10 +953,177 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
+	if (pp == zero_page) {
+		zero_page_maps--;
+		return;
+	}
 	if (--pp->pp_ref == 0)
 		page_free(pp);
 }
 
+//
+// Take a reference on a page for a mapping or a message.  The shared
+// zero page can have more mappings than pp_ref can count, so its are
+// counted apart and it keeps its one reference for good.
+//
+void
+page_incref(struct PageInfo *pp)
+{
+	if (pp == zero_page)
+		zero_page_maps++;
+	else
+		pp->pp_ref++;
+}
+
+// --------------------------------------------------------------
+// Buddy allocator for physically contiguous multi-page blocks.
+//
+// A block of order n is 2^n pages long and starts at a page number
+// that is a multiple of 2^n.  Its buddy is the block of the same order
+// whose page number differs only in bit n.  Free blocks are kept on
+// per-order lists linked through the pp_link field of their first
+// page, which also records the order and the PP_BUDDYFREE flag.
+// --------------------------------------------------------------
+
+// Carve the pool out of the top of physical memory.  Only pages that
+// are still on page_free_list are moved over; anything in the range
+// that is already in use joins the pool when it is freed.
+static void
+buddy_init(void)
+{
+   struct PageInfo **pp, *page;
+   size_t npool, pn;
+
+   npool = MIN(BUDDY_NPAGES, ROUNDDOWN(npages / 4, 1 << BUDDY_MAXORDER));
+   buddy_end = ROUNDDOWN(npages, 1 << BUDDY_MAXORDER);
+   buddy_start = buddy_end - npool;
+   buddy_stat.bs_pool_pages = npool;
+
+   pp = &page_free_list;
+   while ((page = *pp)) {
+      pn = page - pages;
+      if (pn >= buddy_start && pn < buddy_end) {
+         *pp = page->pp_link;
+         page->pp_link = NULL;
+         buddy_free(page, 0);
+      }
+      else
+         pp = &page->pp_link;
+   }
+   // Building the pool is not interesting coalescing
+   buddy_stat.bs_merges = 0;
+}
+
+// Remove the free block headed by 'pp' from the list for 'order'.
+static void
+buddy_unlink(struct PageInfo *pp, unsigned order)
+{
+   struct PageInfo **walker;
+
+   for (walker = &buddy_free_list[order]; *walker; walker = &(*walker)->pp_link) {
+      if (*walker == pp) {
+         *walker = pp->pp_link;
+         break;
+      }
+   }
+   pp->pp_link = NULL;
+   pp->pp_flags &= ~PP_BUDDYFREE;
+   buddy_stat.bs_nfree[order]--;
+   buddy_stat.bs_free_pages -= 1 << order;
+}
+
+// Put the block headed by 'pp' on the free list for 'order'.
+static void
+buddy_link(struct PageInfo *pp, unsigned order)
+{
+   pp->pp_order = order;
+   pp->pp_flags |= PP_BUDDYFREE;
+   pp->pp_link = buddy_free_list[order];
+   buddy_free_list[order] = pp;
+   buddy_stat.bs_nfree[order]++;
+   buddy_stat.bs_free_pages += 1 << order;
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size.
+// If (alloc_flags & ALLOC_ZERO), the whole block is zeroed.  Like
+// page_alloc, does NOT increment any reference counts; the block must
+// be handed back with buddy_free() using the same order.
+//
+// Returns the PageInfo of the first page, or NULL if no block is free.
+//
+struct PageInfo *
+buddy_alloc(int alloc_flags, unsigned order)
+{
+   struct PageInfo *page;
+   unsigned cur;
+
+   if (order > BUDDY_MAXORDER)
+      return NULL;
+
+   // Find the smallest free block that is big enough
+   for (cur = order; cur <= BUDDY_MAXORDER; cur++)
+      if (buddy_free_list[cur])
+         break;
+   if (cur > BUDDY_MAXORDER) {
+      buddy_stat.bs_fails++;
+      return NULL;
+   }
+
+   page = buddy_free_list[cur];
+   buddy_unlink(page, cur);
+
+   // Split it, returning the upper halves to the free lists
+   while (cur > order) {
+      cur--;
+      buddy_link(page + (1 << cur), cur);
+      buddy_stat.bs_splits++;
+   }
+   page->pp_order = order;
+   buddy_stat.bs_allocs++;
+
+   if (alloc_flags & ALLOC_ZERO)
+      memset(page2kva(page), 0, PGSIZE << order);
+
+   return page;
+}
+
+//
+// Return a block of 2^order pages obtained from buddy_alloc(), merging
+// it with its buddy for as long as the buddy is free as well.
+//
+void
+buddy_free(struct PageInfo *pp, unsigned order)
+{
+   struct PageInfo *buddy;
+   size_t pn = pp - pages;
+
+   if (pn < buddy_start || pn + (1 << order) > buddy_end
+       || order > BUDDY_MAXORDER || pn & ((1 << order) - 1))
+      panic("buddy_free: bad block %08x order %d", page2pa(pp), order);
+   if (pp->pp_ref != 0 || pp->pp_link != NULL || pp->pp_flags & PP_BUDDYFREE)
+      panic("buddy_free: block %08x is still in use", page2pa(pp));
+
+   while (order < BUDDY_MAXORDER) {
+      buddy = pages + (pn ^ (1 << order));
+      if (buddy - pages < buddy_start || buddy - pages >= buddy_end
+          || !(buddy->pp_flags & PP_BUDDYFREE) || buddy->pp_order != order)
+         break;
+      buddy_unlink(buddy, order);
+      pn &= ~(1 << order);
+      order++;
+      buddy_stat.bs_merges++;
+   }
+   buddy_link(pages + pn, order);
+}
+
+// Copy out the buddy allocator's counters.
+void
+buddy_stats(struct BuddyStats *bs)
+{
+   *bs = buddy_stat;
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -490,10 +1146,18 @@ page_decref(struct PageInfo* pp)
 // Hint 3: look at inc/mmu.h for useful macros that mainipulate page
 // table and page directory entries.
 //
+// If va lies in a 4MB page (PTE_PS set in the pd entry), there is no
+// page table: with create == false the pd entry itself is returned,
+// which has the same layout as a PTE for the permission bits.  With
+// create == true the large page is first split into a page table of
+// 4KB entries mapping the same memory.  Only the static kernel mappings
+// are ever split this way; user large pages are removed instead (see
+// page_insert).
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
-   size_t pdIndex, ptIndex;
+   size_t pdIndex, ptIndex, i;
    physaddr_t pa;
    pde_t *pdEntry;
    pte_t *ptEntry;
@@ -503,6 +1167,22 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
    ptIndex = PTX(va);
    
    pdEntry = pgdir + pdIndex; // Walk to pd entry
+
+   if (*pdEntry & PTE_PS) {
+      if (!create)
+         return pdEntry;
+      if (!(pp = page_alloc(0)))
+         return NULL;   // Out of mem, cannot alloc pt
+
+      // Same frames and permissions, one 4KB page at a time
+      pp->pp_ref++;
+      ptEntry = page2kva(pp);
+      for (i = 0; i < NPTENTRIES; i++)
+         ptEntry[i] = (PTE_ADDR(*pdEntry) + i * PGSIZE)
+                      | (*pdEntry & 0xFFF & ~PTE_PS);
+      *pdEntry = page2pa(pp) | (*pdEntry & (PTE_U | PTE_W | PTE_P));
+      return ptEntry + ptIndex;
+   }
    
    // Check if page table page is present 
    if (!(*pdEntry & PTE_P)) {
@@ -560,6 +1240,53 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
       pgdir[pdx++] |= perm;
 }
 
+//
+// Like boot_map_region, but maps [va, va+size) with 4MB pages straight
+// from the page directory.  va, pa and size must be multiples of PTSIZE,
+// and CR4_PSE must be on before pgdir is loaded.
+//
+static void
+boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+   uint32_t cnt;
+
+   assert(va % PTSIZE == 0 && pa % PTSIZE == 0 && size % PTSIZE == 0);
+   for (cnt = 0; cnt < size; cnt += PTSIZE)
+      pgdir[PDX(va + cnt)] = (pa + cnt) | perm | PTE_PS | PTE_P;
+}
+
+//
+// Return the env whose address space 'pgdir' is, or NULL for
+// kern_pgdir.  The last one looked up is remembered, since fork and
+// spawn map many pages into one child at a time.
+//
+static struct Env *
+pgdir_env(pde_t *pgdir)
+{
+   struct Env *e;
+
+   if (pgdir == kern_pgdir)
+      return NULL;
+   if (curenv && curenv->env_pgdir == pgdir)
+      return curenv;
+   if (pgdir_env_last && pgdir_env_last->env_pgdir == pgdir)
+      return pgdir_env_last;
+   for (e = envs; e < envs + NENV; e++)
+      if (e->env_pgdir == pgdir)
+         return pgdir_env_last = e;
+   return NULL;
+}
+
+// Charge 'n' more (or fewer) pages mapped at 'va' to pgdir's env
+static void
+page_account(pde_t *pgdir, void *va, int n)
+{
+   struct Env *e;
+
+   if ((uintptr_t)va < UTOP && (e = pgdir_env(pgdir)))
+      e->env_npages += n;
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -592,6 +1319,10 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
    pde_t *pdEntry;
    pte_t *ptEntry;
 
+   // Mapping a small page over part of a user large page unmaps all of it
+   if ((uintptr_t)va < UTOP && pgdir[PDX(va)] & PTE_PS)
+      page_remove(pgdir, va);
+
    if (!(ptEntry = pgdir_walk(pgdir, va, 1)))
       return -E_NO_MEM;  // Out of memory
 
@@ -604,16 +1335,163 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
    // We make page dir entry permissions more lenient
    *pdEntry = *pdEntry | PTE_U | PTE_W | PTE_P;  
 
-   pp->pp_ref++;  // Inc first so we don't delete same va
+   page_incref(pp);  // Inc first so we don't delete same va
    page_remove(pgdir, va);
    pa = page2pa(pp);
    
    // Set perm for page table entry
    *ptEntry = pa | perm | PTE_P;
+   page_account(pgdir, va, 1);
+
+   return 0;
+}
+
+//
+// Map the 4MB block headed by 'pp' (from buddy_alloc with order
+// BUDDY_MAXORDER) as one large page at the PTSIZE-aligned user address
+// 'va'.  Whatever was mapped in [va, va+PTSIZE) before is unmapped,
+// including its page table.  As with page_insert, pp->pp_ref counts the
+// mappings, and the block is freed whole when the last one goes away.
+//
+void
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+   pde_t *pdEntry = pgdir + PDX(va);
+   pte_t *pt;
+   size_t i;
+
+   assert((uintptr_t)va % PTSIZE == 0 && (uintptr_t)va < UTOP);
+   pp->pp_ref++;  // Inc first so we don't free a re-inserted page
+
+   if (*pdEntry & PTE_PS)
+      page_remove(pgdir, va);
+   else if (*pdEntry & PTE_P) {
+      pt = KADDR(PTE_ADDR(*pdEntry));
+      for (i = 0; i < NPTENTRIES; i++)
+         if (pt[i] & PTE_P)
+            page_remove(pgdir, (char *)va + i * PGSIZE);
+      page_decref(pa2page(PTE_ADDR(*pdEntry)));
+   }
+
+   *pdEntry = page2pa(pp) | perm | PTE_PS | PTE_P;
+   page_account(pgdir, va, NPTENTRIES);
+   tlb_invalidate(pgdir, va);
+}
+
+//
+// Copy the user mappings below 'end' from 'src' into 'dst' for fork.
+// Writable and copy-on-write pages, large ones included, are mapped
+// copy-on-write in both, so the caller must flush the TLB if 'src' is
+// loaded.  PTE_SHARE pages and read-only pages are simply shared.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//
+int
+pgdir_copy_cow(pde_t *dst, pde_t *src, uintptr_t end)
+{
+   uintptr_t va;
+   pte_t *ptEntry;
+   int perm, error;
 
+   for (va = 0; va < end; va += PGSIZE) {
+      // Skip over holes with no page table
+      if (!(src[PDX(va)] & PTE_P)) {
+         va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+         continue;
+      }
+      if (src[PDX(va)] & PTE_PS) {
+         perm = src[PDX(va)] & PTE_SYSCALL;
+         if (!(perm & PTE_SHARE) && perm & (PTE_W | PTE_COW)) {
+            perm = (perm & ~PTE_W) | PTE_COW;
+            src[PDX(va)] = PTE_ADDR(src[PDX(va)]) | perm | PTE_PS;
+         }
+         page_insert_large(dst, pa2page(PTE_ADDR(src[PDX(va)])), (void *)va,
+                           perm);
+         va += PTSIZE - PGSIZE;
+         continue;
+      }
+
+      ptEntry = (pte_t *)KADDR(PTE_ADDR(src[PDX(va)])) + PTX(va);
+      if (!(*ptEntry & PTE_P))
+         continue;
+      perm = *ptEntry & PTE_SYSCALL;
+      if (!(perm & PTE_SHARE) && perm & (PTE_W | PTE_COW)) {
+         perm = (perm & ~PTE_W) | PTE_COW;
+         *ptEntry = PTE_ADDR(*ptEntry) | perm;
+      }
+      if ((error = page_insert(dst, pa2page(PTE_ADDR(*ptEntry)), (void *)va, perm)) < 0)
+         return error;
+   }
    return 0;
 }
 
+//
+// page_cow_fault for a copy-on-write large page, whose pd entry is
+// 'pdEntry': the whole 4MB is copied into a block of its own.
+//
+static int
+page_cow_fault_large(pde_t *pgdir, void *va, pde_t *pdEntry, int perm)
+{
+   struct PageInfo *page = pa2page(PTE_ADDR(*pdEntry)), *copy;
+
+   va = ROUNDDOWN(va, PTSIZE);
+   if (page->pp_ref == 1) {
+      *pdEntry = PTE_ADDR(*pdEntry) | perm | PTE_PS | PTE_P;
+      tlb_invalidate(pgdir, va);
+      return 0;
+   }
+   if (!(copy = buddy_alloc(0, BUDDY_MAXORDER)))
+      return -E_NO_MEM;
+   memmove(page2kva(copy), page2kva(page), PTSIZE);
+   page_insert_large(pgdir, copy, va, perm);
+   return 0;
+}
+
+//
+// Resolve a write fault on the copy-on-write page at 'va', giving
+// 'pgdir' its own writable copy.  If no one else maps the page any
+// more it is just made writable again.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if va is not a copy-on-write page
+//   -E_NO_MEM, if there's no memory for the copy
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+   struct PageInfo *page, *copy;
+   pte_t *ptEntry;
+   int perm;
+
+   va = ROUNDDOWN(va, PGSIZE);
+   if (!(page = page_lookup(pgdir, va, &ptEntry)) || !(*ptEntry & PTE_COW))
+      return -E_INVAL;
+   perm = ((*ptEntry & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+   if (*ptEntry & PTE_PS)
+      return page_cow_fault_large(pgdir, va, ptEntry, perm);
+
+   // The first write to the zero page needs nothing copied
+   if (page == zero_page) {
+      if (!(copy = page_alloc_va(ALLOC_ZERO, va)))
+         return -E_NO_MEM;
+   }
+   else if (page->pp_ref == 1) {
+      *ptEntry = PTE_ADDR(*ptEntry) | perm;
+      tlb_invalidate(pgdir, va);
+      return 0;
+   }
+   else {
+      if (!(copy = page_alloc_va(0, va)))
+         return -E_NO_MEM;
+      memmove(page2kva(copy), page2kva(page), PGSIZE);
+   }
+   // Can't fail: the page table is already there
+   return page_insert(pgdir, copy, va, perm);
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -638,6 +1516,9 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
       return NULL;   // va is not mapped yet
 
    pa = PTE_ADDR(*ptEntry);
+   // In a large page, find the 4KB page that holds va
+   if (*ptEntry & PTE_PS)
+      pa += PTX(va) << PTXSHIFT;
    page = pa2page(pa);
 
    if (pte_store)
@@ -667,12 +1548,25 @@ page_remove(pde_t *pgdir, void *va)
    pte_t *ptEntry;
    struct PageInfo *page;
 
+   // A user large page goes away whole, and its reference count
+   // lives in its first page
+   if (pgdir[PDX(va)] & PTE_PS) {
+      page_decref(pa2page(PTE_ADDR(pgdir[PDX(va)])));
+      pgdir[PDX(va)] = 0;
+      page_account(pgdir, va, -NPTENTRIES);
+      tlb_invalidate(pgdir, va);
+      return;
+   }
+
    if (!(page = page_lookup(pgdir, va, &ptEntry)))
       return;  // No physical page at that address
 
    page_decref(page);      
    *ptEntry = 0;
+   page_account(pgdir, va, -1);
    tlb_invalidate(pgdir, va);
+   // Futex waiters may be watching the page's reference count
+   futex_wake_page(page2pa(page));
 }
 
 //
@@ -682,9 +1576,75 @@ page_remove(pde_t *pgdir, void *va)
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	int i;
+
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+
+	// Any other CPU with these page tables loaded gets a shootdown
+	// when we leave the kernel.  Kernel mappings are in every pgdir.
+	for (i = 0; i < ncpu; i++) {
+		if (&cpus[i] == thiscpu || cpus[i].cpu_status == CPU_UNUSED)
+			continue;
+		if (pgdir == kern_pgdir || cpus[i].cpu_pgdir == pgdir)
+			tlb_pending[cpunum()] |= 1 << i;
+	}
+}
+
+//
+// Send the shootdowns queued up by tlb_invalidate, one IPI per CPU no
+// matter how many pages changed, and wait for the targets to flush.
+// This must happen before we release the kernel lock, since the pages
+// behind their stale entries can be reallocated once it is released.
+//
+void
+tlb_shootdown(void)
+{
+	uint32_t mask = tlb_pending[cpunum()];
+	int i;
+
+	if (!mask)
+		return;
+	tlb_pending[cpunum()] = 0;
+
+	for (i = 0; i < ncpu; i++)
+		if (mask & (1 << i)) {
+			xchg(&cpus[i].cpu_tlb_flush, 1);
+			lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_TLB);
+			tlb_stat.ts_ipis++;
+		}
+
+	// A CPU that is on its way into the kernel has interrupts off and
+	// can't take the IPI, but it flushes once it has the kernel lock.
+	for (i = 0; i < ncpu; i++)
+		if (mask & (1 << i))
+			while (cpus[i].cpu_tlb_flush && cpus[i].cpu_interruptible)
+				asm volatile("pause");
+	tlb_stat.ts_shootdowns++;
+}
+
+// Copy out the shootdown counters.
+void
+tlb_stats(struct TlbStats *ts)
+{
+	*ts = tlb_stat;
+}
+
+// Flush our TLB if another CPU has asked us to.
+void
+tlb_shootdown_ack(void)
+{
+	if (thiscpu->cpu_tlb_flush && xchg(&thiscpu->cpu_tlb_flush, 0))
+		tlbflush();
+}
+
+// Switch to pgdir, noting it so tlb_invalidate knows to shoot us down.
+void
+pgdir_load(pde_t *pgdir)
+{
+	thiscpu->cpu_pgdir = pgdir;
+	lcr3(PADDR(pgdir));
 }
 
 //
@@ -759,7 +1719,9 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
    uintptr_t cur_va = (uintptr_t)va;
    pte_t *ptEntry;
 
-   for (; cur_va < (uintptr_t)va + len; cur_va++) {
+   // One lookup per page is enough; only the first page can start
+   // part way through
+   for (; cur_va < (uintptr_t)va + len; cur_va = ROUNDDOWN(cur_va, PGSIZE) + PGSIZE) {
       user_mem_check_addr = cur_va;
       // Check if address is below ULIM
       if (cur_va >= ULIM)
@@ -770,6 +1732,11 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
       // Check permissions
       if (!(*ptEntry & (perm | PTE_P)))
          return -E_FAULT;
+      // The kernel is about to write the page, so it can't still be
+      // copy-on-write (CR0_WP makes read-only pages fault in the kernel)
+      if (perm & PTE_W && *ptEntry & PTE_COW
+          && page_cow_fault(env->env_pgdir, (void *)cur_va) < 0)
+         return -E_FAULT;
    }
 	return 0;
 }
@@ -935,6 +1902,52 @@ char *c;
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
+//
+// Check the buddy allocator: alignment, splitting and coalescing.
+//
+static void
+check_buddy(void)
+{
+	struct PageInfo *pp0, *pp1, *pp2;
+	struct BuddyStats before, after;
+	char *c;
+	int i;
+
+	if (!buddy_stat.bs_pool_pages) {
+		cprintf("check_buddy() skipped: no buddy pool\n");
+		return;
+	}
+	buddy_stats(&before);
+
+	// a maximal block is aligned to PTSIZE and zeroed all the way through
+	assert((pp2 = buddy_alloc(ALLOC_ZERO, BUDDY_MAXORDER)));
+	assert(page2pa(pp2) % PTSIZE == 0);
+	c = page2kva(pp2);
+	for (i = 0; i < PTSIZE; i += PGSIZE / 4)
+		assert(c[i] == 0);
+	buddy_free(pp2, BUDDY_MAXORDER);
+
+	// smaller blocks are split off and come back aligned to their size
+	assert((pp0 = buddy_alloc(0, 0)));
+	assert((pp1 = buddy_alloc(0, 3)));
+	assert(pp0 != pp1);
+	assert(PGNUM(page2pa(pp1)) % 8 == 0);
+	assert(pp0->pp_link == NULL && pp1->pp_link == NULL);
+
+	// too large an order fails cleanly
+	assert(!buddy_alloc(0, BUDDY_MAXORDER + 1));
+
+	// freeing everything coalesces back into the original blocks
+	buddy_free(pp1, 3);
+	buddy_free(pp0, 0);
+	buddy_stats(&after);
+	assert(after.bs_free_pages == before.bs_free_pages);
+	for (i = 0; i <= BUDDY_MAXORDER; i++)
+		assert(after.bs_nfree[i] == before.bs_nfree[i]);
+
+	cprintf("check_buddy() succeeded!\n");
+}
+
 //
 // Checks that the kernel part of virtual address space
 // has been setup roughly correctly (by mem_init()).
@@ -1011,6 +2024,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -16,6 +16,7 @@ extern struct PageInfo *pages;
 extern size_t npages;
 
 extern pde_t *kern_pgdir;
+extern bool pse_enabled;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -51,17 +52,104 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// The cache color of a physical page, and the one wanted for a
+// virtual address (see PAGE_NCOLORS)
+#define PAGE_COLOR(pp)	(PGNUM(page2pa(pp)) % PAGE_NCOLORS)
+#define VA_COLOR(va)	(PGNUM(va) % PAGE_NCOLORS)
+
+struct PageColorStats {
+	size_t pc_nfree[PAGE_NCOLORS];	// Free pages of each color
+	size_t pc_nzero[PAGE_NCOLORS];	// Pre-zeroed pages of each color
+	uint32_t pc_hits;		// page_alloc_va got the color it wanted
+	uint32_t pc_misses;		// ... or had to take another
+};
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_va(int alloc_flags, const void *va);
+void	page_color_stats(struct PageColorStats *pc);
 void	page_free(struct PageInfo *pp);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+void	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	pgdir_copy_cow(pde_t *dst, pde_t *src, uintptr_t end);
+int	page_cow_fault(pde_t *pgdir, void *va);
+int	page_insert_zero(pde_t *pgdir, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	page_incref(struct PageInfo *pp);
+
+// Free pages zeroed ahead of time by idle CPUs for page_alloc(ALLOC_ZERO)
+#define PAGE_ZERO_MAX	1024	// Most pages kept on the pre-zeroed list
+#define PAGE_ZERO_BATCH	32	// Pages zeroed per trip through sched_halt
+
+struct PageZeroStats {
+	size_t pz_npages;		// Pages on the pre-zeroed list
+	uint32_t pz_zeroed;		// Pages zeroed by idle CPUs
+	uint32_t pz_hits;		// ALLOC_ZERO served from the list
+	uint32_t pz_misses;		// ALLOC_ZERO that had to memset
+	uint32_t pz_zero_maps;		// Mappings of the shared zero page
+};
+
+void	page_zero_idle(int n);
+void	page_zero_stats(struct PageZeroStats *pz);
+
+// Same-page merging: idle CPUs hash private user pages and map
+// byte-identical ones to a single copy-on-write page.  It turns
+// writable pages copy-on-write behind their envs' backs, so it is off
+// unless turned on with the monitor's "mergeinfo on".
+#define PAGE_MERGE_BATCH	16	// Pages hashed per trip through sched_halt
+#define PAGE_MERGE_SCAN		1024	// Most PTEs looked at per trip
+#define PAGE_MERGE_STABLE	512	// Slots for pages already merged
+#define PAGE_MERGE_UNSTABLE	512	// Slots for candidates seen this pass
+
+struct PageMergeStats {
+	uint32_t pm_scanned;		// Candidate pages hashed
+	uint32_t pm_passes;		// Full passes over every env
+	uint32_t pm_merged;		// Mappings moved onto a merged page
+	uint32_t pm_zero;		// Mappings moved onto the zero page
+	size_t pm_shared;		// Merged pages in use now
+	size_t pm_sharing;		// Mappings of those pages now
+};
+
+extern bool page_merge_enabled;
+
+void	page_merge_idle(int n);
+void	page_merge_stats(struct PageMergeStats *pm);
+
+// Changes to page tables another CPU has loaded are batched up by
+// tlb_invalidate and sent as one IPI per CPU by tlb_shootdown.
+struct TlbStats {
+	uint32_t ts_shootdowns;		// Batches that needed IPIs
+	uint32_t ts_ipis;		// IPIs sent
+};
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown(void);
+void	tlb_shootdown_ack(void);
+void	tlb_stats(struct TlbStats *ts);
+void	pgdir_load(pde_t *pgdir);
+
+// Buddy allocator for physically contiguous runs of 2^order pages.
+// The largest block (order BUDDY_MAXORDER) is 4MB, one PTSIZE.
+#define BUDDY_MAXORDER	10
+#define BUDDY_NPAGES	(4 << BUDDY_MAXORDER)	// Max pages in the pool
+
+struct BuddyStats {
+	size_t bs_nfree[BUDDY_MAXORDER + 1];	// Free blocks of each order
+	size_t bs_free_pages;			// Free pages in the pool
+	size_t bs_pool_pages;			// Pages managed by the pool
+	uint32_t bs_allocs;			// Successful allocations
+	uint32_t bs_fails;			// Failed allocations
+	uint32_t bs_splits;			// Blocks split in two
+	uint32_t bs_merges;			// Buddies coalesced on free
+};
+
+struct PageInfo *buddy_alloc(int alloc_flags, unsigned order);
+void	buddy_free(struct PageInfo *pp, unsigned order);
+void	buddy_stats(struct BuddyStats *bs);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -100,11 +100,16 @@ sched_halt(void)
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
+	// An env in a timed futex wait will be runnable once CPU 0's timer
+	// tick expires it, so halt for that instead.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
 		     envs[i].env_status == ENV_DYING))
 			break;
+		if (envs[i].env_status == ENV_NOT_RUNNABLE
+		    && envs[i].env_futex_deadline)
+			break;
 	}
 	if (i == NENV) {
 		cprintf("No runnable environments in the system!\n");
@@ -114,7 +119,14 @@ sched_halt(void)
 
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
+	tlb_shootdown();
+
+	// Put the idle time to use zeroing free pages for page_alloc
+	page_zero_idle(PAGE_ZERO_BATCH);
+
+	// and looking for identical pages to merge
+	page_merge_idle(PAGE_MERGE_BATCH);
 
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
@@ -122,6 +134,7 @@ sched_halt(void)
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
 	// Release the big kernel lock as if we were "leaving" the kernel
+	xchg(&thiscpu->cpu_interruptible, 1);
 	unlock_kernel();
 
 	// Reset stack pointer, enable interrupts and then halt.
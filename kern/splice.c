@@ -0,0 +1,170 @@
+// Page handoffs: an env leaves one of its pages with the kernel under a
+// word of memory it shares with other envs, and one of them later takes
+// the page into its own address space, with no copy.  Slots are keyed
+// on the physical address of the word, as futexes are, and go away
+// with the page holding it.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/futex.h>
+#include <kern/splice.h>
+
+#define SPLICE_HASH(pa)	(PGNUM(pa) % SPLICE_NHASH)
+
+struct SpliceSlot {
+	physaddr_t ss_key;		// Physical address of the key word
+	struct PageInfo *ss_page;	// Page left there, holding a reference
+	int ss_perm;			// Perm to map it with
+	struct SpliceSlot *ss_next;	// Next in its bucket, or free
+};
+
+static struct SpliceSlot splice_slots[SPLICE_NSLOT];
+static struct SpliceSlot *splice_hash[SPLICE_NHASH];
+static struct SpliceSlot *splice_free;
+static uint32_t splice_nused;		// Slots holding a page
+
+// Find the link to the slot keyed on 'key', which is null if there's
+// none.
+static struct SpliceSlot **
+splice_find(physaddr_t key)
+{
+	struct SpliceSlot **pp;
+
+	for (pp = &splice_hash[SPLICE_HASH(key)]; *pp; pp = &(*pp)->ss_next)
+		if ((*pp)->ss_key == key)
+			break;
+	return pp;
+}
+
+// Find the key for the word at 'addr', as futex_key does, but only for
+// a word the caller can write.  Keys then live in pages that are freed
+// with their last env, which empties their slots, never in pages the
+// kernel keeps for good, like those at UENVS.
+static int
+splice_key(volatile uint32_t *addr, physaddr_t *key)
+{
+	pte_t *pte;
+
+	if ((uintptr_t) addr >= UTOP
+	    || curenv->env_pgdir[PDX(addr)] & PTE_PS
+	    || !page_lookup(curenv->env_pgdir, (void *) addr, &pte)
+	    || !(*pte & PTE_U) || !(*pte & (PTE_W | PTE_COW)))
+		return -E_INVAL;
+	return futex_key(addr, key);
+}
+
+// Drop the page of slot s, which is off its bucket, and free the slot.
+static void
+splice_release(struct SpliceSlot *s)
+{
+	page_decref(s->ss_page);
+	s->ss_page = NULL;
+	s->ss_next = splice_free;
+	splice_free = s;
+	splice_nused--;
+}
+
+// Leave curenv's page at 'srcva' in the slot keyed on 'addr', to be
+// mapped with 'perm' by whoever takes it.  PTE_W in 'perm' becomes
+// PTE_COW, and a writable page turns copy-on-write in curenv too.  The
+// page must be mapped nowhere else: another writable mapping of it,
+// say an sfork sibling's, could change it after it's taken.
+// Returns 0 on success; see sys_page_give for the errors.
+int
+splice_give(volatile uint32_t *addr, void *srcva, int perm)
+{
+	struct SpliceSlot *s;
+	struct PageInfo *page;
+	physaddr_t key;
+	pte_t *pte;
+	int i, r;
+
+	if ((uintptr_t) srcva >= UTOP || (uintptr_t) srcva & (PGSIZE - 1)
+	    || (perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P)
+	    || perm & ~PTE_SYSCALL || perm & PTE_SHARE)
+		return -E_INVAL;
+	if ((r = splice_key(addr, &key)) < 0)
+		return r;
+	if (*splice_find(key))
+		return -E_WOULD_BLOCK;
+	if (!(page = page_lookup(curenv->env_pgdir, srcva, &pte))
+	    || *pte & (PTE_PS | PTE_SHARE) || page->pp_ref > 1)
+		return -E_INVAL;
+	if (!splice_free && !splice_nused)
+		for (i = 0; i < SPLICE_NSLOT; i++) {
+			splice_slots[i].ss_next = splice_free;
+			splice_free = &splice_slots[i];
+		}
+	if (!(s = splice_free))
+		return -E_NO_MEM;
+
+	if (perm & PTE_W) {
+		perm = (perm & ~PTE_W) | PTE_COW;
+		if (*pte & PTE_W) {
+			*pte = (*pte & ~PTE_W) | PTE_COW;
+			tlb_invalidate(curenv->env_pgdir, srcva);
+			tlb_shootdown();
+		}
+	}
+	splice_free = s->ss_next;
+	s->ss_key = key;
+	s->ss_page = page;
+	s->ss_perm = perm;
+	page_incref(page);
+	s->ss_next = splice_hash[SPLICE_HASH(key)];
+	splice_hash[SPLICE_HASH(key)] = s;
+	splice_nused++;
+	return 0;
+}
+
+// Map the page in the slot keyed on 'addr' at 'dstva' in curenv, and
+// empty the slot.
+// Returns 0 on success; see sys_page_take for the errors.
+int
+splice_take(volatile uint32_t *addr, void *dstva)
+{
+	struct SpliceSlot **pp, *s;
+	physaddr_t key;
+	int r;
+
+	if ((uintptr_t) dstva >= UTOP || (uintptr_t) dstva & (PGSIZE - 1))
+		return -E_INVAL;
+	if ((r = splice_key(addr, &key)) < 0)
+		return r;
+	if (!(s = *(pp = splice_find(key))))
+		return -E_WOULD_BLOCK;
+	if ((r = page_insert(curenv->env_pgdir, s->ss_page, dstva,
+			     s->ss_perm)) < 0)
+		return r;
+	*pp = s->ss_next;
+	splice_release(s);
+	return 0;
+}
+
+// Empty every slot keyed in the page at 'pa', which is being freed.
+void
+splice_drop_page(physaddr_t pa)
+{
+	struct SpliceSlot **pp, *s, *dead = NULL;
+
+	if (!splice_nused)
+		return;
+	pp = &splice_hash[SPLICE_HASH(pa)];
+	while ((s = *pp)) {
+		if (PGNUM(s->ss_key) == PGNUM(pa)) {
+			*pp = s->ss_next;
+			s->ss_next = dead;
+			dead = s;
+		} else
+			pp = &s->ss_next;
+	}
+	// Dropping a page can free another key page, so only once the
+	// bucket is consistent again
+	while ((s = dead)) {
+		dead = s->ss_next;
+		splice_release(s);
+	}
+}
@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_SPLICE_H
+#define JOS_KERN_SPLICE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define SPLICE_NSLOT	256	// Pages the kernel holds for handoffs at once
+#define SPLICE_NHASH	64	// Buckets of slots, hashed by page
+
+int	splice_give(volatile uint32_t *addr, void *srcva, int perm);
+int	splice_take(volatile uint32_t *addr, void *dstva);
+void	splice_drop_page(physaddr_t pa);
+
+#endif /* !JOS_KERN_SPLICE_H */
@@ -14,6 +14,8 @@
 #include <kern/time.h>
 #include <kern/e1000.h>
 #include <kern/flexsc.h>
+#include <kern/futex.h>
+#include <kern/splice.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -106,10 +108,66 @@ sys_exofork(void)
    e->env_tf = curenv->env_tf;
    // Set %eax to 0 so it appears to return 0 in the child
    e->env_tf.tf_regs.reg_eax = 0;   
+   // The child is an ordinary user env: no I/O privileges
+   e->env_tf.tf_eflags &= ~FL_IOPL_MASK;
    // Return child id for the parent env
    return e->env_id;
 }
 
+// Fork the current environment in a single system call.  The child
+// gets a copy-on-write copy of everything below the exception stack
+// (PTE_SHARE, read-only and large pages are shared), a fresh exception
+// stack if the parent has one, the same page fault upcall, and is
+// marked runnable.  Write faults on the copy-on-write pages are
+// resolved by the kernel, so no user page fault handler is needed.
+// Like any env env_alloc makes, the child is an ENV_TYPE_USER, so it
+// doesn't inherit the parent's I/O privileges.
+//
+// Returns envid of new environment to the parent and 0 to the child,
+// or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+   struct Env *e;
+   struct PageInfo *page;
+   void *xstk = (void *)(UXSTACKTOP - PGSIZE);
+   int error;
+
+   if ((error = env_alloc(&e, curenv->env_id)) < 0)
+      return error;
+   e->env_tf = curenv->env_tf;
+   e->env_tf.tf_regs.reg_eax = 0;
+   e->env_tf.tf_eflags &= ~FL_IOPL_MASK;
+   e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+   if ((error = pgdir_copy_cow(e->env_pgdir, curenv->env_pgdir,
+                               (uintptr_t)xstk)) < 0)
+      goto fail;
+   // Our own writable pages just became read-only
+   tlbflush();
+
+   if (page_lookup(curenv->env_pgdir, xstk, NULL)) {
+      if (!(page = page_alloc_va(ALLOC_ZERO, xstk))) {
+         error = -E_NO_MEM;
+         goto fail;
+      }
+      if ((error = page_insert(e->env_pgdir, page, xstk,
+                               PTE_U | PTE_W | PTE_P)) < 0) {
+         page_free(page);
+         goto fail;
+      }
+   }
+
+   e->env_status = ENV_RUNNABLE;
+   return e->env_id;
+
+fail:
+   env_free(e);
+   return error;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -205,12 +263,36 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
    return 0;
 }
 
+// Check that mapping 'n' more pages would not take 'e' over its page
+// limit.  Returns 0 if not, -E_NO_MEM if it would.
+static int
+check_page_limit(struct Env *e, size_t n)
+{
+   if (e->env_page_limit && e->env_npages + n > e->env_page_limit)
+      return -E_NO_MEM;
+   return 0;
+}
+
+// check_page_limit for mapping an existing page, large if 'large', at
+// 'va' in 'e'.  Replacing a mapping already at 'va' doesn't count.
+static int
+check_map_limit(struct Env *e, void *va, bool large)
+{
+   if (page_lookup(e->env_pgdir, va, NULL))
+      return 0;
+   return check_page_limit(e, large ? NPTENTRIES : 1);
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
 // If a page is already mapped at 'va', that page is unmapped as a
 // side effect.
 //
+// Unless perm has PTE_SHARE, what gets mapped is the kernel's shared
+// zero page, copy-on-write if PTE_W is asked for; a page of its own is
+// only allocated on the first write.
+//
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
 //
@@ -220,7 +302,8 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
 //	-E_NO_MEM if there's no memory to allocate the new page,
-//		or to allocate any necessary page tables.
+//		or to allocate any necessary page tables,
+//		or envid is at its page limit.
 static int
 sys_page_alloc(envid_t envid, void *va, int perm)
 {
@@ -246,8 +329,13 @@ sys_page_alloc(envid_t envid, void *va, int perm)
    // Get env from id and check if we have perm to change it
    if ((error = envid2env(envid, &e, 1)) < 0)
       return error;
+   if ((error = check_page_limit(e, 1)) < 0)
+      return error;
+   // Private pages start out as the zero page
+   if (!(perm & PTE_SHARE))
+      return page_insert_zero(e->env_pgdir, va, perm);
    // Allocate the page and return error if no memory to allocate
-   if (!(page = page_alloc(ALLOC_ZERO))) 
+   if (!(page = page_alloc_va(ALLOC_ZERO, va))) 
       return -E_NO_MEM;
    // Insert the page and return error if no mem to allocate pt 
    if ((error = page_insert(e->env_pgdir, page, va, perm)) < 0) {
@@ -258,6 +346,47 @@ sys_page_alloc(envid_t envid, void *va, int perm)
    return 0;
 }
 
+// Allocate a zeroed, physically contiguous 4MB large page and map it at
+// 'va' in the address space of 'envid' with permission 'perm', using a
+// single page directory entry.  Anything mapped in [va, va+PTSIZE) is
+// unmapped first.  Large pages are mapped and unmapped whole, and are
+// never copy-on-write: fork shares them with the child.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not PTSIZE-aligned.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if the CPU does not support 4MB pages.
+//	-E_NO_MEM if there is no free 4MB block, or envid would go
+//		over its page limit.
+static int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+   struct Env *e;
+   struct PageInfo *page;
+   int error;
+
+   if (!pse_enabled)
+      return -E_INVAL;
+   // Check if va >= UTOP and not large page aligned
+   if ((uintptr_t)va >= UTOP || (uintptr_t)va & (PTSIZE - 1))
+      return -E_INVAL;
+   // Check if the permission bits are valid
+   if (!(perm & (PTE_U | PTE_P)) || perm & ~PTE_SYSCALL)
+      return -E_INVAL;
+   if ((error = envid2env(envid, &e, 1)) < 0)
+      return error;
+   if ((error = check_page_limit(e, NPTENTRIES)) < 0)
+      return error;
+   // A 4MB block is the buddy allocator's largest order
+   if (!(page = buddy_alloc(ALLOC_ZERO, BUDDY_MAXORDER)))
+      return -E_NO_MEM;
+
+   page_insert_large(e->env_pgdir, page, va, perm);
+   return 0;
+}
+
 
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
@@ -274,7 +403,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
-//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables,
+//		or dstenvid would go over its page limit.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
 	     envid_t dstenvid, void *dstva, int perm)
@@ -308,9 +438,27 @@ sys_page_map(envid_t srcenvid, void *srcva,
    // Check if the permission bits are valid
    if (!(perm & (PTE_U | PTE_P)) || perm & ~PTE_SYSCALL)
       return -E_INVAL;
+   // A writable mapping of a copy-on-write page needs srcenvid to
+   // have its own copy first, just as if it had written to the page
+   if (perm & PTE_W && *ptEntry & PTE_COW) {
+      if ((error = page_cow_fault(srce->env_pgdir, srcva)) < 0)
+         return error;
+      page = page_lookup(srce->env_pgdir, srcva, &ptEntry);
+   }
    // If srcva is read-only, perm cannot have write in it
    if (perm & PTE_W && !(*ptEntry & PTE_W))
       return -E_INVAL;
+   // Large pages can only be mapped whole, at a PTSIZE-aligned dstva
+   if (*ptEntry & PTE_PS) {
+      if ((uintptr_t)srcva & (PTSIZE - 1) || (uintptr_t)dstva & (PTSIZE - 1))
+         return -E_INVAL;
+      if ((error = check_map_limit(dste, dstva, 1)) < 0)
+         return error;
+      page_insert_large(dste->env_pgdir, page, dstva, perm);
+      return 0;
+   }
+   if ((error = check_map_limit(dste, dstva, 0)) < 0)
+      return error;
    // Insert page into dst env address space
    if ((error = page_insert(dste->env_pgdir, page, dstva, perm)) < 0)
       return error;    
@@ -348,26 +496,489 @@ sys_page_unmap(envid_t envid, void *va)
    return 0;
 }
 
+// Check that [va, va+len) is a page-aligned range below UTOP.
+static int
+check_user_range(void *va, size_t len)
+{
+   if ((uintptr_t)va & 0xFFF || len & 0xFFF)
+      return -E_INVAL;
+   if ((uintptr_t)va >= UTOP || len > UTOP - (uintptr_t)va)
+      return -E_INVAL;
+   return 0;
+}
+
+// Allocate zeroed pages for the whole range [va, va+len) of envid's
+// address space, like sys_page_alloc on each page in turn (so private
+// pages are the zero page until written).  On error, the pages mapped
+// so far are unmapped again, so whatever was mapped in that part of the
+// range before the call is lost; the rest of the range is untouched.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va or len is not page-aligned, or the range
+//		reaches above UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no memory for the pages or page tables,
+//		or envid would go over its page limit.
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+   uintptr_t cur, start = (uintptr_t)va, end = (uintptr_t)va + len;
+   struct Env *e;
+   struct PageInfo *page;
+   int error;
+
+   if ((error = check_user_range(va, len)) < 0)
+      return error;
+   if (!(perm & (PTE_U | PTE_P)) || perm & ~PTE_SYSCALL)
+      return -E_INVAL;
+   if ((error = envid2env(envid, &e, 1)) < 0)
+      return error;
+   if ((error = check_page_limit(e, len / PGSIZE)) < 0)
+      return error;
+
+   for (cur = start; cur < end; cur += PGSIZE) {
+      if (!(perm & PTE_SHARE)) {
+         if ((error = page_insert_zero(e->env_pgdir, (void *)cur, perm)) < 0)
+            goto fail;
+         continue;
+      }
+      if (!(page = page_alloc_va(ALLOC_ZERO, (void *)cur))) {
+         error = -E_NO_MEM;
+         goto fail;
+      }
+      if ((error = page_insert(e->env_pgdir, page, (void *)cur, perm)) < 0) {
+         page_free(page);
+         goto fail;
+      }
+   }
+   return 0;
+
+fail:
+   // Take back the part of the range we already mapped
+   while (cur > start) {
+      cur -= PGSIZE;
+      page_remove(e->env_pgdir, (void *)cur);
+   }
+   return error;
+}
+
+// Map every page mapped in [srcva, srcva+len) of srcenvid's address
+// space at the same offset from dstva in dstenvid's, keeping each
+// page's own PTE_SYSCALL permissions.  Unmapped source pages are
+// skipped.  Large pages must be covered whole by both ranges.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change one of them.
+//	-E_INVAL if srcva, dstva or len is not page-aligned, or either
+//		range reaches above UTOP.
+//	-E_INVAL if the range covers only part of a large page.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables,
+//		or dstenvid would go over its page limit.  The pages before
+//		the one that failed stay mapped.
+static int
+sys_page_map_range(envid_t srcenvid, void *srcva,
+                   envid_t dstenvid, void *dstva, size_t len)
+{
+   uintptr_t off;
+   struct Env *srce, *dste;
+   struct PageInfo *page;
+   pte_t *ptEntry;
+   int error;
+
+   if ((error = check_user_range(srcva, len)) < 0
+       || (error = check_user_range(dstva, len)) < 0)
+      return error;
+   if ((error = envid2env(srcenvid, &srce, 1)) < 0)
+      return error;
+   if ((error = envid2env(dstenvid, &dste, 1)) < 0)
+      return error;
+
+   for (off = 0; off < len; off += PGSIZE) {
+      if (!(page = page_lookup(srce->env_pgdir, (char *)srcva + off, &ptEntry)))
+         continue;
+      if (*ptEntry & PTE_PS) {
+         if (((uintptr_t)srcva + off) & (PTSIZE - 1)
+             || ((uintptr_t)dstva + off) & (PTSIZE - 1) || len - off < PTSIZE)
+            return -E_INVAL;
+         if ((error = check_map_limit(dste, (char *)dstva + off, 1)) < 0)
+            return error;
+         page_insert_large(dste->env_pgdir, page, (char *)dstva + off,
+                           *ptEntry & PTE_SYSCALL);
+         off += PTSIZE - PGSIZE;
+         continue;
+      }
+      if ((error = check_map_limit(dste, (char *)dstva + off, 0)) < 0)
+         return error;
+      if ((error = page_insert(dste->env_pgdir, page, (char *)dstva + off,
+                               *ptEntry & PTE_SYSCALL)) < 0)
+         return error;
+   }
+   return 0;
+}
+
+// Unmap every page in [va, va+len) of envid's address space.
+// Unmapped pages are silently skipped.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va or len is not page-aligned, or the range
+//		reaches above UTOP.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+   uintptr_t cur, end = (uintptr_t)va + len;
+   struct Env *e;
+   int error;
+
+   if ((error = check_user_range(va, len)) < 0)
+      return error;
+   if ((error = envid2env(envid, &e, 1)) < 0)
+      return error;
+
+   for (cur = (uintptr_t)va; cur < end; cur += PGSIZE) {
+      // Skip over holes with no page table
+      if (!(e->env_pgdir[PDX(cur)] & PTE_P)) {
+         cur = ROUNDDOWN(cur, PTSIZE) + PTSIZE - PGSIZE;
+         continue;
+      }
+      page_remove(e->env_pgdir, (void *)cur);
+   }
+   return 0;
+}
+
+// Change the permissions of every page mapped in [va, va+len) of
+// envid's address space to 'perm'.  Unmapped pages are skipped.  Like
+// sys_page_map, this cannot make a read-only page writable, and
+// copy-on-write pages stay copy-on-write if perm has PTE_W.  Nothing
+// is changed unless the whole range can be.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va or len is not page-aligned, or the range
+//		reaches above UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_W), but a page in the range is read-only.
+//	-E_INVAL if the range covers only part of a large page.
+static int
+sys_page_protect_range(envid_t envid, void *va, size_t len, int perm)
+{
+   uintptr_t cur, end = (uintptr_t)va + len;
+   struct Env *e;
+   pte_t *ptEntry;
+   int error, apply, pteperm;
+
+   if ((error = check_user_range(va, len)) < 0)
+      return error;
+   if (!(perm & (PTE_U | PTE_P)) || perm & ~PTE_SYSCALL)
+      return -E_INVAL;
+   if ((error = envid2env(envid, &e, 1)) < 0)
+      return error;
+
+   // Check the whole range first, then change it
+   for (apply = 0; apply < 2; apply++) {
+      for (cur = (uintptr_t)va; cur < end; cur += PGSIZE) {
+         if (!page_lookup(e->env_pgdir, (void *)cur, &ptEntry))
+            continue;
+         if (!apply) {
+            if (perm & PTE_W && !(*ptEntry & (PTE_W | PTE_COW)))
+               return -E_INVAL;
+            if (*ptEntry & PTE_PS && (cur & (PTSIZE - 1) || end - cur < PTSIZE))
+               return -E_INVAL;
+         }
+         else {
+            pteperm = perm;
+            if (*ptEntry & PTE_COW && perm & PTE_W)
+               pteperm = (perm & ~PTE_W) | PTE_COW;
+            *ptEntry = PTE_ADDR(*ptEntry) | (*ptEntry & PTE_PS) | pteperm | PTE_P;
+            tlb_invalidate(e->env_pgdir, (void *)cur);
+         }
+         if (*ptEntry & PTE_PS)
+            cur += PTSIZE - PGSIZE;
+      }
+   }
+   return 0;
+}
+
+// Perform 'n' sys_page_map calls from srcenvid to dstenvid in one
+// system call, one for each of the requests in 'reqs'.  The requests
+// are done in order, stopping at the first one that fails.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if n > PAGEMAP_BATCH_MAX.
+//	Any error from sys_page_map.
+//	Destroys the environment if 'reqs' is not readable.
+static int
+sys_page_map_batch(envid_t srcenvid, envid_t dstenvid,
+                   const struct PageMapReq *reqs, size_t n)
+{
+   size_t i;
+   int error;
+
+   if (n > PAGEMAP_BATCH_MAX)
+      return -E_INVAL;
+   user_mem_assert(curenv, reqs, n * sizeof(*reqs), PTE_U);
+
+   for (i = 0; i < n; i++)
+      if ((error = sys_page_map(srcenvid, reqs[i].srcva, dstenvid,
+                                reqs[i].dstva, reqs[i].perm)) < 0)
+         return error;
+   return 0;
+}
+
+// Hand 'msg' to 'e', which is waiting in sys_ipc_recv: map its pages,
+// as many as e asked for and its page limit allows, from env_ipc_dstva
+// on and fill in e's ipc fields.  The references msg held on its pages
+// are dropped either way.
+static int
+ipc_deliver(struct Env *e, struct IpcMsg *msg)
+{
+   struct IpcPage *run;
+   uint32_t i;
+   int error;
+
+   e->env_ipc_perm = 0;
+   e->env_ipc_npages = 0;
+   if (msg->im_run) {
+      run = page2kva(msg->im_run);
+      for (i = 0; i < msg->im_npages && i < e->env_ipc_dstmax; i++) {
+         if (check_map_limit(e, (char *)e->env_ipc_dstva + i * PGSIZE, 0) < 0)
+            break;
+         if ((error = page_insert(e->env_pgdir, run[i].ip_page,
+                                  (char *)e->env_ipc_dstva + i * PGSIZE,
+                                  run[i].ip_perm)) < 0)
+            return error;
+      }
+      if (i)
+         e->env_ipc_perm = run[0].ip_perm;
+      e->env_ipc_npages = i;
+   }
+   else if (msg->im_page && e->env_ipc_dstmax
+            && !check_map_limit(e, e->env_ipc_dstva, 0)) {
+      if ((error = page_insert(e->env_pgdir, msg->im_page, e->env_ipc_dstva,
+                               msg->im_perm)) < 0)
+         return error;
+      e->env_ipc_perm = msg->im_perm;
+      e->env_ipc_npages = 1;
+   }
+   ipc_msg_free(msg);
+
+   e->env_ipc_recving = 0;
+   e->env_ipc_callee = 0;
+   e->env_ipc_from = msg->im_from;
+   e->env_ipc_value = msg->im_value;
+   return 0;
+}
+
+// Take a reference to curenv's page at 'srcva' for sending with 'perm',
+// storing it in *page_store.
+// See sys_ipc_try_send for the errors.
+static int
+ipc_take_page(void *srcva, unsigned perm, struct PageInfo **page_store)
+{
+   struct PageInfo *page;
+   pte_t *ptEntry;
+   int error;
+
+   if ((uintptr_t)srcva >= UTOP)
+      return -E_INVAL;
+   // Check if we're page aligned
+   if ((uintptr_t)srcva & 0xFFF)
+      return -E_INVAL;
+   // Check if the permission bits are valid
+   if (!(perm & (PTE_U | PTE_P)) || perm & ~PTE_SYSCALL)
+      return -E_INVAL;
+   // Check if srcva is mapped in current env's address space 
+   if (!(page = page_lookup(curenv->env_pgdir, srcva, &ptEntry)))
+      return -E_INVAL;
+   // Copy-on-write pages are copied before being sent writable
+   if (perm & PTE_W && *ptEntry & PTE_COW) {
+      if ((error = page_cow_fault(curenv->env_pgdir, srcva)) < 0)
+         return error;
+      page = page_lookup(curenv->env_pgdir, srcva, &ptEntry);
+   }
+   // Check if entry at srcva is read-only
+   if (perm & PTE_W && !(*ptEntry & PTE_W))
+      return -E_INVAL;
+   // Large pages cannot be sent a piece at a time
+   if (*ptEntry & PTE_PS)
+      return -E_INVAL;
+   // The message keeps the page alive until it's received
+   page_incref(page);
+   *page_store = page;
+   return 0;
+}
+
+// Fill in 'msg' for a send from curenv of 'value', plus the page at
+// 'srcva' with 'perm' if srcva < UTOP, taking a reference to the page.
+// See sys_ipc_try_send for the errors.
+static int
+ipc_prepare(struct IpcMsg *msg, uint32_t value, void *srcva, unsigned perm)
+{
+   int error;
+
+   msg->im_from = curenv->env_id;
+   msg->im_value = value;
+   msg->im_page = NULL;
+   msg->im_perm = 0;
+   msg->im_npages = 0;
+   msg->im_run = NULL;
+
+   if ((uintptr_t)srcva >= UTOP)
+      return 0;
+   if ((error = ipc_take_page(srcva, perm, &msg->im_page)) < 0)
+      return error;
+   msg->im_perm = perm;
+   msg->im_npages = 1;
+   return 0;
+}
+
+// Fill in 'msg' for a send from curenv of 'value', plus the pages of
+// the 'nsegs' runs in 'segs', in order, taking a reference to each.
+// A message of more than one page keeps them in a page of struct
+// IpcPages of its own.
+// See sys_ipc_sendv for the errors.
+static int
+ipc_preparev(struct IpcMsg *msg, uint32_t value, const struct IpcSeg *segs,
+             size_t nsegs)
+{
+   struct IpcSeg seg;
+   struct IpcPage *run;
+   size_t i, j, n = 0;
+   int error;
+
+   static_assert(IPC_MAXPAGES * sizeof(struct IpcPage) <= PGSIZE);
+
+   if (nsegs > IPC_MAXPAGES)
+      return -E_INVAL;
+   user_mem_assert(curenv, segs, nsegs * sizeof(*segs), PTE_U);
+   for (i = 0; i < nsegs; i++) {
+      if (segs[i].npages > IPC_MAXPAGES - n)
+         return -E_INVAL;
+      n += segs[i].npages;
+   }
+   if (n <= 1) {
+      for (i = 0; i < nsegs && !segs[i].npages; i++)
+         ;
+      seg = i < nsegs ? segs[i] : (struct IpcSeg) { (void *)UTOP, 0, 0 };
+      if (seg.npages && (uintptr_t)seg.va >= UTOP)
+         return -E_INVAL;
+      return ipc_prepare(msg, value, seg.va, seg.perm);
+   }
+
+   if ((error = ipc_prepare(msg, value, (void *)UTOP, 0)) < 0)
+      return error;
+   if (!(msg->im_run = page_alloc(ALLOC_ZERO)))
+      return -E_NO_MEM;
+   msg->im_run->pp_ref++;
+   run = page2kva(msg->im_run);
+   for (i = 0; i < nsegs; i++) {
+      // Read each run once: another env may be changing them
+      seg = segs[i];
+      for (j = 0; j < seg.npages; j++) {
+         if (msg->im_npages == n)
+            error = -E_INVAL;
+         else
+            error = ipc_take_page((char *)seg.va + j * PGSIZE, seg.perm,
+                                  &run[msg->im_npages].ip_page);
+         if (error < 0) {
+            ipc_msg_free(msg);
+            return error;
+         }
+         run[msg->im_npages++].ip_perm = seg.perm;
+      }
+   }
+   return 0;
+}
+
+// Read the run to receive pages into, 'dst' (NULL for none), from user
+// space into *dstva_store and *dstmax_store.
+// Returns 0 on success, -E_INVAL if the run is not page-aligned or
+// reaches past UTOP.  Destroys curenv if 'dst' is not readable.
+static int
+ipc_window(const struct IpcSeg *dst, void **dstva_store,
+           uint32_t *dstmax_store)
+{
+   struct IpcSeg seg;
+
+   *dstva_store = (void *)UTOP;
+   *dstmax_store = 0;
+   if (!dst)
+      return 0;
+   user_mem_assert(curenv, dst, sizeof(*dst), PTE_U);
+   seg = *dst;
+   if ((uintptr_t)seg.va >= UTOP || !seg.npages)
+      return 0;
+   if ((uintptr_t)seg.va & 0xFFF || seg.npages > IPC_MAXPAGES
+       || seg.npages > (UTOP - (uintptr_t)seg.va) / PGSIZE)
+      return -E_INVAL;
+   *dstva_store = seg.va;
+   *dstmax_store = seg.npages;
+   return 0;
+}
+
+// True if e is blocked receiving and takes a message from 'from' right
+// now: it's in sys_ipc_recv, or in a sys_ipc_call to 'from'.
+static bool
+ipc_open(struct Env *e, envid_t from)
+{
+   return e->env_ipc_recving
+          && (!e->env_ipc_callee || e->env_ipc_callee == from);
+}
+
+// True if a message from curenv to 'e' would have to wait: e won't
+// take it right now and its queue is full.
+static bool
+ipc_full(struct Env *e)
+{
+   return !ipc_open(e, curenv->env_id)
+          && e->env_ipc_qlen >= e->env_ipc_qdepth;
+}
+
+// Deliver 'msg' to e if it's blocked waiting for it (see ipc_open), or
+// else put it at the back of e's queue.  e must not be ipc_full.  On
+// error the caller still owns msg's page reference.
+static int
+ipc_post(struct Env *e, struct IpcMsg *msg)
+{
+   int error;
+
+   if (ipc_open(e, msg->im_from)) {
+      if ((error = ipc_deliver(e, msg)) < 0)
+         return error;
+      // Mark the target env runnable again
+      e->env_status = ENV_RUNNABLE;
+      return 0;
+   }
+
+   e->env_ipc_queue[(e->env_ipc_qhead + e->env_ipc_qlen) % IPC_QMAX] = *msg;
+   e->env_ipc_qlen++;
+   return 0;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
 //
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
-//
-// The send also can fail for the other reasons listed below.
-//
-// Otherwise, the send succeeds, and the target's ipc fields are
-// updated as follows:
+// If the target is blocked in sys_ipc_recv, the message is delivered
+// right away: the target's ipc fields are updated as follows:
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
 //    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
-// The target environment is marked runnable again, returning 0
-// from the paused sys_ipc_recv system call.  (Hint: does the
-// sys_ipc_recv function ever actually return?)
+// and the target is marked runnable again, returning 0 from the paused
+// sys_ipc_recv system call.
 //
-// If the sender wants to send a page but the receiver isn't asking for one,
+// Otherwise the message (with a reference to the page) is put at the
+// back of the target's queue, for a later sys_ipc_recv to pick up.
+// The send fails with -E_IPC_NOT_RECV if the queue already holds
+// env_ipc_qdepth messages.
+//
+// If the sender sends a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
 // The ipc only happens when no errors occur.
 //
@@ -375,8 +986,8 @@ sys_page_unmap(envid_t envid, void *va)
 // Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//	-E_IPC_NOT_RECV if envid is not blocked in sys_ipc_recv and
+//		its queue is full.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -391,93 +1002,580 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 
-   struct PageInfo *page;
-   pte_t *ptEntry;
+   struct IpcMsg msg;
    struct Env *e;
    int error;
 
    // Get the env struct (NOT checking permissions)
    if ((error = envid2env(envid, &e, 0)) < 0)
       return error;
-   // See if the destination env is blocked
-   if (!e->env_ipc_recving)
+   // Nowhere to put the message
+   if (ipc_full(e))
       return -E_IPC_NOT_RECV;
 
-   // Block other threads from sending
-   e->env_ipc_recving = 0;
-   e->env_ipc_from = curenv->env_id;
-   // Send the value
-   e->env_ipc_value = value;
-   e->env_ipc_perm = 0;
+   if ((error = ipc_prepare(&msg, value, srcva, perm)) < 0)
+      return error;
+   if ((error = ipc_post(e, &msg)) < 0)
+      ipc_msg_free(&msg);
+   return error;
+}
 
-   // Check if both src and dst agree that a page is to be transferred
-   if ((uintptr_t)srcva < UTOP && (uintptr_t)e->env_ipc_dstva < UTOP) {
-      // Check if we're page aligned
-      if ((uintptr_t)srcva & 0xFFF)
-         return -E_INVAL;
-      // Check if the permission bits are valid
-      if (!(perm & (PTE_U | PTE_P)) || perm & ~PTE_SYSCALL)
-         return -E_INVAL;
-      // Check if srcva is mapped in current env's address space 
-      if (!(page = page_lookup(curenv->env_pgdir, srcva, &ptEntry)))
-         return -E_INVAL;
-      // Check if entry at srcva is read-only
-      if (perm & PTE_W && !(*ptEntry & PTE_W))
-         return -E_INVAL;
-      // Map the page
-      if ((error = page_insert(e->env_pgdir, page, e->env_ipc_dstva, perm)) < 0)
-         return error;    
+// Block curenv at the back of e's line of senders, with 'msg' to go
+// into e's queue once there's room.  If 'calling', curenv then waits
+// for a message in sys_ipc_recv style.
+static void __attribute__((noreturn))
+ipc_block_send(struct Env *e, struct IpcMsg *msg, bool calling)
+{
+   curenv->env_ipc_sendmsg = *msg;
+   curenv->env_ipc_sendto = e->env_id;
+   curenv->env_ipc_calling = calling;
+   curenv->env_ipc_sendnext = NULL;
+   if (e->env_ipc_waittail)
+      e->env_ipc_waittail->env_ipc_sendnext = curenv;
+   else
+      e->env_ipc_waithead = curenv;
+   e->env_ipc_waittail = curenv;
+
+   // Return 0 once the receiver takes the message
+   curenv->env_tf.tf_regs.reg_eax = 0;
+   curenv->env_status = ENV_NOT_RUNNABLE;
+   sched_yield();
+}
+
+// Post the prepared 'msg' to e, first blocking until e has room for it
+// if need be.
+static int
+ipc_send_prepared(struct Env *e, struct IpcMsg *msg)
+{
+   int error;
 
-      e->env_ipc_perm = perm;
+   if (!ipc_full(e)) {
+      if ((error = ipc_post(e, msg)) < 0)
+         ipc_msg_free(msg);
+      return error;
    }
+   ipc_block_send(e, msg, 0);
+}
 
-   // Mark the target env runnable again
-   e->env_status = ENV_RUNNABLE;
+// Like sys_ipc_try_send, but if the target's queue is full, block
+// until the target receives enough to make room for this message.
+// Senders blocked on the same target get in in the order they came.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, except:
+//	-E_IPC_NOT_RECV only if envid is the caller itself (or a
+//		FlexSC thread is sending), which can't wait.
+//	-E_BAD_ENV if envid is destroyed before it takes the message.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+   struct IpcMsg msg;
+   struct Env *e;
+   int error;
+
+   if ((error = envid2env(envid, &e, 0)) < 0)
+      return error;
+   if (ipc_full(e) && (e == curenv || curenv->env_type == ENV_TYPE_FLEX))
+      return -E_IPC_NOT_RECV;
+
+   if ((error = ipc_prepare(&msg, value, srcva, perm)) < 0)
+      return error;
+   return ipc_send_prepared(e, &msg);
+}
+
+// Like sys_ipc_send, but sends the pages of the 'nsegs' runs in 'segs',
+// in order, as one message.  The receiver gets them mapped one after
+// another from its dstva, as many as it asked for (see
+// sys_ipc_reply_waitv); env_ipc_perm is the perm of the first.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_send, and:
+//	-E_INVAL if there are more than IPC_MAXPAGES pages in all, or a
+//		run reaches past UTOP.
+//	-E_NO_MEM if there's no memory to hold a message of many pages.
+//	Destroys the environment if 'segs' is not readable.
+static int
+sys_ipc_sendv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+              size_t nsegs)
+{
+   struct IpcMsg msg;
+   struct Env *e;
+   int error;
+
+   if ((error = envid2env(envid, &e, 0)) < 0)
+      return error;
+   if (ipc_full(e) && (e == curenv || curenv->env_type == ENV_TYPE_FLEX))
+      return -E_IPC_NOT_RECV;
 
+   if ((error = ipc_preparev(&msg, value, segs, nsegs)) < 0)
+      return error;
+   return ipc_send_prepared(e, &msg);
+}
+
+static int ipc_dequeue(struct Env *e);
+
+// Move the message of the oldest sender blocked on e to the back of
+// e's queue, and let that sender go.
+static void
+ipc_admit(struct Env *e)
+{
+   struct Env *w = e->env_ipc_waithead;
+
+   if (!(e->env_ipc_waithead = w->env_ipc_sendnext))
+      e->env_ipc_waittail = NULL;
+   e->env_ipc_queue[(e->env_ipc_qhead + e->env_ipc_qlen) % IPC_QMAX] =
+      w->env_ipc_sendmsg;
+   e->env_ipc_qlen++;
+   w->env_ipc_sendto = 0;
+
+   // A sys_ipc_call goes on to wait for e's reply
+   if (w->env_ipc_calling) {
+      w->env_ipc_calling = 0;
+      w->env_ipc_callee = e->env_id;
+      w->env_ipc_recving = 1;
+      return;
+   }
+   w->env_status = ENV_RUNNABLE;
+}
+
+// Take the oldest message off e's queue and deliver it to e, refilling
+// the queue from e's blocked senders.
+static int
+ipc_dequeue(struct Env *e)
+{
+   int error;
+
+   // Even a queue of depth 0 passes messages through one at a time
+   if (!e->env_ipc_qlen)
+      ipc_admit(e);
+   if ((error = ipc_deliver(e, &e->env_ipc_queue[e->env_ipc_qhead])) < 0)
+      return error;
+   e->env_ipc_qhead = (e->env_ipc_qhead + 1) % IPC_QMAX;
+   e->env_ipc_qlen--;
+   while (e->env_ipc_waithead && e->env_ipc_qlen < e->env_ipc_qdepth)
+      ipc_admit(e);
    return 0;
 }
 
-// Block until a value is ready.  Record that you want to receive
-// using the env_ipc_recving and env_ipc_dstva fields of struct Env,
-// mark yourself not runnable, and then give up the CPU.
+// Receive into curenv, whose env_ipc_dstva is set: take a waiting
+// message, or else block until one comes.  If 'partner' was just made
+// runnable, switch straight to it rather than through the scheduler.
+static int
+ipc_wait(struct Env *partner)
+{
+   if (curenv->env_ipc_qlen || curenv->env_ipc_waithead)
+      return ipc_dequeue(curenv);
+
+   curenv->env_ipc_recving = 1;
+
+   // Simulate a 0 return value sometime in the future
+   curenv->env_tf.tf_regs.reg_eax = 0;
+
+   // Block this env
+   curenv->env_status = ENV_NOT_RUNNABLE; 
+   if (partner && partner != curenv && partner->env_status == ENV_RUNNABLE
+       && partner->env_type != ENV_TYPE_FLEX)
+      env_run(partner);
+   sched_yield();
+}
+
+// Receive the oldest message in our queue (or from a sender blocked on
+// us), or if there is none, block until a value is ready.  Record that
+// you want to receive using the env_ipc_recving and env_ipc_dstva fields
+// of struct Env, mark yourself not runnable, and then give up the CPU.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
-// This function only returns on error, but the system call will eventually
+// Returns 0 at once if a waiting message was received.  Otherwise this
+// function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_NO_MEM if there's not enough memory to map a waiting page.
 static int
 sys_ipc_recv(void *dstva)
 {
+   struct Env *e;
+
+   if ((uintptr_t)dstva < UTOP && (uintptr_t)dstva & 0xFFF)
+      return -E_INVAL;
+
    // FlexSC IPC only handle passing values for now
    if (curenv->env_type == ENV_TYPE_FLEX) {
+      e = curenv->link;
+      e->env_ipc_dstva = (void *)UTOP;
+      e->env_ipc_dstmax = 0;
+      if (e->env_ipc_qlen || e->env_ipc_waithead)
+         return ipc_dequeue(e);
       // Tell them we're ready to receive
-      curenv->link->env_ipc_recving = 1;
+      e->env_ipc_recving = 1;
       // Put user process to sleep
-      curenv->link->env_status = ENV_NOT_RUNNABLE;
+      e->env_status = ENV_NOT_RUNNABLE;
       return -E_BLOCKED;
    } 
 
 	// LAB 4: Your code here.
    
+   curenv->env_ipc_dstva = dstva;
+   curenv->env_ipc_dstmax = (uintptr_t)dstva < UTOP;
+   return ipc_wait(NULL);
+}
+
+// Set how many messages may wait in the caller's IPC queue before
+// sends to it fail with -E_IPC_NOT_RECV (or block, for sys_ipc_send).
+// Messages already queued beyond a lowered depth are still delivered.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if depth > IPC_QMAX.
+static int
+sys_ipc_set_queue(unsigned depth)
+{
+   if (depth > IPC_QMAX)
+      return -E_INVAL;
+   curenv->env_ipc_qdepth = depth;
+   // Room for senders that were waiting
+   while (curenv->env_ipc_waithead && curenv->env_ipc_qlen < depth)
+      ipc_admit(curenv);
+   return 0;
+}
+
+// Block curenv until e replies to its call, leaving messages from
+// anyone else in the queue.  If e was just made runnable, switch
+// straight to it.
+static int
+ipc_wait_reply(struct Env *e)
+{
+   curenv->env_ipc_callee = e->env_id;
    curenv->env_ipc_recving = 1;
-   
-   if ((uintptr_t)dstva < UTOP) {
-      if ((uintptr_t)dstva & 0xFFF)
-         return -E_INVAL;
-      curenv->env_ipc_dstva = dstva;
-   } 
 
    // Simulate a 0 return value sometime in the future
    curenv->env_tf.tf_regs.reg_eax = 0;
 
-   // Block this env
-   curenv->env_status = ENV_NOT_RUNNABLE; 
+   curenv->env_status = ENV_NOT_RUNNABLE;
+   if (e->env_status == ENV_RUNNABLE && e->env_type != ENV_TYPE_FLEX)
+      env_run(e);
    sched_yield();
+}
 
-	return 0;
+// Post the prepared request 'msg' to e, blocking until e has room for
+// it if need be, then wait for e's reply of up to 'dstmax' pages at
+// 'dstva'.
+static int
+ipc_call_prepared(struct Env *e, struct IpcMsg *msg, void *dstva,
+                  uint32_t dstmax)
+{
+   int error;
+
+   curenv->env_ipc_dstva = dstva;
+   curenv->env_ipc_dstmax = dstmax;
+   if (ipc_full(e))
+      ipc_block_send(e, msg, 1);
+   if ((error = ipc_post(e, msg)) < 0) {
+      ipc_msg_free(msg);
+      return error;
+   }
+   return ipc_wait_reply(e);
+}
+
+// Send a request to 'envid' as sys_ipc_send does, then wait for the
+// reply as sys_ipc_recv(dstva) does, all in one system call.  If the
+// request is delivered to envid blocked in sys_ipc_recv, we switch
+// straight to it.  Only envid's reply ends the call: messages from
+// other envs stay in our queue for a later receive.
+//
+// Returns 0 once the reply arrives, < 0 on error.  Errors are those of
+// sys_ipc_send and sys_ipc_recv, and:
+//	-E_INVAL if envid is the caller, or called by a FlexSC thread.
+//	-E_BAD_ENV if envid is destroyed before it replies.
+// If sending fails, nothing is received.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+             void *dstva)
+{
+   struct IpcMsg msg;
+   struct Env *e;
+   int error;
+
+   if ((uintptr_t)dstva < UTOP && (uintptr_t)dstva & 0xFFF)
+      return -E_INVAL;
+   if (curenv->env_type == ENV_TYPE_FLEX)
+      return -E_INVAL;
+   if ((error = envid2env(envid, &e, 0)) < 0)
+      return error;
+   if (e == curenv)
+      return -E_INVAL;
+
+   if ((error = ipc_prepare(&msg, value, srcva, perm)) < 0)
+      return error;
+   return ipc_call_prepared(e, &msg, dstva, (uintptr_t)dstva < UTOP);
+}
+
+// Like sys_ipc_call, but sends the pages of 'segs' as sys_ipc_sendv
+// does, and takes up to dst->npages pages of reply from dst->va on.
+// A null 'dst' takes no pages.
+//
+// Returns 0 once the reply arrives, < 0 on error.  Errors are those of
+// sys_ipc_call and sys_ipc_sendv, and:
+//	-E_INVAL if dst is not page-aligned or reaches past UTOP.
+static int
+sys_ipc_callv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+              size_t nsegs, const struct IpcSeg *dst)
+{
+   struct IpcMsg msg;
+   struct Env *e;
+   uint32_t dstmax;
+   void *dstva;
+   int error;
+
+   if ((error = ipc_window(dst, &dstva, &dstmax)) < 0)
+      return error;
+   if (curenv->env_type == ENV_TYPE_FLEX)
+      return -E_INVAL;
+   if ((error = envid2env(envid, &e, 0)) < 0)
+      return error;
+   if (e == curenv)
+      return -E_INVAL;
+
+   if ((error = ipc_preparev(&msg, value, segs, nsegs)) < 0)
+      return error;
+   return ipc_call_prepared(e, &msg, dstva, dstmax);
+}
+
+// Post the reply 'msg' to envid if it can take it right away, and
+// otherwise drop it.  A caller waiting on us in sys_ipc_call always
+// can.  Returns the env it went to, or NULL.
+static struct Env *
+ipc_reply(envid_t envid, struct IpcMsg *msg)
+{
+   struct Env *e;
+
+   if (envid2env(envid, &e, 0) < 0 || ipc_full(e) || ipc_post(e, msg) < 0) {
+      ipc_msg_free(msg);
+      return NULL;
+   }
+   return e;
+}
+
+// Reply to 'envid' with 'value' (and the page at 'srcva' with 'perm',
+// if srcva < UTOP), then wait for the next message as
+// sys_ipc_recv(dstva) does, all in one system call.  The reply never
+// blocks.  An envid waiting on us in sys_ipc_call gets it at once;
+// any other envid gets it queued, or if its queue is full (or it's
+// gone), the reply is dropped.
+// If the reply wakes envid up, we switch straight to it.  An envid of
+// 0 means there is nothing to reply to.
+//
+// Returns 0 once a message arrives, < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if called by a FlexSC thread.
+//	-E_INVAL for a bad srcva or perm (see sys_ipc_try_send).
+//	-E_NO_MEM if there's not enough memory to map a waiting page.
+// Nothing is sent or received if the arguments are bad.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva,
+                   unsigned perm, void *dstva)
+{
+   struct IpcMsg msg;
+   struct Env *e = NULL;
+   int error;
+
+   if ((uintptr_t)dstva < UTOP && (uintptr_t)dstva & 0xFFF)
+      return -E_INVAL;
+   if (curenv->env_type == ENV_TYPE_FLEX)
+      return -E_INVAL;
+
+   if (envid) {
+      if ((error = ipc_prepare(&msg, value, srcva, perm)) < 0)
+         return error;
+      e = ipc_reply(envid, &msg);
+   }
+
+   curenv->env_ipc_dstva = dstva;
+   curenv->env_ipc_dstmax = (uintptr_t)dstva < UTOP;
+   return ipc_wait(e);
+}
+
+// Like sys_ipc_reply_wait, but replies with the pages of 'segs' as
+// sys_ipc_sendv does, and takes up to dst->npages pages of the next
+// message from dst->va on.  A null 'dst' takes no pages.  With an
+// envid of 0, this is sys_ipc_recv for many pages.
+//
+// Returns 0 once a message arrives, < 0 on error.  Errors are those of
+// sys_ipc_reply_wait and sys_ipc_sendv, and:
+//	-E_INVAL if dst is not page-aligned or reaches past UTOP.
+static int
+sys_ipc_reply_waitv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+                    size_t nsegs, const struct IpcSeg *dst)
+{
+   struct IpcMsg msg;
+   struct Env *e = NULL;
+   uint32_t dstmax;
+   void *dstva;
+   int error;
+
+   if ((error = ipc_window(dst, &dstva, &dstmax)) < 0)
+      return error;
+   if (curenv->env_type == ENV_TYPE_FLEX)
+      return -E_INVAL;
+
+   if (envid) {
+      if ((error = ipc_preparev(&msg, value, segs, nsegs)) < 0)
+         return error;
+      e = ipc_reply(envid, &msg);
+   }
+
+   curenv->env_ipc_dstva = dstva;
+   curenv->env_ipc_dstmax = dstmax;
+   return ipc_wait(e);
+}
+
+// Post the notification bits 'bits' to envid.  If envid is blocked in
+// sys_notify_wait on any of them, it wakes up and takes them; otherwise
+// they stay pending until it waits.  Bits aren't counted: posting a
+// bit twice before it's taken is the same as posting it once.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//		(No need to check permissions, as for IPC.)
+//	-E_INVAL if bits is 0 or has bit 31 set.
+static int
+sys_env_notify(envid_t envid, uint32_t bits)
+{
+   struct Env *e;
+   uint32_t got;
+   int error;
+
+   if (!bits || bits & 0x80000000)
+      return -E_INVAL;
+   if ((error = envid2env(envid, &e, 0)) < 0)
+      return error;
+
+   e->env_notify_pending |= bits;
+   if ((got = e->env_notify_pending & e->env_notify_waiting)) {
+      e->env_notify_pending &= ~got;
+      e->env_notify_waiting = 0;
+      e->env_tf.tf_regs.reg_eax = got;
+      e->env_status = ENV_RUNNABLE;
+   }
+   return 0;
+}
+
+// Take whichever of the notification bits in 'mask' are pending, or
+// if none are, block until one is posted with sys_env_notify.
+//
+// Returns the bits taken (> 0), or < 0 on error.  Errors are:
+//	-E_INVAL if mask is 0 or has bit 31 set.
+//	-E_INVAL if called by a FlexSC thread.
+static int
+sys_notify_wait(uint32_t mask)
+{
+   uint32_t got;
+
+   if (!mask || mask & 0x80000000 || curenv->env_type == ENV_TYPE_FLEX)
+      return -E_INVAL;
+
+   if ((got = curenv->env_notify_pending & mask)) {
+      curenv->env_notify_pending &= ~got;
+      return got;
+   }
+
+   curenv->env_notify_waiting = mask;
+   curenv->env_status = ENV_NOT_RUNNABLE;
+   sched_yield();
+}
+
+// Sleep until woken by sys_futex_wake on 'addr', if the word at 'addr'
+// still holds 'expected'.  Waiters are keyed on the physical address
+// of the word, so envs sharing the page wake each other.  If 'timeout'
+// is nonzero (and below 2^31), give up after that many milliseconds.
+// Waiters are also woken when a mapping of their page goes away, and
+// when an env whose env_status they're watching (through envs[]) is
+// freed, so callers should check their condition again after every
+// return.
+//
+// Returns 0 once woken, < 0 on error.  Errors are:
+//	-E_WOULD_BLOCK if *addr != expected.
+//	-E_TIMEOUT if the timeout passed first.
+//	-E_INVAL if addr isn't 4-byte aligned and readable by the caller.
+//	-E_INVAL if called by a FlexSC thread.
+//	-E_NO_MEM if addr is copy-on-write and can't be copied.
+static int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+   if (curenv->env_type == ENV_TYPE_FLEX)
+      return -E_INVAL;
+   return futex_wait(addr, expected, timeout);
+}
+
+// Wake up to 'n' envs asleep in sys_futex_wait on 'addr', oldest first.
+//
+// Returns the number woken, or < 0 on error.  Errors are:
+//	-E_INVAL if addr isn't 4-byte aligned and readable by the caller.
+//	-E_NO_MEM if addr is copy-on-write and can't be copied.
+static int
+sys_futex_wake(volatile uint32_t *addr, uint32_t n)
+{
+   return futex_wake(addr, n);
+}
+
+// Hand the page at 'srcva' over to whichever env next calls
+// sys_page_take on 'addr', a word that both envs map (usually through
+// a PTE_SHARE page).  The kernel holds the page until then.  With
+// PTE_W in 'perm', the page becomes copy-on-write for the caller and
+// the taker alike, so neither sees the other's later writes (a page
+// the caller can't write is only copy-on-write for the taker).  The
+// page is dropped if the page holding 'addr' is freed first.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_WOULD_BLOCK if a page is already waiting on 'addr'.
+//	-E_INVAL if addr isn't 4-byte aligned and writable by the caller.
+//	-E_INVAL if srcva >= UTOP, or srcva is not page-aligned or mapped.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc), or has
+//		PTE_SHARE, or srcva is a shared or large page, or is
+//		mapped anywhere else too.
+//	-E_NO_MEM if the kernel is already holding SPLICE_NSLOT pages.
+static int
+sys_page_give(volatile uint32_t *addr, void *srcva, int perm)
+{
+   return splice_give(addr, srcva, perm);
+}
+
+// Map the page waiting on 'addr' (see sys_page_give) at 'dstva' in
+// the caller's address space, unmapping whatever was there.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_WOULD_BLOCK if no page is waiting on 'addr'.
+//	-E_INVAL if addr isn't 4-byte aligned and writable by the caller.
+//	-E_INVAL if dstva >= UTOP or is not page-aligned.
+//	-E_NO_MEM if there's no memory for a page table.
+static int
+sys_page_take(volatile uint32_t *addr, void *dstva)
+{
+   return splice_take(addr, dstva);
+}
+
+// Register the caller as the server for env type 'type' in the
+// service table that every env sees at USERVICES, making it that type
+// of env.  The slot frees up when the server exits, so a new one can
+// take over; clients that look the server up each time follow it.
+// Only a server the kernel created as 'type', or a child of the last
+// server of that type, may register.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if type isn't a server type, or the caller is a FlexSC
+//		thread.
+//	-E_BAD_ENV if another live env is registered for 'type', or the
+//		caller may not take the slot.
+static int
+sys_service_register(enum EnvType type)
+{
+   if (curenv->env_type == ENV_TYPE_FLEX
+       || type <= ENV_TYPE_USER || type >= NSERVICE)
+      return -E_INVAL;
+   if (!service_may_register(curenv, type))
+      return -E_BAD_ENV;
+   return service_register(curenv, type);
 }
 
 // Return the current time.
@@ -510,6 +1608,35 @@ sys_net_recv_pckt(void *dstva)
    return recv_pckt(dstva);
 }
 
+// Set the most pages envid may have mapped below UTOP through the
+// allocation and mapping system calls (see check_page_limit), or 0 for
+// no limit.  Pages sent to it over IPC past the limit are dropped, as
+// if it hadn't asked for them.  Copy-on-write copies and fork don't
+// count, since they only replace or copy mappings already charged.
+// Children created afterwards inherit the limit.  The caller's own
+// limit is a ceiling: a limited env can't give itself or its children
+// a higher limit or none, so they can't escape it together.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if the caller has a limit and 'limit' is 0 or above it.
+static int
+sys_env_set_page_limit(envid_t envid, uint32_t limit)
+{
+   struct Env *e;
+   int error;
+
+   if ((error = envid2env(envid, &e, 1)) < 0)
+      return error;
+   if (curenv->env_page_limit
+       && (!limit || limit > curenv->env_page_limit))
+      return -E_INVAL;
+
+   e->env_page_limit = limit;
+   return 0;
+}
+
 // Challenge
 static int
 sys_env_set_priority(envid_t envid, int priority)
@@ -620,6 +1747,12 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
    case SYS_exofork:
       ret = sys_exofork();
       break;
+   case SYS_fork:
+      ret = sys_fork();
+      break;
+   case SYS_env_set_page_limit:
+      ret = sys_env_set_page_limit((envid_t)a1, (uint32_t)a2);
+      break;
    case SYS_env_set_status:
       ret = sys_env_set_status((envid_t)a1, (int)a2);
       break;
@@ -636,12 +1769,80 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
    case SYS_page_unmap:
       ret = sys_page_unmap((envid_t)a1, (void *)a2);
       break;
+   case SYS_page_alloc_large:
+      ret = sys_page_alloc_large((envid_t)a1, (void *)a2, (int)a3);
+      break;
+   case SYS_page_alloc_range:
+      ret = sys_page_alloc_range((envid_t)a1, (void *)a2, (size_t)a3, (int)a4);
+      break;
+   case SYS_page_map_range:
+      ret = sys_page_map_range((envid_t)a1, (void *)a2, (envid_t)a3,
+                               (void *)a4, (size_t)a5);
+      break;
+   case SYS_page_unmap_range:
+      ret = sys_page_unmap_range((envid_t)a1, (void *)a2, (size_t)a3);
+      break;
+   case SYS_page_protect_range:
+      ret = sys_page_protect_range((envid_t)a1, (void *)a2, (size_t)a3, (int)a4);
+      break;
+   case SYS_page_map_batch:
+      ret = sys_page_map_batch((envid_t)a1, (envid_t)a2,
+                               (const struct PageMapReq *)a3, (size_t)a4);
+      break;
    case SYS_ipc_try_send:
       ret = sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void *)a3, (unsigned)a4);
       break;
    case SYS_ipc_recv:
       ret = sys_ipc_recv((void *)a1);
       break;
+   case SYS_ipc_send:
+      ret = sys_ipc_send((envid_t)a1, (uint32_t)a2, (void *)a3, (unsigned)a4);
+      break;
+   case SYS_ipc_call:
+      ret = sys_ipc_call((envid_t)a1, (uint32_t)a2, (void *)a3, (unsigned)a4,
+                         (void *)a5);
+      break;
+   case SYS_ipc_reply_wait:
+      ret = sys_ipc_reply_wait((envid_t)a1, (uint32_t)a2, (void *)a3,
+                               (unsigned)a4, (void *)a5);
+      break;
+   case SYS_env_notify:
+      ret = sys_env_notify((envid_t)a1, (uint32_t)a2);
+      break;
+   case SYS_notify_wait:
+      ret = sys_notify_wait((uint32_t)a1);
+      break;
+   case SYS_futex_wait:
+      ret = sys_futex_wait((volatile uint32_t *)a1, (uint32_t)a2, (uint32_t)a3);
+      break;
+   case SYS_futex_wake:
+      ret = sys_futex_wake((volatile uint32_t *)a1, (uint32_t)a2);
+      break;
+   case SYS_page_give:
+      ret = sys_page_give((volatile uint32_t *)a1, (void *)a2, (int)a3);
+      break;
+   case SYS_page_take:
+      ret = sys_page_take((volatile uint32_t *)a1, (void *)a2);
+      break;
+   case SYS_service_register:
+      ret = sys_service_register((enum EnvType)a1);
+      break;
+   case SYS_ipc_sendv:
+      ret = sys_ipc_sendv((envid_t)a1, (uint32_t)a2,
+                          (const struct IpcSeg *)a3, (size_t)a4);
+      break;
+   case SYS_ipc_callv:
+      ret = sys_ipc_callv((envid_t)a1, (uint32_t)a2, (const struct IpcSeg *)a3,
+                          (size_t)a4, (const struct IpcSeg *)a5);
+      break;
+   case SYS_ipc_reply_waitv:
+      ret = sys_ipc_reply_waitv((envid_t)a1, (uint32_t)a2,
+                                (const struct IpcSeg *)a3, (size_t)a4,
+                                (const struct IpcSeg *)a5);
+      break;
+   case SYS_ipc_set_queue:
+      ret = sys_ipc_set_queue((unsigned)a1);
+      break;
    case SYS_env_set_priority:    // Lab 4 Challenge
       ret = sys_env_set_priority((envid_t)a1, (int)a2);
       break;
@@ -15,6 +15,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/flexsc.h>
+#include <kern/futex.h>
 
 static struct Taskstate ts;
 
@@ -105,6 +106,7 @@ void IRQ12();
 void IRQ13();
 void IRQIDE();
 void IRQERROR();
+void IRQTLB();
 
 void
 trap_init(void)
@@ -153,6 +155,7 @@ trap_init(void)
    SETGATE(idt[IRQ_OFFSET + 13], 0, GD_KT, IRQ13, 3);
    SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT, IRQIDE, 3);
    SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, IRQERROR, 3);
+   SETGATE(idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT, IRQTLB, 3);
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -315,10 +318,19 @@ trap_dispatch(struct Trapframe *tf)
 	// Be careful! In multiprocessors, clock interrupts are
 	// triggered on every CPU.
 	// LAB 6: Your code here.
+   // A TLB shootdown from another CPU has already been answered in
+   // trap(); all that is left is to acknowledge the interrupt
+   if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+      lapic_eoi();
+      return;
+   }
+
    if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
       // Timer only tick on CPU 0
-      if (cpunum() == 0)
+      if (cpunum() == 0) {
          time_tick();
+         futex_expire();
+      }
       lapic_eoi(); 
       sched_yield();
    }
@@ -357,10 +369,24 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Answer TLB shootdowns before waiting on the big kernel lock,
+	// since the CPU that sent them holds it until we have flushed.
+	// Shootdowns that arrive from now on are picked up once we have
+	// the lock.
+	xchg(&thiscpu->cpu_interruptible, 0);
+	tlb_shootdown_ack();
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB && (tf->tf_cs & 3) == 3) {
+		lapic_eoi();
+		xchg(&thiscpu->cpu_interruptible, 1);
+		env_pop_tf(tf);
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
 		lock_kernel();
+		tlb_shootdown_ack();
+	}
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -374,6 +400,7 @@ trap(struct Trapframe *tf)
 		assert(curenv);
 
       lock_kernel();
+      tlb_shootdown_ack();
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
@@ -467,6 +494,12 @@ page_fault_handler(struct Trapframe *tf)
 
    struct UTrapframe *utf = (void *)UXSTACKTOP;
 
+   // Writes to copy-on-write pages are handled right here, without
+   // bothering the user level handler
+   if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)
+       && fault_va < UTOP && page_cow_fault(curenv->env_pgdir, (void *)fault_va) == 0)
+      return;
+
    // Check if we have a user level page handler
    if (curenv->env_pgfault_upcall) {
       // Check if we're already in the user exception stack
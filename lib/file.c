@@ -4,28 +4,72 @@
 
 #define debug 0
 
-union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
+union Fsipc fsipcbuf __attribute__((aligned(PGSIZE))) THREADLOCAL;
+
+// Find the file server to send a request about 'fd' (or about no open
+// file, if fd is null) to.
+// Returns 0 on success, < 0 on failure:
+//	-E_BAD_ENV if there is no file server
+//	-E_INVAL if fd was opened in a file server that has since been
+//		replaced, which doesn't know its fileid
+static int
+fsipc_env(struct Fd *fd, envid_t *fsenv_store)
+{
+	uint32_t gen;
+
+	if (!(*fsenv_store = ipc_find_service(ENV_TYPE_FS, &gen)))
+		return -E_BAD_ENV;
+	if (fd && fd->fd_file.gen != gen)
+		return -E_INVAL;
+	return 0;
+}
 
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
 // type: request code, passed as the simple integer IPC value.
+// fd: the open file the request is about, 0 if none.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc(unsigned type, struct Fd *fd, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
+	envid_t fsenv;
+	int r;
 
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
+	if ((r = fsipc_env(fd, &fsenv)) < 0)
+		return r;
+
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
+// Like fsipc, but sends the 'npages' data pages at FSBIGBUF along with
+// fsipcbuf, all in one message, for a large request.
+static int
+fsipc_large(unsigned type, struct Fd *fd, size_t npages)
+{
+	struct IpcSeg segs[2] = {
+		{ &fsipcbuf, 1, PTE_P | PTE_W | PTE_U },
+		{ (void *) FSBIGBUF, npages, PTE_P | PTE_W | PTE_U },
+	};
+	envid_t fsenv;
+	int r;
+
+	if ((r = fsipc_env(fd, &fsenv)) < 0)
+		return r;
+	if ((r = ipc_buffer((void *) FSBIGBUF, npages)) < 0)
+		return r;
+
+	if (debug)
+		cprintf("[%08x] fsipc_large %d %d pages\n", thisenv->env_id, type, npages);
+
+	return ipc_callv(fsenv, type, segs, 2, NULL, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -41,6 +85,8 @@ struct Dev devfile =
 	.dev_read =	devfile_read,
 	.dev_close =	devfile_flush,
 	.dev_stat =	devfile_stat,
+	.dev_write =	devfile_write,
+	.dev_trunc =	devfile_trunc,
 };
 
 // Open a file (or directory).
@@ -78,7 +124,7 @@ open(const char *path, int mode)
 	strcpy(fsipcbuf.open.req_path, path);
 	fsipcbuf.open.req_omode = mode;
 
-	if ((r = fsipc(FSREQ_OPEN, fd)) < 0) {
+	if ((r = fsipc(FSREQ_OPEN, NULL, fd)) < 0) {
 		fd_close(fd, 0);
 		return r;
 	}
@@ -98,10 +144,12 @@ static int
 devfile_flush(struct Fd *fd)
 {
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	return fsipc(FSREQ_FLUSH, fd, NULL);
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
+// More than a page is read with one FSREQ_READ_LARGE, up to
+// FSLARGE_MAXPAGES pages of it.
 //
 // Returns:
 // 	The number of bytes successfully read.
@@ -113,11 +161,24 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// filling fsipcbuf.read with the request arguments.  The
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
+	size_t npages;
 	int r;
 
+	if (n > PGSIZE) {
+		npages = MIN(ROUNDUP(n, PGSIZE) / PGSIZE, FSLARGE_MAXPAGES);
+		n = MIN(n, npages * PGSIZE);
+		fsipcbuf.read.req_fileid = fd->fd_file.id;
+		fsipcbuf.read.req_n = n;
+		if ((r = fsipc_large(FSREQ_READ_LARGE, fd, npages)) < 0)
+			return r;
+		assert(r <= n);
+		memmove(buf, (void *) FSBIGBUF, r);
+		return r;
+	}
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+	if ((r = fsipc(FSREQ_READ, fd, NULL)) < 0)
 		return r;
 	assert(r <= n);
 	assert(r <= PGSIZE);
@@ -126,13 +187,42 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 }
 
 
+// Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
+// More than fits in the request page goes as one FSREQ_WRITE_LARGE, up
+// to FSLARGE_MAXPAGES pages of it.
+//
+// Returns:
+//	 The number of bytes successfully written.
+//	 < 0 on error.
+static ssize_t
+devfile_write(struct Fd *fd, const void *buf, size_t n)
+{
+	size_t npages;
+	int r;
+
+	fsipcbuf.write.req_fileid = fd->fd_file.id;
+	if (n > sizeof(fsipcbuf.write.req_buf)) {
+		npages = MIN(ROUNDUP(n, PGSIZE) / PGSIZE, FSLARGE_MAXPAGES);
+		n = MIN(n, npages * PGSIZE);
+		if ((r = ipc_buffer((void *) FSBIGBUF, npages)) < 0)
+			return r;
+		memmove((void *) FSBIGBUF, buf, n);
+		fsipcbuf.write.req_n = n;
+		return fsipc_large(FSREQ_WRITE_LARGE, fd, npages);
+	}
+
+	fsipcbuf.write.req_n = n;
+	memmove(fsipcbuf.write.req_buf, buf, n);
+	return fsipc(FSREQ_WRITE, fd, NULL);
+}
+
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
 	int r;
 
 	fsipcbuf.stat.req_fileid = fd->fd_file.id;
-	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
+	if ((r = fsipc(FSREQ_STAT, fd, NULL)) < 0)
 		return r;
 	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
 	st->st_size = fsipcbuf.statRet.ret_size;
@@ -140,4 +230,42 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 	return 0;
 }
 
+// Truncate or extend an open file to 'size' bytes
+static int
+devfile_trunc(struct Fd *fd, off_t newsize)
+{
+	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
+	fsipcbuf.set_size.req_size = newsize;
+	return fsipc(FSREQ_SET_SIZE, fd, NULL);
+}
+
+// Synchronize disk with buffer cache
+int
+sync(void)
+{
+	// Ask the file server to update the disk
+	// by writing any dirty blocks in the buffer cache.
+
+	return fsipc(FSREQ_SYNC, NULL, NULL);
+}
+
+// Map the page of file 'fdnum' at 'offset' read-only at 'dstva'.
+// The page is the file server's own cached copy of that block, so
+// everyone who maps it shares one physical page.
+//
+// Returns 0 on success, < 0 on failure:
+//	-E_INVAL if offset is not page-aligned or is past the end of the file
+int
+read_map(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
 
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	return fsipc(FSREQ_MAP, fd, dstva);
+}
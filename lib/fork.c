@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -56,6 +52,36 @@ pgfault(struct UTrapframe *utf)
       panic("pgfault: sys_page_unmap %e", r);
 }
 
+// Mapping requests queued up by duppage and sent to the kernel a batch
+// at a time by dupflush.  The child's mappings must all be made before
+// ours are remapped copy-on-write, so the two are queued separately.
+static struct PageMapReq child_reqs[PAGEMAP_BATCH_MAX] THREADLOCAL;
+static struct PageMapReq self_reqs[PAGEMAP_BATCH_MAX] THREADLOCAL;
+static size_t nchild_reqs THREADLOCAL, nself_reqs THREADLOCAL;
+
+static void
+dupqueue(struct PageMapReq *reqs, size_t *n, void *addr, int perm)
+{
+   reqs[*n].srcva = addr;
+   reqs[*n].dstva = addr;
+   reqs[*n].perm = perm;
+   (*n)++;
+}
+
+// Make the mappings queued by duppage, in the child and then in our own
+// address space.
+static void
+dupflush(envid_t envid)
+{
+   int r;
+
+   if ((r = sys_page_map_batch(0, envid, child_reqs, nchild_reqs)) < 0)
+      panic("duppage: sys_page_map_batch to new env %e", r);
+   if ((r = sys_page_map_batch(0, 0, self_reqs, nself_reqs)) < 0)
+      panic("duppage: sys_page_map_batch for remap %e", r);
+   nchild_reqs = nself_reqs = 0;
+}
+
 //
 // Map our virtual page pn (address pn*PGSIZE) into the target envid
 // at the same virtual address.  If the page is writable or copy-on-write,
@@ -64,13 +90,15 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are queued rather than made right away; they take effect
+// once the queue fills up or dupflush is called.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
 static int
 duppage(envid_t envid, unsigned pn)
 {
-	int r;
    pte_t ptEntry;
    pde_t pdEntry;
    void *addr = (void *)(pn * PGSIZE);
@@ -78,43 +106,65 @@ duppage(envid_t envid, unsigned pn)
 	// LAB 4: Your code here.
    
    pdEntry = uvpd[PDX(addr)]; 
-   if (pdEntry & PTE_P) {
+   if (pdEntry & PTE_PS) {
+      // Large pages are mapped whole from their first page, and are
+      // copy-on-write unless they're shared or read-only, just as
+      // small pages are; the kernel copies them on a write fault
+      if ((uintptr_t)addr & (PTSIZE - 1))
+         ;
+      else if (!(pdEntry & PTE_SHARE) && pdEntry & (PTE_W | PTE_COW)) {
+         dupqueue(child_reqs, &nchild_reqs, addr, PTE_COW | PTE_U | PTE_P);
+         dupqueue(self_reqs, &nself_reqs, addr, PTE_COW | PTE_U | PTE_P);
+      }
+      else
+         dupqueue(child_reqs, &nchild_reqs, addr, pdEntry & PTE_SYSCALL);
+   }
+   else if (pdEntry & PTE_P) {
       ptEntry = uvpt[pn];
       if (ptEntry & PTE_P) {
          if (ptEntry & PTE_SHARE) {
             // Share this page with parent
-            if ((r = sys_page_map(0, addr, envid, addr, PTE_SHARE | PTE_U | PTE_W | PTE_P)) < 0)
-               panic("duppage: sys_page_map page to be shared %e", r);
+            dupqueue(child_reqs, &nchild_reqs, addr, PTE_SHARE | PTE_U | PTE_W | PTE_P);
          }
          else if (ptEntry & PTE_W || ptEntry & PTE_COW) {
-            // Map to new env COW
-            if ((r = sys_page_map(0, addr, envid, addr, PTE_COW | PTE_U | PTE_P)) < 0)
-               panic("duppage: sys_page_map to new env %e", r);
-            // Remap our own to COW
-            if ((r = sys_page_map(0, addr, 0, addr, PTE_COW | PTE_U | PTE_P)) < 0)
-               panic("duppage: sys_page_map for remap %e", r);
+            // Map to new env COW, then remap our own to COW
+            dupqueue(child_reqs, &nchild_reqs, addr, PTE_COW | PTE_U | PTE_P);
+            dupqueue(self_reqs, &nself_reqs, addr, PTE_COW | PTE_U | PTE_P);
          }
          else {
             // Just directly map pages that are present but not W or COW
-            if ((r = sys_page_map(0, addr, envid, addr, PTE_P | PTE_U)) < 0)
-               panic("duppage: sys_page_map to new env PTE_P %e", r);
+            dupqueue(child_reqs, &nchild_reqs, addr, PTE_P | PTE_U);
          }
       }
    }
 
-/*
-   // Map to new env COW
-   if ((r = sys_page_map(0, addr, envid, addr, PTE_COW | PTE_U | PTE_P)) < 0)
-      panic("duppage: sys_page_map to new env %e", r);
-   // Remap our own to COW
-   if ((r = sys_page_map(0, addr, 0, addr, PTE_COW | PTE_U | PTE_P)) < 0)
-      panic("duppage: sys_page_map for remap %e", r);
-*/
+   if (nchild_reqs == PAGEMAP_BATCH_MAX)
+      dupflush(envid);
 	return 0;
 }
 
 //
-// User-level fork with copy-on-write.
+// Fork with copy-on-write, done by the kernel in one system call.
+// Write faults on the shared pages are also handled by the kernel.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+   envid_t envid;
+
+   if ((envid = sys_fork()) == 0)
+      thisenv = &envs[ENVX(sys_getenvid())];
+   return envid;
+}
+
+//
+// User-level fork with copy-on-write, kept to compare against fork().
+// The kernel now resolves write faults on PTE_COW pages itself (see
+// page_cow_fault), so pgfault below only runs if it can't; comparing
+// the two measures copying the address space from user level, not
+// user-level fault handling.
 // Set up our page fault handler appropriately.
 // Create a child.
 // Copy our address space and page fault handler setup to the child.
@@ -130,7 +180,7 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
    
@@ -158,9 +208,16 @@ fork(void)
    
    // We're the parent
    
-   // Copy address space (not including exception stack) to child
-   for (pn = 0; pn < PGNUM(UXSTACKTOP - PGSIZE); pn++)
+   // Copy address space (not including exception stack) to child,
+   // skipping over page tables that aren't there
+   for (pn = 0; pn < PGNUM(UXSTACKTOP - PGSIZE); pn++) {
+      if (!(uvpd[PDX(pn * PGSIZE)] & PTE_P)) {
+         pn = ROUNDUP(pn + 1, NPTENTRIES) - 1;
+         continue;
+      }
       duppage(envid, pn);
+   }
+   dupflush(envid);
 
    // Create exception stack page for child
    addr = (void *)(UXSTACKTOP - PGSIZE);
@@ -177,9 +234,70 @@ fork(void)
    return envid;
 }
 
-// Challenge!
-int
+// Pages that each sfork()ed thread gets its own copy-on-write copy of:
+// the normal stack area and the thread-local data.
+static bool
+sfork_private(uintptr_t va)
+{
+   return (va >= USTACKTOP - PTSIZE && va < USTACKTOP)
+          || (va >= (uintptr_t)tls_start && va < (uintptr_t)tls_end);
+}
+
+//
+// Create a thread: a child that shares all of our memory except the
+// stack and THREADLOCAL data, which it gets copy-on-write copies of,
+// and its own exception stack.  Pages mapped after the sfork() are
+// private to whichever thread maps them, so set up shared data first.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	return -E_INVAL;
+   envid_t envid;
+   uint32_t pn;
+   uintptr_t va;
+   pte_t ptEntry;
+   int r;
+
+   set_pgfault_handler(pgfault);
+   if ((envid = sys_exofork()) < 0)
+      return envid;
+   if (envid == 0) {
+      // thisenv is thread-local, so this only fixes our own
+      thisenv = &envs[ENVX(sys_getenvid())];
+      return 0;
+   }
+
+   for (pn = 0; pn < PGNUM(UXSTACKTOP - PGSIZE); pn++) {
+      va = pn * PGSIZE;
+      if (!(uvpd[PDX(va)] & PTE_P)) {
+         pn = ROUNDUP(pn + 1, NPTENTRIES) - 1;
+         continue;
+      }
+      if (sfork_private(va) || uvpd[PDX(va)] & PTE_PS) {
+         duppage(envid, pn);
+         continue;
+      }
+      if (!((ptEntry = uvpt[pn]) & PTE_P))
+         continue;
+      if (ptEntry & PTE_COW) {
+         // Take our own copy first, or the first write by either
+         // thread would split the page again
+         *(volatile char *)va = *(volatile char *)va;
+         ptEntry = uvpt[pn];
+      }
+      dupqueue(child_reqs, &nchild_reqs, (void *)va, ptEntry & PTE_SYSCALL);
+      if (nchild_reqs == PAGEMAP_BATCH_MAX)
+         dupflush(envid);
+   }
+   dupflush(envid);
+
+   if ((r = sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
+      panic("sfork: sys_page_alloc UXSTACK %e", r);
+   sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall);
+   if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+      panic("sfork: sys_env_set_status %e", r);
+
+   return envid;
 }
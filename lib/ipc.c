@@ -48,12 +48,12 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// The message is queued if 'toenv' isn't waiting for it; if its queue
+// is full, we sleep in the kernel until there's room.
+// It should panic() on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
@@ -66,32 +66,148 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
    if (pg == NULL)
       srcva = (void *)UTOP;   // Not sending a page, use an invalid addr
 
-   // Keep trying until ipc succeeds or error
-   while (1) {
-      if ((error = sys_ipc_try_send(to_env, val, srcva, perm)) < 0) {
-         if (error == -E_IPC_NOT_RECV) {
-            // sys_env_set_status(0, ENV_RUNNABLE);
-            sys_yield();   // Come back later and try again
-         }
-         else
-            panic("ipc_send: %e", error);
-      }
-      else
-         break;
-   }  
-   
-   return;
+   if ((error = sys_ipc_send(to_env, val, srcva, perm)) < 0)
+      panic("ipc_send: %e", error);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// then receive its reply as ipc_recv(NULL, rcv_pg, perm_store) does,
+// in a single system call.  Panics if the send fails.
+// Returns the value of the reply.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if ((r = sys_ipc_call(to_env, val, pg ? pg : (void *) UTOP, perm,
+			      rcv_pg ? rcv_pg : (void *) UTOP)) < 0)
+		panic("ipc_call: %e", r);
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// then receive the next message as ipc_recv does, in a single system
+// call.  A 'to_env' of 0 sends no reply.  The reply is dropped if
+// 'to_env' can't take it right away.
+// Returns what ipc_recv would.
+int32_t
+ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if ((r = sys_ipc_reply_wait(to_env, val, pg ? pg : (void *) UTOP, perm,
+				    rcv_pg ? rcv_pg : (void *) UTOP)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Like ipc_call, but sends the pages of the 'nsegs' runs in 'segs' as
+// one message, and maps up to dst->npages pages of the reply from
+// dst->va on (none if 'dst' is null).  Panics if the send fails.
+// Stores the number of pages received in *npages_store if it's nonnull.
+// Returns the value of the reply.
+int32_t
+ipc_callv(envid_t to_env, uint32_t val, const struct IpcSeg *segs,
+	  size_t nsegs, const struct IpcSeg *dst, size_t *npages_store)
+{
+	int r;
+
+	if ((r = sys_ipc_callv(to_env, val, segs, nsegs, dst)) < 0)
+		panic("ipc_callv: %e", r);
+	if (npages_store)
+		*npages_store = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
+// Like ipc_reply_recv, but replies with the pages of 'segs' and maps
+// up to dst->npages pages of the next message from dst->va on.  With a
+// 'to_env' of 0 this is ipc_recv for many pages.
+// Returns what ipc_recv would, storing the number of pages received in
+// *npages_store if it's nonnull.
+int32_t
+ipc_reply_recvv(envid_t to_env, uint32_t val, const struct IpcSeg *segs,
+		size_t nsegs, envid_t *from_env_store,
+		const struct IpcSeg *dst, size_t *npages_store)
+{
+	int r;
+
+	if ((r = sys_ipc_reply_waitv(to_env, val, segs, nsegs, dst)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (npages_store)
+			*npages_store = 0;
+		return r;
+	}
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (npages_store)
+		*npages_store = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
 }
 
-// Find the first environment of the given type.  We'll use this to
-// find special environments.
-// Returns 0 if no such environment exists.
+// Make sure each of the 'npages' pages at 'va' is mapped writable,
+// allocating fresh pages where there are none.  This lets a client
+// keep one buffer of data pages to send with its large requests.
+// Returns 0 on success, < 0 on error.
+int
+ipc_buffer(void *va, size_t npages)
+{
+	uintptr_t cur;
+	int r;
+
+	for (cur = (uintptr_t) va; cur < (uintptr_t) va + npages * PGSIZE;
+	     cur += PGSIZE) {
+		if ((uvpd[PDX(cur)] & PTE_P) && (uvpt[PGNUM(cur)] & PTE_P))
+			continue;
+		if ((r = sys_page_alloc(0, (void *) cur, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+// Find the server registered for the given type of environment in the
+// kernel's service table.  Look it up again for each request, rather
+// than keeping it, to follow a server that has been replaced.
+// Returns 0 if there's no such server.
 envid_t
 ipc_find_env(enum EnvType type)
 {
-	int i;
-	for (i = 0; i < NENV; i++)
-		if (envs[i].env_type == type)
-			return envs[i].env_id;
-	return 0;
+	return ipc_find_service(type, NULL);
+}
+
+// Like ipc_find_env, but also stores the registration's generation in
+// *gen_store if it's nonnull.  A client holding state in the server,
+// like open files, can compare generations to tell that it's lost.
+envid_t
+ipc_find_service(enum EnvType type, uint32_t *gen_store)
+{
+	uint32_t gen;
+	envid_t env;
+
+	if (type <= ENV_TYPE_USER || type >= NSERVICE)
+		return 0;
+	// The kernel may be changing the entry on another CPU, in which
+	// case sv_gen is odd or changes under us
+	do {
+		gen = services[type].sv_gen;
+		env = services[type].sv_env;
+	} while (gen & 1 || gen != services[type].sv_gen);
+	if (gen_store)
+		*gen_store = gen;
+	return env;
 }
@@ -5,7 +5,7 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
+const volatile struct Env *thisenv THREADLOCAL;
 const char *binaryname = "<unknown>";
 
 void
@@ -1,31 +1,70 @@
-
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 /*
- * Simple malloc/free.
+ * Size-class malloc/free.
+ *
+ * Small requests (up to MAXSLAB bytes) are rounded up to a power-of-two
+ * size class and carved out of slabs: pages that hold objects of one
+ * class, with a header at the start of the page and a free list
+ * threaded through the free objects.  Each class keeps a list of the
+ * slabs it has with room in them, so malloc and free of small objects
+ * are a few pointer moves.
  *
- * Uses the address space to do most of the hard work.
- * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
- * malloc requests, and then left alone.  Free decrements
- * a ref count maintained in the page; the page is freed
- * when the ref count hits zero.
+ * Anything bigger gets a run of whole pages, with the header at the
+ * start of the first page.  Freed runs and empty slabs stay mapped on
+ * a list of free runs, kept in address order so that neighbours
+ * coalesce, until it holds more than MCACHE pages.  New address space
+ * is mapped at least MCHUNK pages at a time, so most allocations make
+ * no system calls at all.
  *
- * If we need to allocate a large amount (more than a page)
- * we can't put a ref count at the end of each page,
- * so we mark the pte entry with the bit PTE_CONTINUED.
+ * Allocation counters are kept all the time; they cost a few adds.
+ * malloc_profile() turns on sampling of the call sites that allocate,
+ * and malloc_stats_dump() prints it all to a file or the console.
  */
 enum
 {
-	MAXMALLOC = 1024*1024	/* max size of one allocated chunk */
+	MAXMALLOC = 32*1024*1024,	/* max size of one allocated chunk */
+	MINSHIFT = 4,			/* smallest class is 16 bytes */
+	NCLASS = MALLOC_NCLASS,		/* ... and the biggest 1024 */
+	MAXSLAB = 1 << (MINSHIFT + NCLASS - 1),
+	MCHUNK = 8,			/* fewest pages mapped at once */
+	MCACHE = 64,			/* most free pages kept mapped */
+	MSITES = 64,			/* call sites remembered */
 };
 
-#define PTE_CONTINUED 0x200
+#define MH_MAGIC	0x434c414d	/* "MALC" */
+#define MH_LARGE	0xffff		/* mh_class of an allocated run */
+#define MH_FREE		0xfffe		/* mh_class of a free run */
+
+struct MHeader {
+	uint32_t mh_magic;
+	uint16_t mh_class;		/* size class, MH_LARGE or MH_FREE */
+	uint16_t mh_nused;		/* slabs: objects handed out */
+	uint32_t mh_npages;		/* runs: length in pages */
+	void *mh_free;			/* slabs: first free object */
+	struct MHeader *mh_next;	/* slabs with room, or free runs */
+	struct MHeader *mh_prev;
+	uint32_t mh_pad[2];		/* keep objects 16-byte aligned */
+};
 
 static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
 static uint8_t *mptr;
 
+static struct MHeader *slabs[NCLASS];	/* slabs with free objects */
+static struct MHeader *runs;		/* free runs, in address order */
+static size_t nrunpages;		/* pages on runs */
+
+/* Allocation statistics; see malloc_stats() */
+static struct MallocStats mstat;
+
+/* Call sites seen by malloc_profile's sampling */
+static struct MallocSite msites[MSITES];
+static uint32_t msample;		/* sample one in msample mallocs */
+static uint32_t mcountdown;
+static uint32_t mlost;			/* samples with no room in msites */
+
 static int
 isfree(void *v, size_t n)
 {
@@ -38,52 +77,55 @@ isfree(void *v, size_t n)
 	return 1;
 }
 
-void*
-malloc(size_t n)
+/*
+ * Put the run of 'npages' pages at 'h' on the free run list, merging
+ * it with the runs on either side, or unmap it if the list is full.
+ */
+static void
+run_free(struct MHeader *h, size_t npages)
+{
+	struct MHeader *prev, *next;
+
+	if (nrunpages + npages > MCACHE) {
+		sys_page_unmap_range(0, h, npages * PGSIZE);
+		mstat.ms_mapped_pages -= npages;
+		return;
+	}
+	nrunpages += npages;
+
+	for (prev = 0, next = runs; next && next < h; next = next->mh_next)
+		prev = next;
+	h->mh_magic = MH_MAGIC;
+	h->mh_class = MH_FREE;
+	h->mh_npages = npages;
+	h->mh_next = next;
+	if (next && (uint8_t*) h + h->mh_npages * PGSIZE == (uint8_t*) next) {
+		h->mh_npages += next->mh_npages;
+		h->mh_next = next->mh_next;
+	}
+	if (prev && (uint8_t*) prev + prev->mh_npages * PGSIZE == (uint8_t*) h) {
+		prev->mh_npages += h->mh_npages;
+		prev->mh_next = h->mh_next;
+	} else if (prev)
+		prev->mh_next = h;
+	else
+		runs = h;
+}
+
+/*
+ * Map 'npages' pages of fresh address space.
+ */
+static struct MHeader *
+run_map(size_t npages)
 {
-	int i, cont;
+	struct MHeader *h;
 	int nwrap;
-	uint32_t *ref;
-	void *v;
 
 	if (mptr == 0)
 		mptr = mbegin;
 
-	n = ROUNDUP(n, 4);
-
-	if (n >= MAXMALLOC)
-		return 0;
-
-	if ((uintptr_t) mptr % PGSIZE){
-		/*
-		 * we're in the middle of a partially
-		 * allocated page - can we add this chunk?
-		 * the +4 below is for the ref count.
-		 */
-		ref = (uint32_t*) (ROUNDUP(mptr, PGSIZE) - 4);
-		if ((uintptr_t) mptr / PGSIZE == (uintptr_t) (mptr + n - 1 + 4) / PGSIZE) {
-			(*ref)++;
-			v = mptr;
-			mptr += n;
-			return v;
-		}
-		/*
-		 * stop working on this page and move on.
-		 */
-		free(mptr);	/* drop reference to this page */
-		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
-	}
-
-	/*
-	 * now we need to find some address space for this chunk.
-	 * if it's less than a page we leave it open for allocation.
-	 * runs of more than a page can't have ref counts so we
-	 * flag the PTE entries instead.
-	 */
 	nwrap = 0;
-	while (1) {
-		if (isfree(mptr, n + 4))
-			break;
+	while (!isfree(mptr, npages * PGSIZE)) {
 		mptr += PGSIZE;
 		if (mptr == mend) {
 			mptr = mbegin;
@@ -91,50 +133,378 @@ malloc(size_t n)
 				return 0;	/* out of address space */
 		}
 	}
+	if (sys_page_alloc_range(0, mptr, npages * PGSIZE, PTE_P|PTE_U|PTE_W) < 0)
+		return 0;	/* out of physical memory */
+
+	mstat.ms_mapped_pages += npages;
+	h = (struct MHeader*) mptr;
+	mptr += npages * PGSIZE;
+	if (mptr == mend)
+		mptr = mbegin;
+	return h;
+}
+
+/*
+ * Get a run of 'npages' pages: the first free run that is big enough,
+ * or else fresh pages.
+ */
+static struct MHeader *
+run_alloc(size_t npages)
+{
+	struct MHeader *h, *rest, **hp;
+	size_t n;
+
+	for (hp = &runs; (h = *hp); hp = &h->mh_next)
+		if (h->mh_npages >= npages)
+			break;
+
+	if (h) {
+		*hp = h->mh_next;
+		nrunpages -= h->mh_npages;
+		n = h->mh_npages;
+	} else {
+		n = MAX(npages, MCHUNK);
+		if (!(h = run_map(n)) && !(h = run_map(n = npages)))
+			return 0;
+	}
+
+	if (n > npages) {
+		rest = (struct MHeader*) ((uint8_t*) h + npages * PGSIZE);
+		run_free(rest, n - npages);
+	}
+	h->mh_magic = MH_MAGIC;
+	h->mh_npages = npages;
+	return h;
+}
+
+static void
+slab_link(struct MHeader *h)
+{
+	h->mh_prev = 0;
+	h->mh_next = slabs[h->mh_class];
+	if (h->mh_next)
+		h->mh_next->mh_prev = h;
+	slabs[h->mh_class] = h;
+}
+
+static void
+slab_unlink(struct MHeader *h)
+{
+	if (h->mh_prev)
+		h->mh_prev->mh_next = h->mh_next;
+	else
+		slabs[h->mh_class] = h->mh_next;
+	if (h->mh_next)
+		h->mh_next->mh_prev = h->mh_prev;
+}
+
+/*
+ * Start a new slab for size class 'c'.
+ */
+static struct MHeader *
+slab_new(int c)
+{
+	struct MHeader *h;
+	size_t size = 1 << (MINSHIFT + c);
+	uint8_t *obj, *end;
+
+	if (!(h = run_alloc(1)))
+		return 0;
+	h->mh_class = c;
+	h->mh_nused = 0;
+	h->mh_free = 0;
+	end = (uint8_t*) h + PGSIZE;
+	for (obj = end - ROUNDDOWN(PGSIZE - sizeof(*h), size);
+	     obj + size <= end; obj += size) {
+		*(void**) obj = h->mh_free;
+		h->mh_free = obj;
+	}
+	slab_link(h);
+	return h;
+}
 
-	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
-	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
+static int
+size_class(size_t n)
+{
+	int c;
+
+	for (c = 0; (1 << (MINSHIFT + c)) < n; c++)
+		;
+	return c;
+}
+
+static struct MHeader *
+mheader(void *v)
+{
+	struct MHeader *h;
+
+	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
+	h = ROUNDDOWN(v, PGSIZE);
+	assert(h->mh_magic == MH_MAGIC
+	       && (h->mh_class < NCLASS || h->mh_class == MH_LARGE));
+	return h;
+}
+
+static void
+mstat_add(int c, size_t bytes)
+{
+	mstat.ms_nmalloc++;
+	mstat.ms_live[c]++;
+	mstat.ms_live_bytes[c] += bytes;
+	mstat.ms_in_use += bytes;
+	if (mstat.ms_in_use > mstat.ms_peak)
+		mstat.ms_peak = mstat.ms_in_use;
+}
+
+static void
+mstat_sub(int c, size_t bytes)
+{
+	mstat.ms_nfree++;
+	mstat.ms_live[c]--;
+	mstat.ms_live_bytes[c] -= bytes;
+	mstat.ms_in_use -= bytes;
+}
+
+/*
+ * Charge an allocation of 'n' bytes to its call site, found by walking
+ * the chain of saved %ebp's up from malloc's caller.
+ */
+static void __attribute__((noinline))
+malloc_sample(size_t n)
+{
+	uintptr_t pc[MALLOC_SITE_DEPTH];
+	uint32_t *ebp, hash = 0;
+	struct MallocSite *ms;
+	int depth, i;
+
+	/* skip our own frame and malloc's */
+	ebp = (uint32_t*) read_ebp();
+	ebp = (uint32_t*) ebp[0];
+	for (depth = 0; depth < MALLOC_SITE_DEPTH; depth++) {
+		if ((uintptr_t) ebp < USTACKTOP - PTSIZE
+		    || (uintptr_t) ebp >= USTACKTOP
+		    || !(uvpt[PGNUM(ebp)] & PTE_P))
+			break;
+		pc[depth] = ebp[1];
+		hash = hash * 31 + pc[depth];
+		ebp = (uint32_t*) ebp[0];
+	}
+	for (i = depth; i < MALLOC_SITE_DEPTH; i++)
+		pc[i] = 0;
+
+	for (i = 0; i < MSITES; i++) {
+		ms = &msites[(hash + i) % MSITES];
+		if (ms->count == 0)
+			memmove(ms->pc, pc, sizeof(pc));
+		else if (memcmp(ms->pc, pc, sizeof(pc)) != 0)
+			continue;
+		ms->count++;
+		ms->bytes += n;
+		return;
+	}
+	mlost++;
+}
+
+void*
+malloc(size_t n)
+{
+	struct MHeader *h;
+	void **obj;
+	int c;
+
+	if (n >= MAXMALLOC)
+		return 0;
+
+	if (msample && --mcountdown == 0) {
+		mcountdown = msample;
+		malloc_sample(n);
+	}
+
+	if (n > MAXSLAB) {
+		if (!(h = run_alloc(ROUNDUP(n + sizeof(*h), PGSIZE) / PGSIZE))) {
+			mstat.ms_nfail++;
+			return 0;
 		}
+		h->mh_class = MH_LARGE;
+		mstat_add(NCLASS, h->mh_npages * PGSIZE);
+		return h + 1;
 	}
 
-	ref = (uint32_t*) (mptr + i - 4);
-	*ref = 2;	/* reference for mptr, reference for returned block */
-	v = mptr;
-	mptr += n;
-	return v;
+	c = size_class(n);
+	if (!(h = slabs[c]) && !(h = slab_new(c))) {
+		mstat.ms_nfail++;
+		return 0;
+	}
+	obj = h->mh_free;
+	h->mh_free = *obj;
+	h->mh_nused++;
+	if (!h->mh_free)
+		slab_unlink(h);		/* full */
+	mstat_add(c, 1 << (MINSHIFT + c));
+	return obj;
 }
 
 void
 free(void *v)
 {
-	uint8_t *c;
-	uint32_t *ref;
+	struct MHeader *h;
+	int wasfull;
 
 	if (v == 0)
 		return;
-	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
+	h = mheader(v);
 
-	c = ROUNDDOWN(v, PGSIZE);
+	if (h->mh_class == MH_LARGE) {
+		mstat_sub(NCLASS, h->mh_npages * PGSIZE);
+		run_free(h, h->mh_npages);
+		return;
+	}
+	mstat_sub(h->mh_class, 1 << (MINSHIFT + h->mh_class));
 
-	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
+	wasfull = !h->mh_free;
+	*(void**) v = h->mh_free;
+	h->mh_free = v;
+	h->mh_nused--;
+	if (wasfull)
+		slab_link(h);
+	/* keep one empty slab per class around */
+	else if (h->mh_nused == 0 && (h->mh_prev || h->mh_next)) {
+		slab_unlink(h);
+		run_free(h, 1);
 	}
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+	void *v;
 
-	/*
-	 * c is just a piece of this page, so dec the ref count
-	 * and maybe free the page.
-	 */
-	ref = (uint32_t*) (c + PGSIZE - 4);
-	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+	if (size && nmemb > (size_t) -1 / size)
+		return 0;
+	if ((v = malloc(nmemb * size)))
+		memset(v, 0, nmemb * size);
+	return v;
 }
 
+void*
+realloc(void *v, size_t n)
+{
+	struct MHeader *h;
+	size_t have;
+	void *nv;
+
+	if (v == 0)
+		return malloc(n);
+	if (n == 0) {
+		free(v);
+		return 0;
+	}
+
+	h = mheader(v);
+	if (h->mh_class == MH_LARGE)
+		have = h->mh_npages * PGSIZE - sizeof(*h);
+	else
+		have = 1 << (MINSHIFT + h->mh_class);
+	if (n <= have)
+		return v;
+
+	if (!(nv = malloc(n)))
+		return 0;
+	memmove(nv, v, have);
+	free(v);
+	return nv;
+}
+
+/*
+ * Copy out the allocation counters.
+ */
+void
+malloc_stats(struct MallocStats *ms)
+{
+	*ms = mstat;
+	ms->ms_cached_pages = nrunpages;
+}
+
+/*
+ * Start sampling one in every 'every' allocations for malloc_stats_dump
+ * to report by call site, throwing away any earlier samples.  0 stops
+ * sampling.
+ */
+void
+malloc_profile(uint32_t every)
+{
+	memset(msites, 0, sizeof(msites));
+	mlost = 0;
+	msample = mcountdown = every;
+}
+
+/*
+ * Copy out up to 'n' of the call sites sampled so far.  Returns how
+ * many were copied.
+ */
+int
+malloc_sites(struct MallocSite *sites, int n)
+{
+	int i, nsites = 0;
+
+	for (i = 0; i < MSITES && nsites < n; i++)
+		if (msites[i].count)
+			sites[nsites++] = msites[i];
+	return nsites;
+}
+
+static void
+mprintf(int fd, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (fd < 0)
+		vcprintf(fmt, ap);
+	else
+		vfprintf(fd, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Print the allocation counters and sampled call sites to 'fd', or to
+ * the console if fd < 0.
+ */
+void
+malloc_stats_dump(int fd)
+{
+	struct MallocStats ms;
+	size_t mapped;
+	int c, i, j;
+
+	malloc_stats(&ms);
+	mapped = ms.ms_mapped_pages * PGSIZE;
+
+	mprintf(fd, "malloc: %u mallocs, %u frees, %u failed\n",
+		ms.ms_nmalloc, ms.ms_nfree, ms.ms_nfail);
+	mprintf(fd, "  class    live      bytes\n");
+	for (c = 0; c <= NCLASS; c++) {
+		if (c < NCLASS)
+			mprintf(fd, "  %5d", 1 << (MINSHIFT + c));
+		else
+			mprintf(fd, "  large");
+		mprintf(fd, " %7u %10u\n", ms.ms_live[c], ms.ms_live_bytes[c]);
+	}
+	mprintf(fd, "  in use %u bytes, peak %u bytes\n", ms.ms_in_use, ms.ms_peak);
+	mprintf(fd, "  mapped %u pages (%u free and cached), %u%% fragmented\n",
+		ms.ms_mapped_pages, ms.ms_cached_pages,
+		mapped ? (mapped - ms.ms_in_use) * 100 / mapped : 0);
+
+	if (!msample)
+		return;
+	mprintf(fd, "sampled call sites (1 in %u mallocs, %u not recorded):\n",
+		msample, mlost);
+	for (i = 0; i < MSITES; i++) {
+		if (!msites[i].count)
+			continue;
+		mprintf(fd, "  %6u %10u ", msites[i].count, msites[i].bytes);
+		for (j = 0; j < MALLOC_SITE_DEPTH && msites[i].pc[j]; j++)
+			mprintf(fd, " %08x", msites[i].pc[j]);
+		mprintf(fd, "\n");
+	}
+}
@@ -6,7 +6,11 @@
 
 // Virtual address at which to receive page mappings containing client requests.
 #define REQVA		0x0ffff000
-union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
+union Nsipc nsipcbuf __attribute__((aligned(PGSIZE))) THREADLOCAL;
+
+// Sends and receives of this many bytes or more go as NSREQ_SEND_LARGE
+// and NSREQ_RECV_LARGE, with the data in pages of its own.
+#define NSIPC_LARGE	1600
 
 // Send an IP request to the network server, and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
@@ -16,17 +20,38 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 nsipc(unsigned type)
 {
-	static envid_t nsenv;
-	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
+	envid_t nsenv;
 
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
+	if (!(nsenv = ipc_find_env(ENV_TYPE_NS)))
+		return -E_BAD_ENV;
+
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U, NULL, NULL);
+}
+
+// Like nsipc, but sends the 'npages' data pages at NSBIGBUF along with
+// nsipcbuf, all in one message.  The server reads or writes the data
+// in place.
+static int
+nsipc_large(unsigned type, size_t npages)
+{
+	struct IpcSeg segs[2] = {
+		{ &nsipcbuf, 1, PTE_P|PTE_W|PTE_U },
+		{ (void *) NSBIGBUF, npages, PTE_P|PTE_W|PTE_U },
+	};
+	envid_t nsenv;
+
+	if (!(nsenv = ipc_find_env(ENV_TYPE_NS)))
+		return -E_BAD_ENV;
+
+	if (debug)
+		cprintf("[%08x] nsipc_large %d %d pages\n", thisenv->env_id, type, npages);
+
+	return ipc_callv(nsenv, type, segs, 2, NULL, NULL);
 }
 
 int
@@ -88,14 +113,30 @@ nsipc_listen(int s, int backlog)
 int
 nsipc_recv(int s, void *mem, int len, unsigned int flags)
 {
+	size_t npages;
 	int r;
 
+	if (len >= NSIPC_LARGE) {
+		npages = MIN(ROUNDUP(len, PGSIZE) / PGSIZE, NSLARGE_MAXPAGES);
+		len = MIN(len, npages * PGSIZE);
+		if ((r = ipc_buffer((void *) NSBIGBUF, npages)) < 0)
+			return r;
+		nsipcbuf.recv.req_s = s;
+		nsipcbuf.recv.req_len = len;
+		nsipcbuf.recv.req_flags = flags;
+		if ((r = nsipc_large(NSREQ_RECV_LARGE, npages)) >= 0) {
+			assert(r <= len);
+			memmove(mem, (void *) NSBIGBUF, r);
+		}
+		return r;
+	}
+
 	nsipcbuf.recv.req_s = s;
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
 	if ((r = nsipc(NSREQ_RECV)) >= 0) {
-		assert(r < 1600 && r <= len);
+		assert(r < NSIPC_LARGE && r <= len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
 	}
 
@@ -105,8 +146,23 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
+	size_t npages;
+	int r;
+
+	if (size >= NSIPC_LARGE) {
+		npages = MIN(ROUNDUP(size, PGSIZE) / PGSIZE, NSLARGE_MAXPAGES);
+		size = MIN(size, npages * PGSIZE);
+		if ((r = ipc_buffer((void *) NSBIGBUF, npages)) < 0)
+			return r;
+		memmove((void *) NSBIGBUF, buf, size);
+		nsipcbuf.send.req_s = s;
+		nsipcbuf.send.req_size = size;
+		nsipcbuf.send.req_flags = flags;
+		return nsipc_large(NSREQ_SEND_LARGE, npages);
+	}
+
 	nsipcbuf.send.req_s = s;
-	assert(size < 1600);
+	assert(size < NSIPC_LARGE);
 	memmove(&nsipcbuf.send.req_buf, buf, size);
 	nsipcbuf.send.req_size = size;
 	nsipcbuf.send.req_flags = flags;
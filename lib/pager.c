@@ -0,0 +1,157 @@
+// Demand paging for programs started by spawn().
+//
+// Instead of reading every page of a program before it runs, spawn
+// leaves the file-backed pages of its segments unmapped and tells us
+// where they come from in the struct PagerMap at PAGERMAP.  The first
+// touch of one of those pages faults, and we have the file server
+// map us the page straight out of its block cache.
+//
+// This code runs before any of the program's own text or data is
+// there, so user/user.ld links it, the entry code and the system call
+// stubs into the first segment, which spawn loads up front.  It must
+// not call anything else or use global variables -- not even panic().
+
+#include <inc/lib.h>
+
+extern void _pgfault_upcall(void);
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+// Called from _start.  Start taking page faults if spawn left us a
+// PagerMap; otherwise everything was loaded up front.
+void
+pager_init(void)
+{
+	if (!(uvpd[PDX(PAGERMAP)] & PTE_P) || !(uvpt[PGNUM(PAGERMAP)] & PTE_P))
+		return;
+	if (sys_page_alloc(0, (void *) (UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W) < 0
+	    || sys_env_set_pgfault_upcall(0, _pgfault_upcall) < 0)
+		sys_env_destroy(0);
+}
+
+// Report a page we couldn't page in and exit.  panic() and the printf
+// code are in the pages we failed to get, so format it by hand.
+static void
+pager_die(uintptr_t va, int r)
+{
+	char msg[] = "pager: page 00000000: error -000\n";
+	int i;
+
+	for (i = 0; i < 8; i++)
+		msg[19 - i] = "0123456789abcdef"[(va >> (4 * i)) & 0xf];
+	r = r < 0 ? -r : r;
+	for (i = 0; i < 3; i++, r /= 10)
+		msg[31 - i] = '0' + r % 10;
+	sys_cputs(msg, sizeof(msg) - 1);
+	sys_env_destroy(0);
+}
+
+// The file server the program was opened in, read straight from the
+// service table the way ipc_find_service does.  0 if it has been
+// replaced since spawn, since the new one won't know pm_fileid.
+static envid_t
+pager_fsenv(const struct PagerMap *pm)
+{
+	const volatile struct Service *sv = &services[ENV_TYPE_FS];
+	uint32_t gen;
+	envid_t env;
+
+	do {
+		gen = sv->sv_gen;
+		env = sv->sv_env;
+	} while (gen & 1 || gen != sv->sv_gen);
+	return gen == pm->pm_fsgen ? env : 0;
+}
+
+// Have the file server map the page of the program file at 'offset'
+// at PAGERTEMP.  sys_ipc_call only takes the file server's reply, so
+// messages other envs have queued for the program are left alone.
+static int
+pager_fetch(const struct PagerMap *pm, off_t offset)
+{
+	union Fsipc *req = (union Fsipc *) PAGERREQ;
+	const volatile struct Env *e;
+	envid_t fsenv;
+	int r;
+
+	if (!(fsenv = pager_fsenv(pm)))
+		return -E_BAD_ENV;
+	if ((r = sys_page_alloc(0, req, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	req->map.req_fileid = pm->pm_fileid;
+	req->map.req_offset = offset;
+
+	if ((r = sys_ipc_call(fsenv, FSREQ_MAP, req, PTE_P|PTE_U|PTE_W,
+			      (void *) PAGERTEMP)) < 0)
+		return r;
+
+	e = &envs[ENVX(sys_getenvid())];
+	if ((int32_t) e->env_ipc_value < 0)
+		return e->env_ipc_value;
+	if (!e->env_ipc_perm)
+		return -E_INVAL;
+	return 0;
+}
+
+// Page in the page at the fault address, if it is one that spawn left
+// for us.  Returns 0 if it was, < 0 otherwise.
+static int
+pager_fault(struct UTrapframe *utf)
+{
+	const struct PagerMap *pm = (const struct PagerMap *) PAGERMAP;
+	const struct PagerSeg *ps;
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	size_t off, n, i;
+	int r;
+
+	if (!(uvpd[PDX(PAGERMAP)] & PTE_P) || !(uvpt[PGNUM(PAGERMAP)] & PTE_P))
+		return -E_INVAL;
+	if (utf->utf_err & FEC_PR)
+		return -E_INVAL;
+	for (ps = pm->pm_segs; ps < pm->pm_segs + pm->pm_nsegs; ps++)
+		if (va >= ps->ps_va && va < ps->ps_va + ps->ps_filesz)
+			break;
+	if (ps == pm->pm_segs + pm->pm_nsegs)
+		return -E_INVAL;
+
+	off = va - ps->ps_va;
+	n = MIN(ps->ps_filesz - off, PGSIZE);
+	if ((r = pager_fetch(pm, ps->ps_offset + off)) < 0)
+		pager_die(va, r);
+
+	if (n == PGSIZE) {
+		// A whole page of file: share the file server's copy,
+		// copy-on-write if the segment is writable
+		r = sys_page_map(0, (void *) PAGERTEMP, 0, (void *) va,
+				 ps->ps_perm & PTE_W
+				 ? (ps->ps_perm & ~PTE_W) | PTE_COW : ps->ps_perm);
+	} else {
+		// The last page of file data is followed by .bss, which
+		// must read as zero, so it gets a page of its own
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+			pager_die(va, r);
+		for (i = 0; i < n; i++)
+			((char *) va)[i] = ((char *) PAGERTEMP)[i];
+		if (!(ps->ps_perm & PTE_W))
+			r = sys_page_map(0, (void *) va, 0, (void *) va, ps->ps_perm);
+	}
+	if (r < 0)
+		pager_die(va, r);
+	sys_page_unmap(0, (void *) PAGERTEMP);
+	return 0;
+}
+
+// Called by _pgfault_upcall for every page fault.
+void
+_pgfault_dispatch(struct UTrapframe *utf)
+{
+	if (pager_fault(utf) == 0)
+		return;
+	if (_pgfault_handler) {
+		_pgfault_handler(utf);
+		return;
+	}
+
+	// Nobody wants it: fault again without an upcall, so the kernel
+	// reports the fault and destroys us as it normally would
+	sys_env_set_pgfault_upcall(0, 0);
+}
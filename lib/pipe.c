@@ -1,3 +1,4 @@
+#include <inc/x86.h>
 #include <inc/lib.h>
 
 #define debug 0
@@ -17,14 +18,127 @@ struct Dev devpipe =
 	.dev_stat =	devpipe_stat,
 };
 
-#define PIPEBUFSIZ 32		// small to provoke races
+#define PIPEBUFSIZ (16 * PGSIZE)	// ring of data pages after the Pipe page
+#define PIPEWAIT 100		// ms to sleep before looking for a lost close
 
+#define PIPENPAGE (PIPEBUFSIZ / PGSIZE)
+
+// The Pipe page is the first data page of both ends, and the ring of
+// PIPEBUFSIZ bytes follows it.  The positions only ever grow, wrapping
+// around at 2^32 along with the ring.
+//
+// A writer with a whole, page-aligned page to store at a page boundary
+// hands it over with sys_page_give instead of copying it, keyed on
+// p_given[i] for ring page i, and sets p_given[i].  The reader maps the
+// page straight into its buffer if it wants all of it, and otherwise
+// copies it into ring page i first.
 struct Pipe {
-	off_t p_rpos;		// read position
-	off_t p_wpos;		// write position
-	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
+	uint32_t p_rpos;	// read position
+	uint32_t p_wpos;	// write position
+	uint32_t p_rsleep;	// a reader may be asleep on p_wpos
+	uint32_t p_wsleep;	// a writer may be asleep on p_rpos
+	uint32_t p_given[PIPENPAGE];	// ring page i's bytes are with the kernel
 };
 
+static inline uint8_t *
+pipe_buf(struct Pipe *p)
+{
+	return (uint8_t *) p + PGSIZE;
+}
+
+// A private page for pipe_unsplice, just past the ring
+static inline uint8_t *
+pipe_spare(struct Pipe *p)
+{
+	return pipe_buf(p) + PIPEBUFSIZ;
+}
+
+// Sleep until someone moves *pos away from 'seen', first setting
+// *sleeping so they know to wake us.  Closing the other end unmaps the
+// pipe, which wakes us too; the timeout only covers a close that lands
+// between our _pipeisclosed check and the sleep.
+static void
+pipe_sleep(uint32_t *sleeping, uint32_t *pos, uint32_t seen)
+{
+	xchg(sleeping, 1);
+	sys_futex_wait(pos, seen, PIPEWAIT);
+}
+
+// Wake whoever is asleep on *pos, having just moved it.
+static void
+pipe_wake(uint32_t *sleeping, uint32_t *pos)
+{
+	if (xchg(sleeping, 0))
+		sys_futex_wake(pos, ~0);
+}
+
+// Copy 'n' bytes between 'buf' and the ring at position 'pos', in at
+// most two pieces where the ring wraps around.  'in' copies into the
+// ring.
+static void
+pipe_copy(struct Pipe *p, uint32_t pos, uint8_t *buf, size_t n, bool in)
+{
+	size_t off = pos % PIPEBUFSIZ, m = MIN(n, PIPEBUFSIZ - off);
+
+	if (in) {
+		memcpy(pipe_buf(p) + off, buf, m);
+		memcpy(pipe_buf(p), buf + m, n - m);
+	} else {
+		memcpy(buf, pipe_buf(p) + off, m);
+		memcpy(buf + m, pipe_buf(p), n - m);
+	}
+	// Finish with the data before the caller moves the position
+	asm volatile("" : : : "memory");
+}
+
+// Hand the page at 'buf' to the reader as the next PGSIZE bytes, if
+// the write has a whole page there and it lines up with a ring page.
+// Returns 1 if the page was handed over, 0 if it has to be copied.
+static bool
+pipe_give(struct Pipe *p, const uint8_t *buf, size_t n, uint32_t room)
+{
+	uint32_t *given = &p->p_given[p->p_wpos % PIPEBUFSIZ / PGSIZE];
+
+	if (n < PGSIZE || room < PGSIZE || p->p_wpos % PGSIZE
+	    || (uintptr_t) buf % PGSIZE
+	    || sys_page_give(given, (void *) buf, PTE_P|PTE_U|PTE_W) < 0)
+		return 0;
+	*given = 1;
+	asm volatile("" : : : "memory");
+	return 1;
+}
+
+// Take the page handed over for ring page 'i' into the reader's buffer
+// at 'buf', if the read wants all of it there and 'buf' is private
+// memory.
+// Returns 1 if the page was taken, 0 if it has to be copied.
+static bool
+pipe_take(struct Pipe *p, uint32_t i, uint8_t *buf, size_t n)
+{
+	if (n < PGSIZE || p->p_rpos % PGSIZE || (uintptr_t) buf % PGSIZE
+	    || !(uvpd[PDX(buf)] & PTE_P)
+	    || (uvpt[PGNUM(buf)] & (PTE_P|PTE_SHARE)) != PTE_P
+	    || sys_page_take(&p->p_given[i], buf) < 0)
+		return 0;
+	p->p_given[i] = 0;
+	return 1;
+}
+
+// Copy the page handed over for ring page 'i' into the ring, for a
+// read that only wants part of it.
+static int
+pipe_unsplice(struct Pipe *p, uint32_t i)
+{
+	int r;
+
+	if ((r = sys_page_take(&p->p_given[i], pipe_spare(p))) < 0)
+		return r;
+	memcpy(pipe_buf(p) + i * PGSIZE, pipe_spare(p), PGSIZE);
+	sys_page_unmap(0, pipe_spare(p));
+	p->p_given[i] = 0;
+	return 0;
+}
+
 int
 pipe(int pfd[2])
 {
@@ -41,11 +155,15 @@ pipe(int pfd[2])
 	    || (r = sys_page_alloc(0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err1;
 
-	// allocate the pipe structure as first data page in both
+	// allocate the pipe structure and its ring as data pages in both
+	static_assert(sizeof(struct Pipe) <= PGSIZE);
+	static_assert(PGSIZE + PIPEBUFSIZ + PGSIZE <= FDDATASIZE);
 	va = fd2data(fd0);
-	if ((r = sys_page_alloc(0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+	if ((r = sys_page_alloc_range(0, va, PGSIZE + PIPEBUFSIZ,
+				      PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err2;
-	if ((r = sys_page_map(0, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+	if ((r = sys_page_map_range(0, va, 0, fd2data(fd1),
+				    PGSIZE + PIPEBUFSIZ)) < 0)
 		goto err3;
 
 	// set up fd structures
@@ -63,7 +181,7 @@ pipe(int pfd[2])
 	return 0;
 
     err3:
-	sys_page_unmap(0, va);
+	sys_page_unmap_range(0, va, PGSIZE + PIPEBUFSIZ);
     err2:
 	sys_page_unmap(0, fd1);
     err1:
@@ -105,34 +223,49 @@ static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
-	size_t i;
 	struct Pipe *p;
+	uint32_t avail, pg;
+	size_t i, m;
+	int r;
 
 	p = (struct Pipe*)fd2data(fd);
 	if (debug)
 		cprintf("[%08x] devpipe_read %08x %d rpos %d wpos %d\n",
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
+	if (n == 0)
+		return 0;
+	while ((avail = p->p_wpos - p->p_rpos) == 0) {
+		// pipe is empty
+		// if all the writers are gone, note eof
+		if (_pipeisclosed(fd, p))
+			return 0;
+		// sleep until a writer adds something
+		if (debug)
+			cprintf("devpipe_read sleep\n");
+		pipe_sleep(&p->p_rsleep, &p->p_wpos, p->p_rpos);
+	}
+	// take all we can in one go, a ring page at a time so as to
+	// catch pages that were handed over.
+	// wait to move rpos until the bytes are taken!
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
-			// pipe is empty
-			// if we got any data, return it
-			if (i > 0)
-				return i;
-			// if all the writers are gone, note eof
-			if (_pipeisclosed(fd, p))
-				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+	n = MIN(n, avail);
+	for (i = 0; i < n; i += m) {
+		pg = p->p_rpos % PIPEBUFSIZ / PGSIZE;
+		m = MIN(n - i, PGSIZE - p->p_rpos % PGSIZE);
+		if (p->p_given[pg] && pipe_take(p, pg, buf + i, n - i)) {
+			p->p_rpos += m;
+			continue;
+		}
+		if (p->p_given[pg] && (r = pipe_unsplice(p, pg)) < 0) {
+			if (i == 0)
+				return r;
+			break;
 		}
-		// there's a byte.  take it.
-		// wait to increment rpos until the byte is taken!
-		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-		p->p_rpos++;
+		pipe_copy(p, p->p_rpos, buf + i, m, 0);
+		p->p_rpos += m;
 	}
+	pipe_wake(&p->p_wsleep, &p->p_rpos);
 	return i;
 }
 
@@ -140,7 +273,8 @@ static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
-	size_t i;
+	size_t i, m;
+	uint32_t room;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -149,25 +283,33 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+	for (i = 0; i < n; i += m) {
+		while (p->p_wpos - p->p_rpos == PIPEBUFSIZ) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until readers make room
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_sleep(&p->p_wsleep, &p->p_rpos,
+				   p->p_wpos - PIPEBUFSIZ);
 		}
-		// there's room for a byte.  store it.
-		// wait to increment wpos until the byte is stored!
-		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-		p->p_wpos++;
+		// hand over a whole page, or store as much as there's
+		// room for.
+		// wait to move wpos until the bytes are stored!
+		room = PIPEBUFSIZ - (p->p_wpos - p->p_rpos);
+		if (pipe_give(p, buf + i, n - i, room))
+			m = PGSIZE;
+		else {
+			m = MIN(n - i, room);
+			pipe_copy(p, p->p_wpos, (uint8_t *) buf + i, m, 1);
+		}
+		p->p_wpos += m;
+		pipe_wake(&p->p_rsleep, &p->p_wpos);
 	}
-
 	return i;
 }
 
@@ -186,6 +328,8 @@ static int
 devpipe_close(struct Fd *fd)
 {
 	(void) sys_page_unmap(0, fd);
+	// The Pipe page goes last: it's how the other end sees us leave
+	(void) sys_page_unmap_range(0, fd2data(fd) + PGSIZE, PIPEBUFSIZ);
 	return sys_page_unmap(0, fd2data(fd));
 }
 
@@ -0,0 +1,266 @@
+// Shared-memory ring channels between environments (see inc/ring.h).
+//
+// Slot i of the ring is free for the producer that claims position pos
+// (pos % nslots == i) when rh_seq[i] == pos, and holds a message for
+// the consumer when rh_seq[i] == pos + 1.  Taking the message hands the
+// slot on to position pos + nslots.  A single producer just bumps
+// rh_tail; several race for it with cmpxchg.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define RING_MAGIC	0x474e4952	/* "RING" */
+
+struct RingHdr {
+	uint32_t rh_magic;
+	uint32_t rh_slotsize;			// Bytes per slot
+	uint32_t rh_nslots;			// A power of two
+	uint32_t rh_npages;			// Pages, header included
+	int rh_flags;
+	volatile uint32_t rh_head;		// Next position to consume
+	volatile uint32_t rh_tail;		// Next position to produce
+	volatile envid_t rh_cwait;		// Consumer asleep on empty
+	volatile envid_t rh_pwait[RING_NWAIT];	// Producers asleep on full
+	volatile uint32_t rh_seq[RING_MAXSLOTS];
+};
+
+// Order our earlier stores before our later loads.  Sleepers store
+// their envid and then look at the ring; wakers change the ring and
+// then look for sleepers.
+static inline void
+ring_fence(void)
+{
+	asm volatile("lock; addl $0, 0(%%esp)" : : : "cc", "memory");
+}
+
+// Set up a new ring of 'nslots' slots of 'slotsize' bytes at 'va',
+// mapping RING_NPAGES(slotsize, nslots) fresh pages there.
+// slotsize must be a multiple of 4 and more than 4, nslots a power of
+// two no bigger than RING_MAXSLOTS.
+// Returns 0 on success, < 0 on error.
+int
+ring_create(struct Ring *r, void *va, size_t slotsize, size_t nslots,
+	    int flags)
+{
+	struct RingHdr *h = va;
+	size_t npages;
+	uint32_t i;
+	int e;
+
+	static_assert(sizeof(struct RingHdr) <= PGSIZE);
+
+	if (slotsize <= 4 || slotsize % 4 || !nslots || nslots & (nslots - 1)
+	    || nslots > RING_MAXSLOTS || (uintptr_t) va % PGSIZE)
+		return -E_INVAL;
+	npages = RING_NPAGES(slotsize, nslots);
+	if ((e = sys_page_alloc_range(0, va, npages * PGSIZE,
+				      PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return e;
+
+	h->rh_slotsize = slotsize;
+	h->rh_nslots = nslots;
+	h->rh_npages = npages;
+	h->rh_flags = flags;
+	for (i = 0; i < nslots; i++)
+		h->rh_seq[i] = i;
+	h->rh_magic = RING_MAGIC;
+	return ring_attach(r, va);
+}
+
+// Get a handle on the ring already mapped at 'va', say after a fork
+// or spawn, or a ring_accept.
+// Returns 0 on success, -E_INVAL if there's no ring there.
+int
+ring_attach(struct Ring *r, void *va)
+{
+	struct RingHdr *h = va;
+
+	if ((uintptr_t) va % PGSIZE || !(uvpd[PDX(va)] & PTE_P)
+	    || !(uvpt[PGNUM(va)] & PTE_P) || h->rh_magic != RING_MAGIC)
+		return -E_INVAL;
+	r->r_hdr = h;
+	r->r_slots = (uint8_t *) va + PGSIZE;
+	r->r_slotsize = h->rh_slotsize;
+	r->r_mask = h->rh_nslots - 1;
+	r->r_npages = h->rh_npages;
+	r->r_flags = h->rh_flags;
+	if (r->r_slotsize <= 4 || r->r_slotsize % 4 || r->r_mask >= RING_MAXSLOTS
+	    || r->r_npages != RING_NPAGES(r->r_slotsize, r->r_mask + 1))
+		return -E_INVAL;
+	return 0;
+}
+
+// Send the pages of ring 'r' to 'dst', which must be in ring_accept,
+// one IPC per page.  Like ipc_send, panics on error.
+// Returns 0.
+int
+ring_share(struct Ring *r, envid_t dst)
+{
+	uint32_t i;
+
+	ipc_send(dst, r->r_npages, r->r_hdr, PTE_P|PTE_U|PTE_W|PTE_SHARE);
+	for (i = 1; i < r->r_npages; i++)
+		ipc_send(dst, i, r->r_slots + (i - 1) * PGSIZE,
+			 PTE_P|PTE_U|PTE_W|PTE_SHARE);
+	return 0;
+}
+
+// Receive a ring sent with ring_share, mapping it at 'va'.
+// Stores the sender's envid in *from_env_store if it's nonnull.
+// Returns 0 on success, < 0 on error.
+int
+ring_accept(struct Ring *r, void *va, envid_t *from_env_store)
+{
+	uint32_t npages, i;
+	envid_t from, who;
+	int perm;
+
+	npages = ipc_recv(&from, va, &perm);
+	if (!(perm & PTE_P) || npages < 2)
+		return -E_INVAL;
+	for (i = 1; i < npages; i++)
+		if (ipc_recv(&who, (uint8_t *) va + i * PGSIZE, &perm) != i
+		    || who != from || !(perm & PTE_P))
+			return -E_INVAL;
+	if (from_env_store)
+		*from_env_store = from;
+	return ring_attach(r, va);
+}
+
+// The longest message ring 'r' carries
+size_t
+ring_maxmsg(struct Ring *r)
+{
+	return r->r_slotsize - 4;
+}
+
+static inline uint8_t *
+ring_slot(struct Ring *r, uint32_t pos)
+{
+	return r->r_slots + (pos & r->r_mask) * r->r_slotsize;
+}
+
+// Post RING_NOTIFY to whoever is asleep in *waiter, if anyone.
+static void
+ring_wake(volatile envid_t *waiter)
+{
+	envid_t who;
+
+	if (*waiter && (who = xchg((volatile uint32_t *) waiter, 0)))
+		sys_env_notify(who, RING_NOTIFY);
+}
+
+// Put the message 'msg' of 'len' bytes into the ring without waiting.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if len > ring_maxmsg(r).
+//	-E_WOULD_BLOCK if the ring is full.
+int
+ring_try_send(struct Ring *r, const void *msg, size_t len)
+{
+	struct RingHdr *h = r->r_hdr;
+	uint32_t pos;
+	int32_t dif;
+	uint8_t *slot;
+
+	if (len > ring_maxmsg(r))
+		return -E_INVAL;
+
+	while (1) {
+		pos = h->rh_tail;
+		dif = (int32_t) (h->rh_seq[pos & r->r_mask] - pos);
+		if (dif < 0)
+			return -E_WOULD_BLOCK;
+		if (dif > 0 && !(r->r_flags & RING_MPSC))
+			return -E_INVAL;	// Only a broken peer does this
+		if (dif > 0)
+			continue;	// Another producer got here first
+		if (!(r->r_flags & RING_MPSC)) {
+			h->rh_tail = pos + 1;
+			break;
+		}
+		if (cmpxchg(&h->rh_tail, pos, pos + 1) == pos)
+			break;
+	}
+
+	slot = ring_slot(r, pos);
+	*(uint32_t *) slot = len;
+	memmove(slot + 4, msg, len);
+	h->rh_seq[pos & r->r_mask] = pos + 1;
+
+	ring_fence();
+	ring_wake(&h->rh_cwait);
+	return 0;
+}
+
+// Like ring_try_send, but sleeps while the ring is full.
+int
+ring_send(struct Ring *r, const void *msg, size_t len)
+{
+	struct RingHdr *h = r->r_hdr;
+	envid_t me = thisenv->env_id;
+	uint32_t pos;
+	int i, e;
+
+	while ((e = ring_try_send(r, msg, len)) == -E_WOULD_BLOCK) {
+		for (i = 0; i < RING_NWAIT; i++)
+			if (cmpxchg((volatile uint32_t *) &h->rh_pwait[i], 0, me) == 0)
+				break;
+		// No room to wait in; come back later
+		if (i == RING_NWAIT) {
+			sys_yield();
+			continue;
+		}
+		ring_fence();
+		pos = h->rh_tail;
+		if ((int32_t) (h->rh_seq[pos & r->r_mask] - pos) < 0)
+			sys_notify_wait(RING_NOTIFY);
+		cmpxchg((volatile uint32_t *) &h->rh_pwait[i], me, 0);
+	}
+	return e;
+}
+
+// Take the oldest message out of the ring without waiting, copying up
+// to 'len' bytes of it to 'buf'.
+// Returns the length of the message on success, < 0 on error.  Errors:
+//	-E_WOULD_BLOCK if the ring is empty.
+int
+ring_try_recv(struct Ring *r, void *buf, size_t len)
+{
+	struct RingHdr *h = r->r_hdr;
+	uint32_t pos = h->rh_head, n;
+	uint8_t *slot;
+	int i;
+
+	if (h->rh_seq[pos & r->r_mask] != pos + 1)
+		return -E_WOULD_BLOCK;
+
+	slot = ring_slot(r, pos);
+	n = MIN(*(uint32_t *) slot, ring_maxmsg(r));
+	memmove(buf, slot + 4, MIN(n, len));
+	h->rh_seq[pos & r->r_mask] = pos + r->r_mask + 1;
+	h->rh_head = pos + 1;
+
+	ring_fence();
+	for (i = 0; i < RING_NWAIT; i++)
+		ring_wake(&h->rh_pwait[i]);
+	return n;
+}
+
+// Like ring_try_recv, but sleeps while the ring is empty.
+int
+ring_recv(struct Ring *r, void *buf, size_t len)
+{
+	struct RingHdr *h = r->r_hdr;
+	uint32_t pos;
+	int n;
+
+	while ((n = ring_try_recv(r, buf, len)) == -E_WOULD_BLOCK) {
+		h->rh_cwait = thisenv->env_id;
+		ring_fence();
+		pos = h->rh_head;
+		if (h->rh_seq[pos & r->r_mask] != pos + 1)
+			sys_notify_wait(RING_NOTIFY);
+		h->rh_cwait = 0;
+	}
+	return n;
+}
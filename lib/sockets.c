@@ -16,6 +16,19 @@ struct Dev devsock =
 	.dev_stat =	devsock_stat,
 };
 
+// The network server's id for the socket 'sfd', or -E_INVAL if the
+// server that made it has been replaced since and won't know it.
+static int
+sfd2sockid(struct Fd *sfd)
+{
+	uint32_t gen;
+
+	ipc_find_service(ENV_TYPE_NS, &gen);
+	if (sfd->fd_sock.gen != gen)
+		return -E_INVAL;
+	return sfd->fd_sock.sockid;
+}
+
 static int
 fd2sockid(int fd)
 {
@@ -26,11 +39,13 @@ fd2sockid(int fd)
 		return r;
 	if (sfd->fd_dev_id != devsock.dev_id)
 		return -E_NOT_SUPP;
-	return sfd->fd_sock.sockid;
+	return sfd2sockid(sfd);
 }
 
+// Make an fd for the socket 'sockid' of the network server with
+// generation 'gen'.
 static int
-alloc_sockfd(int sockid)
+alloc_sockfd(int sockid, uint32_t gen)
 {
 	struct Fd *sfd;
 	int r;
@@ -44,18 +59,22 @@ alloc_sockfd(int sockid)
 	sfd->fd_dev_id = devsock.dev_id;
 	sfd->fd_omode = O_RDWR;
 	sfd->fd_sock.sockid = sockid;
+	sfd->fd_sock.gen = gen;
 	return fd2num(sfd);
 }
 
 int
 accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
+	uint32_t gen;
 	int r;
 	if ((r = fd2sockid(s)) < 0)
 		return r;
+	// As in socket(); fd2sockid found s to be this server's
+	ipc_find_service(ENV_TYPE_NS, &gen);
 	if ((r = nsipc_accept(r, addr, addrlen)) < 0)
 		return r;
-	return alloc_sockfd(r);
+	return alloc_sockfd(r, gen);
 }
 
 int
@@ -79,10 +98,12 @@ shutdown(int s, int how)
 static int
 devsock_close(struct Fd *fd)
 {
-	if (pageref(fd) == 1)
-		return nsipc_close(fd->fd_sock.sockid);
-	else
+	int r;
+
+	// A stale socket went away with its server
+	if (pageref(fd) > 1 || (r = sfd2sockid(fd)) < 0)
 		return 0;
+	return nsipc_close(r);
 }
 
 int
@@ -106,13 +127,21 @@ listen(int s, int backlog)
 static ssize_t
 devsock_read(struct Fd *fd, void *buf, size_t n)
 {
-	return nsipc_recv(fd->fd_sock.sockid, buf, n, 0);
+	int r;
+
+	if ((r = sfd2sockid(fd)) < 0)
+		return r;
+	return nsipc_recv(r, buf, n, 0);
 }
 
 static ssize_t
 devsock_write(struct Fd *fd, const void *buf, size_t n)
 {
-	return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
+	int r;
+
+	if ((r = sfd2sockid(fd)) < 0)
+		return r;
+	return nsipc_send(r, buf, n, 0);
 }
 
 static int
@@ -125,8 +154,12 @@ devsock_stat(struct Fd *fd, struct Stat *stat)
 int
 socket(int domain, int type, int protocol)
 {
+	uint32_t gen;
 	int r;
+	// Taken first, so a socket made by a server that replaced this
+	// one during the call just looks stale
+	ipc_find_service(ENV_TYPE_NS, &gen);
 	if ((r = nsipc_socket(domain, type, protocol)) < 0)
 		return r;
-	return alloc_sockfd(r);
+	return alloc_sockfd(r, gen);
 }
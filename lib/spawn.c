@@ -4,11 +4,14 @@
 #define UTEMP2USTACK(addr)	((void*) (addr) + (USTACKTOP - PGSIZE) - UTEMP)
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
+#define SEGWINDOW		(64 * PGSIZE)	// Most of a segment read at once
 
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
-		       int fd, size_t filesz, off_t fileoffset, int perm);
+		       int fd, size_t filesz, off_t fileoffset, int perm,
+		       struct PagerMap *pm);
+static int map_pager(envid_t child, int fd, struct PagerMap *pm);
 static int copy_shared_pages(envid_t child);
 
 // Spawn a child process from a program image loaded from the file system.
@@ -21,12 +24,13 @@ spawn(const char *prog, const char **argv)
 {
 	unsigned char elf_buf[512];
 	struct Trapframe child_tf;
+	struct PagerMap pm;
 	envid_t child;
 
 	int fd, i, r;
 	struct Elf *elf;
 	struct Proghdr *ph;
-	int perm;
+	int perm, lazy;
 
 	// This code follows this procedure:
 	//
@@ -110,8 +114,17 @@ spawn(const char *prog, const char **argv)
 	if ((r = init_stack(child, argv, &child_tf.tf_esp)) < 0)
 		return r;
 
-	// Set up program segments as defined in ELF header.
+	// Programs that link in the demand pager (see lib/pager.c) mark
+	// the segment holding it ELF_PROG_FLAG_EAGER.  Only that one is
+	// read now; the rest is paged in as the child touches it.
 	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
+	for (i = lazy = 0; i < elf->e_phnum; i++)
+		if (ph[i].p_type == ELF_PROG_LOAD
+		    && ph[i].p_flags & ELF_PROG_FLAG_EAGER)
+			lazy = 1;
+	pm.pm_nsegs = 0;
+
+	// Set up program segments as defined in ELF header.
 	for (i = 0; i < elf->e_phnum; i++, ph++) {
 		if (ph->p_type != ELF_PROG_LOAD)
 			continue;
@@ -119,9 +132,13 @@ spawn(const char *prog, const char **argv)
 		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
 			perm |= PTE_W;
 		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
-				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
+				     fd, ph->p_filesz, ph->p_offset, perm,
+				     lazy && !(ph->p_flags & ELF_PROG_FLAG_EAGER)
+				     ? &pm : NULL)) < 0)
 			goto error;
 	}
+	if (pm.pm_nsegs && (r = map_pager(child, fd, &pm)) < 0)
+		goto error;
 	close(fd);
 	fd = -1;
 
@@ -259,12 +276,16 @@ error:
 	return r;
 }
 
+// Map a segment of the program into the child.  If pm is not null,
+// the part that comes from the file is left for the child's demand
+// pager and just recorded in pm.
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
-	int fd, size_t filesz, off_t fileoffset, int perm)
+	int fd, size_t filesz, off_t fileoffset, int perm,
+	struct PagerMap *pm)
 {
-	int i, r;
-	void *blk;
+	struct PagerSeg *ps;
+	int i, n, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -275,25 +296,86 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
+	i = 0;
+	if (pm && filesz && pm->pm_nsegs < PAGER_MAXSEGS) {
+		ps = &pm->pm_segs[pm->pm_nsegs++];
+		ps->ps_va = va;
+		ps->ps_filesz = MIN(filesz, memsz);
+		ps->ps_offset = fileoffset;
+		ps->ps_perm = perm;
+		i = ROUNDUP(ps->ps_filesz, PGSIZE);
+	}
+
+	// Whole pages of text and read-only data are the same in every
+	// child, so map in the file server's cached copy rather than
+	// reading our own.
+	if (!(perm & PTE_W))
+		for (; i + PGSIZE <= filesz && i < memsz; i += PGSIZE) {
+			if ((r = read_map(fd, fileoffset + i, UTEMP)) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
+			r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm);
 			sys_page_unmap(0, UTEMP);
+			if (r < 0)
+				return r;
 		}
+
+	// Otherwise read the part that comes from the file into a window
+	// of pages at UTEMP, a window at a time, and move each window into
+	// the child with range system calls.
+	for (; i < filesz && i < memsz; i += n) {
+		n = MIN(ROUNDUP(filesz, PGSIZE) - i, SEGWINDOW);
+		if ((r = sys_page_alloc_range(0, UTEMP, n, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			goto error;
+		if ((r = readn(fd, UTEMP, MIN(n, filesz-i))) < 0)
+			goto error;
+		if ((r = sys_page_map_range(0, UTEMP, child, (void*) (va + i), n)) < 0)
+			panic("spawn: sys_page_map_range data: %e", r);
+		if (!(perm & PTE_W)
+		    && (r = sys_page_protect_range(child, (void*) (va + i), n, perm)) < 0)
+			panic("spawn: sys_page_protect_range data: %e", r);
+		sys_page_unmap_range(0, UTEMP, n);
 	}
+
+	// The rest is blank pages
+	if (i < memsz)
+		return sys_page_alloc_range(child, (void*) (va + i),
+					    ROUNDUP(memsz, PGSIZE) - i, perm);
 	return 0;
+
+error:
+	sys_page_unmap_range(0, UTEMP, n);
+	return r;
+}
+
+// Give the child what its demand pager needs: the PagerMap describing
+// the segments left to it, and the Fd page of the program file, which
+// keeps the file open on the file server for as long as the child (or
+// anything it forks) is around.
+static int
+map_pager(envid_t child, int fd, struct PagerMap *pm)
+{
+	struct Fd *fdp;
+	int r;
+
+	if ((r = fd_lookup(fd, &fdp)) < 0)
+		return r;
+	pm->pm_fsgen = fdp->fd_file.gen;
+	pm->pm_fileid = fdp->fd_file.id;
+
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	memmove(UTEMP, pm, sizeof(*pm));
+	if ((r = sys_page_map(0, UTEMP, child, (void *) PAGERMAP, PTE_P|PTE_U)) < 0
+	    || (r = sys_page_map(0, fdp, child, (void *) PAGERFD, PTE_P|PTE_U)) < 0)
+		goto error;
+	sys_page_unmap(0, UTEMP);
+	return 0;
+
+error:
+	sys_page_unmap(0, UTEMP);
+	return r;
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -301,22 +383,41 @@ static int
 copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
+   static struct PageMapReq reqs[PAGEMAP_BATCH_MAX];
+   size_t nreqs = 0;
    pde_t pdEntry;
    pte_t ptEntry;
    void *addr;   
    uint32_t pn;
+   int r;
 
-   // Map all sharable pages
+   // Map all sharable pages, a batch at a time
    for (pn = 0; pn < PGNUM(UXSTACKTOP - PGSIZE); pn++) {
       addr = (void *)(pn * PGSIZE);
       pdEntry = uvpd[PDX(addr)];
-      if (pdEntry & PTE_P) {
+      if (pdEntry & PTE_PS) {
+         // Shared large pages are mapped whole, from their first page
+         if (!(pdEntry & PTE_SHARE) || (uintptr_t)addr & (PTSIZE - 1))
+            continue;
+         reqs[nreqs].perm = pdEntry & PTE_SYSCALL;
+      }
+      else if (pdEntry & PTE_P) {
          ptEntry = uvpt[pn];
-         if (ptEntry & PTE_P && ptEntry & PTE_SHARE)
-            sys_page_map(0, addr, child, addr, PTE_SHARE | PTE_U | PTE_W | PTE_P);
+         if (!(ptEntry & PTE_P && ptEntry & PTE_SHARE))
+            continue;
+         reqs[nreqs].perm = PTE_SHARE | PTE_U | PTE_W | PTE_P;
+      }
+      else {
+         pn = ROUNDUP(pn + 1, NPTENTRIES) - 1;
+         continue;
+      }
+      reqs[nreqs].srcva = reqs[nreqs].dstva = addr;
+      if (++nreqs == PAGEMAP_BATCH_MAX) {
+         if ((r = sys_page_map_batch(0, child, reqs, nreqs)) < 0)
+            return r;
+         nreqs = 0;
       }
    }
 
-	return 0;
+	return sys_page_map_batch(0, child, reqs, nreqs);
 }
-
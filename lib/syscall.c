@@ -85,8 +85,56 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_large, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_alloc_range, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, size_t len)
+{
+	return syscall(SYS_page_map_range, 1, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva, len);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, len, 0, 0);
+}
+
+int
+sys_page_protect_range(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_protect_range, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_page_map_batch(envid_t srcenv, envid_t dstenv, const struct PageMapReq *reqs, size_t n)
+{
+	return syscall(SYS_page_map_batch, 1, srcenv, dstenv, (uint32_t) reqs, n, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_page_limit(envid_t envid, uint32_t limit)
+{
+	return syscall(SYS_env_set_page_limit, 1, envid, limit, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -111,12 +159,107 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm,
+		   void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva,
+		       perm, (uint32_t) dstva);
+}
+
+int
+sys_page_give(volatile uint32_t *addr, void *srcva, int perm)
+{
+	return syscall(SYS_page_give, 0, (uint32_t) addr, (uint32_t) srcva,
+		       perm, 0, 0);
+}
+
+int
+sys_page_take(volatile uint32_t *addr, void *dstva)
+{
+	return syscall(SYS_page_take, 0, (uint32_t) addr, (uint32_t) dstva,
+		       0, 0, 0);
+}
+
+int
+sys_service_register(enum EnvType type)
+{
+	return syscall(SYS_service_register, 0, type, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_sendv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+	      size_t nsegs)
+{
+	return syscall(SYS_ipc_sendv, 0, envid, value, (uint32_t) segs, nsegs, 0);
+}
+
+int
+sys_ipc_callv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+	      size_t nsegs, const struct IpcSeg *dst)
+{
+	return syscall(SYS_ipc_callv, 0, envid, value, (uint32_t) segs, nsegs,
+		       (uint32_t) dst);
+}
+
+int
+sys_ipc_reply_waitv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+		    size_t nsegs, const struct IpcSeg *dst)
+{
+	return syscall(SYS_ipc_reply_waitv, 0, envid, value, (uint32_t) segs,
+		       nsegs, (uint32_t) dst);
+}
+
+int
+sys_ipc_set_queue(unsigned depth)
+{
+	return syscall(SYS_ipc_set_queue, 1, depth, 0, 0, 0, 0);
+}
+
+int
+sys_env_notify(envid_t envid, uint32_t bits)
+{
+	return syscall(SYS_env_notify, 0, envid, bits, 0, 0, 0);
+}
+
+int
+sys_notify_wait(uint32_t mask)
+{
+	return syscall(SYS_notify_wait, 1, mask, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected, timeout,
+		       0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, uint32_t n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
@@ -47,7 +47,12 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
-	thread_yield();
+	// With no other thread to run, nothing here can change *addr
+	// before the deadline, so sleep instead of spinning
+	if (thread_queue.tq_first)
+	    thread_yield();
+	else
+	    sys_futex_wait(addr ? addr : &p, addr ? val : p, msec - p);
 	p = sys_time_msec();
     }
 
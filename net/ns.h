@@ -8,8 +8,11 @@
 #define TIMER_INTERVAL 250
 
 // Virtual address at which to receive page mappings containing client requests.
+// Each of the QUEUE_SIZE slots has room for the request page and the
+// data pages of a large request after it.
 #define QUEUE_SIZE	20
-#define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+#define REQSLOT		((1 + NSLARGE_MAXPAGES) * PGSIZE)
+#define REQVA		0xB0000000
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
@@ -64,7 +64,7 @@ get_buffer(void) {
 		return 0;
 	}
 
-	va = (void *)(REQVA + i * PGSIZE);
+	va = (void *)(REQVA + i * REQSLOT);
 	buse[i] = 1;
 
 	return va;
@@ -72,7 +72,7 @@ get_buffer(void) {
 
 static void
 put_buffer(void *va) {
-	int i = ((uint32_t)va - REQVA) / PGSIZE;
+	int i = ((uint32_t)va - REQVA) / REQSLOT;
 	buse[i] = 0;
 }
 
@@ -181,6 +181,7 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	size_t npages;		// Data pages after the request page
 };
 
 static void
@@ -226,6 +227,16 @@ serve_thread(uint32_t a) {
 		r = lwip_send(req->send.req_s, &req->send.req_buf,
 			      req->send.req_size, req->send.req_flags);
 		break;
+	case NSREQ_RECV_LARGE:
+		r = lwip_recv(req->recv.req_s, (char *)req + PGSIZE,
+			      MIN(req->recv.req_len, args->npages * PGSIZE),
+			      req->recv.req_flags);
+		break;
+	case NSREQ_SEND_LARGE:
+		r = lwip_send(req->send.req_s, (char *)req + PGSIZE,
+			      MIN(req->send.req_size, args->npages * PGSIZE),
+			      req->send.req_flags);
+		break;
 	case NSREQ_SOCKET:
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
@@ -250,15 +261,18 @@ serve_thread(uint32_t a) {
 		ipc_send(args->whom, r, 0, 0);
 
 	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	sys_page_unmap_range(0, (void*) args->req,
+			     (1 + args->npages) * PGSIZE);
 	free(args);
 }
 
 void
 serve(void) {
+	struct IpcSeg window;
 	int32_t reqno;
 	uint32_t whom;
-	int i, perm;
+	size_t npages;
+	int i;
 	void *va;
 
 	while (1) {
@@ -268,9 +282,10 @@ serve(void) {
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
 
-		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		window = (struct IpcSeg) { va, 1 + NSLARGE_MAXPAGES, 0 };
+		reqno = ipc_reply_recvv(0, 0, NULL, 0, (int32_t *) &whom,
+					&window, &npages);
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -283,7 +298,7 @@ serve(void) {
 		}
 
 		// All remaining requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		if (!npages) {
 			cprintf("Invalid request from %08x: no argument page\n", whom);
 			continue; // just leave it hanging...
 		}
@@ -296,6 +311,7 @@ serve(void) {
 
 		args->reqno = reqno;
 		args->whom = whom;
+		args->npages = npages - 1;
 		args->req = va;
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
@@ -315,9 +331,15 @@ void
 umain(int argc, char **argv)
 {
 	envid_t ns_envid = sys_getenvid();
+	int r;
    
 	binaryname = "ns";
 
+	// Take over as the ns, if we weren't started as it; then our
+	// parent must be the ns we succeed
+	if ((r = sys_service_register(ENV_TYPE_NS)) < 0)
+		panic("sys_service_register: %e", r);
+
 	// fork off the timer thread which will send us periodic messages
 	timer_envid = fork();
 	if (timer_envid < 0)
@@ -9,7 +9,8 @@ timer(envid_t ns_envid, uint32_t initial_to) {
 
 	while (1) {
 		while((r = sys_time_msec()) < stop && r >= 0) {
-			sys_yield();
+			// nobody wakes 'stop', so this just sleeps
+			sys_futex_wait(&stop, stop, stop - r);
 		}
 		if (r < 0)
 			panic("sys_time_msec: %e", r);
@@ -0,0 +1,46 @@
+// compare streaming over pages of every cache color with streaming
+// over the same number of pages that all have one color
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NPG	48		// Working set: 192KB
+#define NPASS	200
+#define VA	((char *) 0xA0000000)
+
+static uint64_t
+bench(const char *name, size_t stride)
+{
+	uint64_t start, cycles;
+	volatile uint32_t *p;
+	uint32_t sum = 0;
+	int i, pass, r;
+
+	// Pages get the color of the virtual page they are first
+	// written at, so this decides how the working set is colored
+	for (i = 0; i < NPG; i++) {
+		if ((r = sys_page_alloc(0, VA + i * stride, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		VA[i * stride] = i;
+	}
+
+	start = read_tsc();
+	for (pass = 0; pass < NPASS; pass++)
+		for (i = 0; i < NPG; i++)
+			for (p = (uint32_t *) (VA + i * stride);
+			     p < (uint32_t *) (VA + i * stride + PGSIZE); p += 8)
+				sum += *p;
+	cycles = read_tsc() - start;
+
+	for (i = 0; i < NPG; i++)
+		sys_page_unmap(0, VA + i * stride);
+	cprintf("%s: %llu cycles per pass (sum %u)\n", name, cycles / NPASS, sum);
+	return cycles;
+}
+
+void
+umain(int argc, char **argv)
+{
+	bench("all colors", PGSIZE);
+	bench("one color", PAGE_NCOLORS * PGSIZE);
+}
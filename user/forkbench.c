@@ -0,0 +1,46 @@
+// compare the in-kernel fork against the user-level ufork
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NFORK	20
+#define NPAGES	32
+
+char buf[NPAGES * PGSIZE];
+
+static uint64_t
+bench(const char *name, envid_t (*forkfn)(void))
+{
+	uint64_t start, cycles;
+	envid_t who;
+	int i, j;
+
+	start = read_tsc();
+	for (i = 0; i < NFORK; i++) {
+		if ((who = forkfn()) < 0)
+			panic("%s: %e", name, who);
+		if (who == 0) {
+			// Touch every page so each one takes a COW fault
+			for (j = 0; j < NPAGES; j++)
+				buf[j * PGSIZE] = 'c';
+			exit();
+		}
+		// The parent's copy must not see the child's writes
+		for (j = 0; j < NPAGES; j++)
+			buf[j * PGSIZE] = 'p';
+		wait(who);
+		for (j = 0; j < NPAGES; j++)
+			if (buf[j * PGSIZE] != 'p')
+				panic("%s: child wrote to our page %d", name, j);
+	}
+	cycles = read_tsc() - start;
+	cprintf("%s: %llu cycles per fork+wait\n", name, cycles / NFORK);
+	return cycles;
+}
+
+void
+umain(int argc, char **argv)
+{
+	bench("fork", fork);
+	bench("ufork", ufork);
+}
@@ -0,0 +1,105 @@
+// pipe throughput between two envs, for a few write sizes, copied and
+// spliced; and a check that spliced pages keep what was written
+
+#include <inc/lib.h>
+
+#define TOTAL	(8 * 1024 * 1024)
+
+static uint8_t buf[64 * 1024 + PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Writes come from buf + off, so only off == 0 can splice whole pages
+static void
+bench(size_t chunk, size_t off)
+{
+	uint32_t start, ms;
+	size_t done, i;
+	int p[2], r;
+	envid_t pid;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((pid = fork()) < 0)
+		panic("fork: %e", pid);
+	if (pid == 0) {
+		close(p[0]);
+		for (i = 0; i < chunk; i++)
+			buf[off + i] = i;
+		for (done = 0; done < TOTAL; done += chunk)
+			if ((r = write(p[1], buf + off, chunk)) != chunk)
+				panic("write: %e", r);
+		exit();
+	}
+
+	close(p[1]);
+	start = sys_time_msec();
+	for (done = 0; (r = read(p[0], buf, 64 * 1024)) > 0; done += r)
+		if (buf[0] != (uint8_t) (done % chunk))
+			panic("read the wrong bytes at %d", done);
+	if (r < 0)
+		panic("read: %e", r);
+	if (done != TOTAL)
+		panic("read %d bytes, not %d", done, TOTAL);
+	ms = MAX(sys_time_msec() - start, 1);
+	close(p[0]);
+	wait(pid);
+
+	cprintf("pipebench: %6d-byte %s writes: %d ms, %d KB/s\n",
+		chunk, off ? "copied" : "spliced", ms,
+		TOTAL / ms * 1000 / 1024);
+}
+
+// The writer scribbles on each page right after writing it, and the
+// reader takes some pages whole and some in pieces.
+static void
+check_splice(void)
+{
+	uint32_t *page = (uint32_t *) buf;
+	int p[2], i, r;
+	envid_t pid;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((pid = fork()) < 0)
+		panic("fork: %e", pid);
+	if (pid == 0) {
+		close(p[0]);
+		for (i = 0; i < 40; i++) {
+			page[0] = page[PGSIZE / 4 - 1] = i;
+			if ((r = write(p[1], page, PGSIZE)) != PGSIZE)
+				panic("write: %e", r);
+			page[0] = page[PGSIZE / 4 - 1] = ~0;
+		}
+		exit();
+	}
+
+	close(p[1]);
+	for (i = 0; i < 40; i++) {
+		if (i % 3 == 0) {
+			// half a page, then the rest
+			if ((r = readn(p[0], buf + 1, PGSIZE / 2)) != PGSIZE / 2
+			    || (r = readn(p[0], buf + 1 + PGSIZE / 2, PGSIZE / 2)) != PGSIZE / 2)
+				panic("read: %e", r);
+			memmove(buf, buf + 1, PGSIZE);
+		} else if ((r = readn(p[0], page, PGSIZE)) != PGSIZE)
+			panic("read: %e", r);
+		if (page[0] != i || page[PGSIZE / 4 - 1] != i)
+			panic("spliced page %d came out as %d/%d", i, page[0],
+			      page[PGSIZE / 4 - 1]);
+	}
+	if ((r = read(p[0], buf, PGSIZE)) != 0)
+		panic("read past the end: %e", r);
+	close(p[0]);
+	wait(pid);
+	cprintf("pipebench: spliced pages are intact\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	check_splice();
+	bench(512, 1);
+	bench(4096, 1);
+	bench(4096, 0);
+	bench(64 * 1024, 1);
+	bench(64 * 1024, 0);
+}
@@ -0,0 +1,46 @@
+// test that spawned programs are paged in on demand
+
+#include <inc/lib.h>
+
+#define NPG	16
+
+// Read-only data the child only looks at part of
+const uint32_t table[NPG * PGSIZE / 4] = { [0] = 0x0123, [NPG * PGSIZE / 4 - 1] = 0x4567 };
+// Initialized data that the child writes to
+uint32_t data[NPG * PGSIZE / 4] = { [0] = 0x89ab };
+
+static int
+mapped(const void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+
+	if (argc < 2) {
+		if ((child = spawnl("/testdemand", "testdemand", "child", 0)) < 0)
+			panic("spawn: %e", child);
+		wait(child);
+		return;
+	}
+
+	if (mapped(&table[PGSIZE]) || mapped(&table[NPG * PGSIZE / 4 - 1]))
+		panic("read-only data was loaded before it was touched");
+	if (table[NPG * PGSIZE / 4 - 1] != 0x4567 || table[0] != 0x0123)
+		panic("read-only data paged in wrong");
+	if (mapped(&table[PGSIZE]))
+		panic("untouched page was paged in along with its neighbours");
+	if (uvpt[PGNUM(&table[0])] & PTE_W)
+		panic("read-only data was paged in writable");
+
+	if (data[0] != 0x89ab)
+		panic("data paged in wrong");
+	data[0] = 0xcdef;
+	if (data[0] != 0xcdef || !(uvpt[PGNUM(&data[0])] & PTE_W))
+		panic("data didn't become writable");
+
+	cprintf("demand paging works\n");
+}
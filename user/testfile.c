@@ -3,6 +3,11 @@
 const char *msg = "This is the NEW message of the day!\n\n";
 
 #define FVA ((struct Fd*)0xCCCCC000)
+#define MAPVA ((char*)0xCCCCD000)
+
+// Enough pages that the write goes as one FSREQ_WRITE_LARGE
+#define NBIG 40
+static char big[NBIG * BLKSIZE];
 
 static int
 xopen(const char *path, int mode)
@@ -18,6 +23,33 @@ xopen(const char *path, int mode)
 	return ipc_recv(NULL, FVA, NULL);
 }
 
+// Check that 'path' holds big[] with every int at offset i being i + k
+static void
+check_big(const char *path, int k)
+{
+	int f, r, i;
+
+	memset(big, 0, sizeof(big));
+	if ((f = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, f);
+	if ((r = readn(f, big, sizeof(big))) != sizeof(big))
+		panic("read %s returned %d: %e", path, r, r);
+	for (i = 0; i < sizeof(big); i += sizeof(int))
+		if (*(int*)(big + i) != i + k)
+			panic("read %s at %d returned bad data %d",
+			      path, i, *(int*)(big + i));
+	close(f);
+}
+
+static void
+fill_big(int k)
+{
+	int i;
+
+	for (i = 0; i < sizeof(big); i += sizeof(int))
+		*(int*)(big + i) = i + k;
+}
+
 void
 umain(int argc, char **argv)
 {
@@ -71,7 +103,7 @@ umain(int argc, char **argv)
 	if ((r = xopen("/new-file", O_RDWR|O_CREAT)) < 0)
 		panic("serve_open /new-file: %e", r);
 
-	//if ((r = devfile.dev_write(FVA, msg, strlen(msg))) != strlen(msg))
+	if ((r = devfile.dev_write(FVA, msg, strlen(msg))) != strlen(msg))
 		panic("file_write: %e", r);
 	cprintf("file_write is good\n");
 
@@ -85,6 +117,16 @@ umain(int argc, char **argv)
 		panic("file_read after file_write returned wrong data");
 	cprintf("file_read after file_write is good\n");
 
+	// The server, not just the fd layer, must refuse writes to a file
+	// that isn't open for writing
+	if ((r = xopen("/newmotd", O_RDONLY)) < 0)
+		panic("serve_open /newmotd: %e", r);
+	if ((r = devfile.dev_write(FVA, msg, strlen(msg))) != -E_INVAL)
+		panic("serve_write to a read-only file: %e", r);
+	if ((r = devfile.dev_trunc(FVA, 0)) != -E_INVAL)
+		panic("serve_set_size of a read-only file: %e", r);
+	cprintf("read-only file is good\n");
+
 	// Now we'll try out open
 	if ((r = open("/not-found", O_RDONLY)) < 0 && r != -E_NOT_FOUND)
 		panic("open /not-found: %e", r);
@@ -124,5 +166,41 @@ umain(int argc, char **argv)
 	}
 	close(f);
 	cprintf("large file is good\n");
+
+	// A write bigger than the request page goes as one
+	// FSREQ_WRITE_LARGE
+	fill_big(0);
+	if ((f = open("/bigwrite", O_RDWR|O_CREAT)) < 0)
+		panic("creat /bigwrite: %e", f);
+	if ((r = write(f, big, sizeof(big))) != sizeof(big))
+		panic("write /bigwrite returned %d: %e", r, r);
+	close(f);
+	check_big("/bigwrite", 0);
+	cprintf("large write is good\n");
+
+	// The fs checks what bc_sync puts on the disk itself (see
+	// fs/test.c); here the rewritten data must survive a sync()
+	fill_big(1);
+	if ((f = open("/bigwrite", O_WRONLY)) < 0)
+		panic("open /bigwrite: %e", f);
+	if ((r = write(f, big, sizeof(big))) != sizeof(big))
+		panic("rewrite /bigwrite returned %d: %e", r, r);
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+	check_big("/bigwrite", 1);
+	cprintf("sync is good\n");
+
+	// Writing a block someone has mapped with read_map must leave
+	// their copy alone
+	if ((r = read_map(f, 0, MAPVA)) < 0)
+		panic("read_map /bigwrite: %e", r);
+	seek(f, 0);
+	if ((r = write(f, "x", 1)) != 1)
+		panic("write /bigwrite over a mapped block: %e", r);
+	if (*(int*)MAPVA != 1)
+		panic("write /bigwrite changed a read_map page");
+	sys_page_unmap(0, MAPVA);
+	close(f);
+	cprintf("write to a mapped block is good\n");
 }
 
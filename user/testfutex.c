@@ -0,0 +1,51 @@
+// test futex wait/wake, within an env and across a PTE_SHARE page
+
+#include <inc/lib.h>
+
+#define SHARED	((volatile uint32_t *) 0xA0000000)
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t word = 7, start;
+	envid_t child;
+	int r;
+
+	if ((r = sys_futex_wait(&word, 8, 0)) != -E_WOULD_BLOCK)
+		panic("futex_wait on a changed word returned %e", r);
+	if ((r = sys_futex_wait((uint32_t *) 0xA0000002, 0, 0)) != -E_INVAL)
+		panic("futex_wait on an unaligned word returned %e", r);
+	if ((r = sys_futex_wake(&word, 1)) != 0)
+		panic("futex_wake with nobody waiting woke %d", r);
+
+	start = sys_time_msec();
+	if ((r = sys_futex_wait(&word, 7, 50)) != -E_TIMEOUT)
+		panic("futex_wait with a timeout returned %e", r);
+	if (sys_time_msec() - start < 40)
+		panic("futex_wait timed out after only %d ms",
+		      sys_time_msec() - start);
+
+	if ((r = sys_page_alloc(0, (void *) SHARED, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*SHARED = 0;
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		while (*SHARED == 0)
+			sys_futex_wait(SHARED, 0, 0);
+		if (*SHARED != 1)
+			panic("child woke up to %d", *SHARED);
+		exit();
+	}
+
+	// The child should leave the run queue, not spin
+	while (!envs[ENVX(child)].env_futex_pa
+	       || envs[ENVX(child)].env_status != ENV_NOT_RUNNABLE)
+		sys_yield();
+	*SHARED = 1;
+	if ((r = sys_futex_wake(SHARED, ~0)) != 1)
+		panic("futex_wake woke %d envs", r);
+	wait(child);
+
+	cprintf("futexes work\n");
+}
@@ -0,0 +1,76 @@
+// test sys_ipc_call and sys_ipc_reply_wait against send/recv round trips
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NCALL	1000
+#define REQVA	((char *) 0xA0000000)
+
+static void
+server(void)
+{
+	envid_t whom = 0;
+	uint32_t req, r = 0;
+	int perm;
+
+	while (1) {
+		req = ipc_reply_recv(whom, r, 0, 0, &whom, REQVA, &perm);
+		// A request page holds the number to add
+		r = req + ((perm & PTE_P) ? *(uint32_t *) REQVA : 0);
+		if (perm & PTE_P)
+			sys_page_unmap(0, REQVA);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t srv, child, from, me = thisenv->env_id;
+	int i, r, perm;
+
+	if ((srv = fork()) < 0)
+		panic("fork: %e", srv);
+	if (srv == 0)
+		server();
+
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*(uint32_t *) UTEMP = 100;
+	if ((r = ipc_call(srv, 5, UTEMP, PTE_P|PTE_U, 0, &perm)) != 105 || perm)
+		panic("call with a page got %d back", r);
+
+	// Another env's message waits in the queue while we call
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		ipc_send(me, 777, 0, 0);
+		exit();
+	}
+	wait(child);
+	if ((r = ipc_call(srv, 7, 0, 0, 0, 0)) != 7)
+		panic("call with a message queued got %d back", r);
+	if ((r = ipc_recv(&from, 0, 0)) != 777 || from != child)
+		panic("queued message came out as %d from %08x", r, from);
+	if ((r = sys_ipc_call(me, 0, (void *) UTOP, 0, (void *) UTOP)) != -E_INVAL)
+		panic("call to ourselves: %e", r);
+
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		if ((r = ipc_call(srv, i, 0, 0, 0, 0)) != i)
+			panic("call %d got %d back", i, r);
+	cprintf("ipc_call: %llu cycles per round trip\n",
+		(read_tsc() - start) / NCALL);
+
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++) {
+		ipc_send(srv, i, 0, 0);
+		if ((r = ipc_recv(0, 0, 0)) != i)
+			panic("send/recv %d got %d back", i, r);
+	}
+	cprintf("ipc_send+ipc_recv: %llu cycles per round trip\n",
+		(read_tsc() - start) / NCALL);
+
+	sys_env_destroy(srv);
+	cprintf("ipc call works\n");
+}
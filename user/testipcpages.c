@@ -0,0 +1,101 @@
+// test multi-page IPC, and large file reads against page-at-a-time ones
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define SRCVA	((char *) 0xA0000000)
+#define DSTVA	((char *) 0xA0400000)
+#define NPAGES	8
+#define BIGREAD	(64 * PGSIZE)
+
+static char big[BIGREAD], small[BIGREAD];
+
+static void
+server(void)
+{
+	struct IpcSeg reply, window = { DSTVA, NPAGES, 0 };
+	envid_t whom = 0;
+	size_t npages = 0, i;
+
+	while (1) {
+		// Send back what came in, with every page's first word doubled
+		reply = (struct IpcSeg) { DSTVA, npages, PTE_P|PTE_U|PTE_W };
+		ipc_reply_recvv(whom, npages, &reply, 1, &whom, &window,
+				&npages);
+		for (i = 0; i < npages; i++)
+			*(uint32_t *) (DSTVA + i * PGSIZE) *= 2;
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct IpcSeg segs[3], dst;
+	uint64_t start;
+	envid_t srv;
+	size_t npages;
+	int i, fd, n, r;
+
+	if ((r = sys_page_alloc_range(0, SRCVA, NPAGES * PGSIZE,
+				      PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc_range: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		*(uint32_t *) (SRCVA + i * PGSIZE) = i;
+
+	if ((srv = fork()) < 0)
+		panic("fork: %e", srv);
+	if (srv == 0)
+		server();
+
+	// A run and two single pages out of order, as one message
+	segs[0] = (struct IpcSeg) { SRCVA, 4, PTE_P|PTE_U|PTE_W };
+	segs[1] = (struct IpcSeg) { SRCVA + 7 * PGSIZE, 1, PTE_P|PTE_U|PTE_W };
+	segs[2] = (struct IpcSeg) { SRCVA + 5 * PGSIZE, 1, PTE_P|PTE_U|PTE_W };
+	dst = (struct IpcSeg) { DSTVA, NPAGES, 0 };
+	if ((r = ipc_callv(srv, 0, segs, 3, &dst, &npages)) != 6 || npages != 6)
+		panic("callv of 6 pages got %d back, %d pages", r, npages);
+	for (i = 0; i < 6; i++)
+		if (*(uint32_t *) (DSTVA + i * PGSIZE) != 2 * "\0\1\2\3\7\5"[i])
+			panic("page %d came back as %d", i,
+			      *(uint32_t *) (DSTVA + i * PGSIZE));
+	if (*(uint32_t *) SRCVA != 0 || *(uint32_t *) (SRCVA + 7 * PGSIZE) != 14)
+		panic("pages weren't shared");
+
+	// Only as many pages as the receiver asks for are mapped
+	dst.npages = 2;
+	sys_page_unmap_range(0, DSTVA, NPAGES * PGSIZE);
+	if ((r = ipc_callv(srv, 0, segs, 1, &dst, &npages)) != 4 || npages != 2)
+		panic("callv into 2 pages got %d back, %d pages", r, npages);
+	if (uvpt[PGNUM(DSTVA + 2 * PGSIZE)] & PTE_P)
+		panic("a page past the receive window was mapped");
+
+	dst.va = DSTVA + 1;
+	if ((r = sys_ipc_callv(srv, 0, segs, 1, &dst)) != -E_INVAL)
+		panic("callv into an unaligned window: %e", r);
+	segs[0].npages = IPC_MAXPAGES + 1;
+	if ((r = sys_ipc_sendv(srv, 0, segs, 1)) != -E_INVAL)
+		panic("sendv of too many pages: %e", r);
+	segs[0] = (struct IpcSeg) { (void *) (UTOP - PGSIZE), 2, PTE_P|PTE_U };
+	if ((r = sys_ipc_sendv(srv, 0, segs, 1)) != -E_INVAL)
+		panic("sendv past UTOP: %e", r);
+	sys_env_destroy(srv);
+
+	// One large read against a page at a time
+	if ((fd = open("/init", O_RDONLY)) < 0)
+		panic("open /init: %e", fd);
+	start = read_tsc();
+	if ((n = read(fd, big, BIGREAD)) <= PGSIZE)
+		panic("large read of /init returned %e", n);
+	cprintf("large read: %llu cycles for %d bytes\n", read_tsc() - start, n);
+	seek(fd, 0);
+	start = read_tsc();
+	for (i = 0; i < n; i += r)
+		if ((r = read(fd, small + i, MIN(PGSIZE, n - i))) <= 0)
+			panic("read of /init at %d returned %e", i, r);
+	cprintf("page reads: %llu cycles for %d bytes\n", read_tsc() - start, n);
+	if (memcmp(big, small, n) != 0)
+		panic("large and page reads differ");
+	close(fd);
+
+	cprintf("multi-page ipc works\n");
+}
@@ -0,0 +1,65 @@
+// test the per-env IPC message queues
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0xA0000000)
+#define NMSG	8
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who, child;
+	int i, r, perm;
+
+	// Messages to ourselves can only ever be queued
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	for (i = 0; i < IPC_QDEPTH; i++) {
+		((int *) UTEMP)[0] = i;
+		if ((r = sys_ipc_try_send(thisenv->env_id, i, UTEMP, PTE_P|PTE_U)) < 0)
+			panic("queueing message %d: %e", i, r);
+		// Each message carries its own page
+		sys_page_unmap(0, UTEMP);
+		if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	}
+	if ((r = sys_ipc_try_send(thisenv->env_id, i, 0, 0)) != -E_IPC_NOT_RECV)
+		panic("send to a full queue returned %e", r);
+	if (thisenv->env_ipc_qlen != IPC_QDEPTH)
+		panic("queue holds %d messages", thisenv->env_ipc_qlen);
+
+	for (i = 0; i < IPC_QDEPTH; i++) {
+		r = ipc_recv(&who, VA, &perm);
+		if (r != i || who != thisenv->env_id)
+			panic("message %d came back as %d from %08x", i, r, who);
+		if (perm != (PTE_P|PTE_U) || *(int *) VA != i)
+			panic("message %d brought the wrong page", i);
+	}
+
+	// A deeper queue takes more before pushing back
+	if ((r = sys_ipc_set_queue(IPC_QMAX + 1)) != -E_INVAL)
+		panic("sys_ipc_set_queue past IPC_QMAX: %e", r);
+	if ((r = sys_ipc_set_queue(IPC_QMAX)) < 0)
+		panic("sys_ipc_set_queue: %e", r);
+	for (i = 0; i < IPC_QMAX; i++)
+		if ((r = sys_ipc_try_send(thisenv->env_id, i, 0, 0)) < 0)
+			panic("queueing message %d: %e", i, r);
+	for (i = 0; i < IPC_QMAX; i++)
+		if ((r = ipc_recv(0, 0, &perm)) != i || perm != 0)
+			panic("message %d came back as %d", i, r);
+
+	// A child's sends arrive in order whether or not we're waiting
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < NMSG; i++)
+			ipc_send(thisenv->env_parent_id, i, 0, 0);
+		exit();
+	}
+	for (i = 0; i < NMSG; i++)
+		if ((r = ipc_recv(&who, 0, 0)) != i || who != child)
+			panic("message %d from the child came back as %d", i, r);
+	wait(child);
+
+	cprintf("ipc queues work\n");
+}
@@ -0,0 +1,68 @@
+// test blocking IPC sends and the order blocked senders are served in
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NMSG	3
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NCHILD], who;
+	uint32_t runs[NCHILD];
+	int seen[NCHILD], next[NCHILD];
+	int i, j, r, blocked;
+
+	// With no queue at all every send has to wait for us
+	if ((r = sys_ipc_set_queue(0)) < 0)
+		panic("sys_ipc_set_queue: %e", r);
+	if ((r = sys_ipc_send(thisenv->env_id, 0, 0, 0)) != -E_IPC_NOT_RECV)
+		panic("blocking send to ourselves returned %e", r);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			for (j = 0; j < NMSG; j++)
+				ipc_send(thisenv->env_parent_id, j, 0, 0);
+			exit();
+		}
+	}
+
+	// Wait until every child is asleep on our wait list
+	do {
+		sys_yield();
+		for (i = blocked = 0; i < NCHILD; i++)
+			if (envs[ENVX(kids[i])].env_ipc_sendto == thisenv->env_id
+			    && envs[ENVX(kids[i])].env_status == ENV_NOT_RUNNABLE)
+				blocked++;
+	} while (blocked < NCHILD);
+
+	// Blocked senders must not be spinning
+	for (i = 0; i < NCHILD; i++)
+		runs[i] = envs[ENVX(kids[i])].env_runs;
+	for (i = 0; i < 10; i++)
+		sys_yield();
+	for (i = 0; i < NCHILD; i++)
+		if (envs[ENVX(kids[i])].env_runs != runs[i])
+			panic("child %d ran while blocked in sys_ipc_send", i);
+
+	// Served first come, first served: every child once before any twice
+	memset(seen, 0, sizeof(seen));
+	memset(next, 0, sizeof(next));
+	for (i = 0; i < NCHILD * NMSG; i++) {
+		r = ipc_recv(&who, 0, 0);
+		for (j = 0; j < NCHILD && kids[j] != who; j++)
+			;
+		if (j == NCHILD)
+			panic("message from stranger %08x", who);
+		if (r != next[j]++)
+			panic("child %d's messages arrived out of order", j);
+		if (i < NCHILD && seen[j]++)
+			panic("child %d was served twice before the others", j);
+	}
+	for (i = 0; i < NCHILD; i++)
+		wait(kids[i]);
+
+	cprintf("blocking ipc sends work\n");
+}
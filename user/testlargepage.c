@@ -0,0 +1,73 @@
+// test 4MB large pages from sys_page_alloc_large
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0x40000000)
+
+// The child of 'forker' sees our large page, and neither of us sees
+// the other's writes to it afterwards
+static void
+check_fork(envid_t (*forker)(void), const char *name)
+{
+	envid_t child;
+	int i;
+
+	if ((child = forker()) < 0)
+		panic("%s: %e", name, child);
+	if (child == 0) {
+		for (i = 0; i < PTSIZE; i += PGSIZE)
+			if (VA[i] != (char) (i >> PGSHIFT))
+				panic("%s child's large page is wrong at offset %x",
+				      name, i);
+		VA[PTSIZE - 1] = 42;
+		if (!(uvpd[PDX(VA)] & PTE_PS) || VA[PTSIZE - 1] != 42)
+			panic("%s child's copy isn't a writable large page", name);
+		exit();
+	}
+	VA[0] = 99;
+	wait(child);
+	if (VA[PTSIZE - 1] != 0)
+		panic("%s child's write to the large page was seen", name);
+	if (!(uvpd[PDX(VA)] & PTE_PS))
+		panic("large page split by writing to it after %s", name);
+	VA[0] = 0;
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		if (VA[i] != (char) (i >> PGSHIFT))
+			panic("large page lost its contents at offset %x", i);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	if ((r = sys_page_alloc_large(0, VA, PTE_P|PTE_W|PTE_U)) < 0)
+		panic("sys_page_alloc_large: %e", r);
+	if (!(uvpd[PDX(VA)] & PTE_PS))
+		panic("no large page mapped at %08x", VA);
+
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		if (VA[i] != 0 || VA[i + PGSIZE - 1] != 0)
+			panic("large page isn't zeroed at offset %x", i);
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		VA[i] = i >> PGSHIFT;
+
+	// misaligned mappings are refused
+	if ((r = sys_page_alloc_large(0, VA + PGSIZE, PTE_P|PTE_W|PTE_U)) != -E_INVAL)
+		panic("misaligned sys_page_alloc_large returned %e", r);
+	if ((r = sys_page_map(0, VA + PGSIZE, 0, UTEMP, PTE_P|PTE_U)) != -E_INVAL)
+		panic("sys_page_map of part of a large page returned %e", r);
+
+	// fork and ufork give the child a copy-on-write copy of the
+	// large page, which stays a large page on either side
+	check_fork(fork, "fork");
+	check_fork(ufork, "ufork");
+
+	// unmapping any part of it unmaps the whole thing
+	if ((r = sys_page_unmap(0, VA + 5 * PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (uvpd[PDX(VA)] & PTE_P)
+		panic("large page still mapped after sys_page_unmap");
+
+	cprintf("large pages work\n");
+}
@@ -0,0 +1,67 @@
+// test per-env page accounting and page limits
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0xA0000000)
+#define NPG	10
+
+void
+umain(int argc, char **argv)
+{
+	const volatile struct Env *e = &envs[ENVX(sys_getenvid())];
+	uint32_t before;
+	envid_t child;
+	int i, r;
+
+	before = e->env_npages;
+	if ((r = sys_page_alloc_range(0, VA, NPG * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc_range: %e", r);
+	if (e->env_npages != before + NPG)
+		panic("mapping %d pages took env_npages from %d to %d",
+		      NPG, before, e->env_npages);
+	if ((r = sys_page_unmap_range(0, VA, NPG * PGSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	if (e->env_npages != before)
+		panic("unmapping didn't give back the pages");
+
+	if ((r = sys_env_set_page_limit(0, before + NPG)) < 0)
+		panic("sys_env_set_page_limit: %e", r);
+	for (i = 0; i < NPG; i++)
+		if ((r = sys_page_alloc(0, VA + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc under the limit: %e", r);
+	if ((r = sys_page_alloc(0, VA + NPG * PGSIZE, PTE_P|PTE_U|PTE_W)) != -E_NO_MEM)
+		panic("sys_page_alloc over the limit returned %e", r);
+	if ((r = sys_env_set_page_limit(0, before + 2 * NPG)) != -E_INVAL)
+		panic("raised our own page limit: %e", r);
+	// Mapping a page somewhere new counts too, but remapping one
+	// that's already mapped doesn't
+	r = sys_page_map(0, VA, 0, VA + NPG * PGSIZE, PTE_P|PTE_U|PTE_W);
+	if (r != -E_NO_MEM)
+		panic("sys_page_map over the limit returned %e", r);
+	if ((r = sys_page_map(0, VA, 0, VA + PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_map over a mapped page: %e", r);
+	sys_page_unmap(0, VA);
+	if ((r = sys_page_alloc(0, VA + NPG * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc after freeing a page: %e", r);
+
+	// Children live under the same limit, and we can't raise theirs
+	// above ours
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if (thisenv->env_page_limit != before + NPG)
+			panic("child's page limit is %d", thisenv->env_page_limit);
+		ipc_recv(NULL, NULL, NULL);
+		exit();
+	}
+	if ((r = sys_env_set_page_limit(child, before + 2 * NPG)) != -E_INVAL)
+		panic("raised a child's page limit over ours: %e", r);
+	if ((r = sys_env_set_page_limit(child, 0)) != -E_INVAL)
+		panic("lifted a child's page limit: %e", r);
+	if ((r = sys_env_set_page_limit(child, NPG)) < 0)
+		panic("lowering a child's page limit: %e", r);
+	ipc_send(child, 0, NULL, 0);
+	wait(child);
+
+	cprintf("page limits work\n");
+}
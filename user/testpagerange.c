@@ -0,0 +1,60 @@
+// test the range and batch page mapping system calls
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0xA0000000)
+#define VA2	((char *) 0xB0000000)
+#define NPG	40
+
+void
+umain(int argc, char **argv)
+{
+	struct PageMapReq reqs[2];
+	int i, r;
+
+	if ((r = sys_page_alloc_range(0, VA, NPG * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc_range: %e", r);
+	for (i = 0; i < NPG; i++) {
+		if (VA[i * PGSIZE] != 0)
+			panic("page %d isn't zeroed", i);
+		VA[i * PGSIZE] = i;
+		if (!(uvpt[PGNUM(VA + i * PGSIZE)] & PTE_W))
+			panic("page %d not mapped writable", i);
+	}
+
+	if ((r = sys_page_map_range(0, VA, 0, VA2, NPG * PGSIZE)) < 0)
+		panic("sys_page_map_range: %e", r);
+	for (i = 0; i < NPG; i++)
+		if (VA2[i * PGSIZE] != i)
+			panic("page %d not mapped at VA2", i);
+
+	if ((r = sys_page_protect_range(0, VA2, NPG * PGSIZE, PTE_P|PTE_U)) < 0)
+		panic("sys_page_protect_range: %e", r);
+	for (i = 0; i < NPG; i++)
+		if (uvpt[PGNUM(VA2 + i * PGSIZE)] & PTE_W)
+			panic("page %d still writable", i);
+	if ((r = sys_page_protect_range(0, VA2, NPG * PGSIZE, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("sys_page_protect_range made read-only pages writable: %e", r);
+
+	reqs[0].srcva = VA;
+	reqs[0].dstva = UTEMP;
+	reqs[0].perm = PTE_P|PTE_U|PTE_W;
+	reqs[1].srcva = VA + PGSIZE;
+	reqs[1].dstva = UTEMP + PGSIZE;
+	reqs[1].perm = PTE_P|PTE_U;
+	if ((r = sys_page_map_batch(0, 0, reqs, 2)) < 0)
+		panic("sys_page_map_batch: %e", r);
+	if (((char *) UTEMP)[PGSIZE] != 1 || (uvpt[PGNUM(UTEMP + PGSIZE)] & PTE_W))
+		panic("sys_page_map_batch mapped the wrong thing");
+
+	if ((r = sys_page_unmap_range(0, VA, NPG * PGSIZE)) < 0
+	    || (r = sys_page_unmap_range(0, VA2, NPG * PGSIZE)) < 0
+	    || (r = sys_page_unmap_range(0, UTEMP, 2 * PGSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	for (i = 0; i < NPG; i++)
+		if ((uvpd[PDX(VA + i * PGSIZE)] & PTE_P)
+		    && (uvpt[PGNUM(VA + i * PGSIZE)] & PTE_P))
+			panic("page %d still mapped", i);
+
+	cprintf("page range syscalls work\n");
+}
@@ -0,0 +1,88 @@
+// test shared-memory ring channels, single- and multi-producer
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define RINGVA	((void *) 0xA0000000)
+#define RING2VA	((void *) 0xA0100000)
+#define NMSG	2000
+#define NPROD	3
+
+struct Msg {
+	envid_t m_from;
+	uint32_t m_seq;
+	char m_pad[24];
+};
+
+void
+umain(int argc, char **argv)
+{
+	struct Ring ring, ring2;
+	struct Msg m;
+	uint32_t next[NPROD];
+	envid_t kids[NPROD], child;
+	uint64_t start;
+	int i, j, r;
+
+	// A small ring, so both sides have to sleep now and then
+	if ((r = ring_create(&ring, RINGVA, sizeof(m) + 4, 8, 0)) < 0)
+		panic("ring_create: %e", r);
+	if ((r = ring_try_recv(&ring, &m, sizeof(m))) != -E_WOULD_BLOCK)
+		panic("ring_try_recv on an empty ring: %e", r);
+	if ((r = ring_try_send(&ring, &m, ring_maxmsg(&ring) + 1)) != -E_INVAL)
+		panic("ring_try_send of an oversized message: %e", r);
+
+	// Single producer: the child, which got the ring through fork
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		m.m_from = thisenv->env_id;
+		for (i = 0; i < NMSG; i++) {
+			m.m_seq = i;
+			if ((r = ring_send(&ring, &m, sizeof(m))) < 0)
+				panic("ring_send: %e", r);
+		}
+		exit();
+	}
+	start = read_tsc();
+	for (i = 0; i < NMSG; i++) {
+		if ((r = ring_recv(&ring, &m, sizeof(m))) != sizeof(m))
+			panic("ring_recv: %e", r);
+		if (m.m_seq != i || m.m_from != child)
+			panic("message %d came out as %d from %08x", i, m.m_seq, m.m_from);
+	}
+	cprintf("spsc ring: %llu cycles per message\n",
+		(read_tsc() - start) / NMSG);
+	wait(child);
+
+	// Several producers: each one's messages stay in order
+	if ((r = ring_create(&ring2, RING2VA, sizeof(m) + 4, 16, RING_MPSC)) < 0)
+		panic("ring_create: %e", r);
+	for (i = 0; i < NPROD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			m.m_from = thisenv->env_id;
+			for (j = 0; j < NMSG; j++) {
+				m.m_seq = j;
+				ring_send(&ring2, &m, sizeof(m));
+			}
+			exit();
+		}
+		next[i] = 0;
+	}
+	for (i = 0; i < NPROD * NMSG; i++) {
+		if ((r = ring_recv(&ring2, &m, sizeof(m))) != sizeof(m))
+			panic("ring_recv: %e", r);
+		for (j = 0; j < NPROD && kids[j] != m.m_from; j++)
+			;
+		if (j == NPROD)
+			panic("message from stranger %08x", m.m_from);
+		if (m.m_seq != next[j]++)
+			panic("producer %d's messages out of order", j);
+	}
+	for (i = 0; i < NPROD; i++)
+		wait(kids[i]);
+
+	cprintf("ring channels work\n");
+}
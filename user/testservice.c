@@ -0,0 +1,51 @@
+// test the service table, and a server being replaced
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t gen, gen2;
+	envid_t fsenv, child;
+	int i, r;
+
+	// The table agrees with a scan of envs
+	for (i = 0; i < NENV && envs[i].env_type != ENV_TYPE_FS; i++)
+		;
+	if (i == NENV || (fsenv = ipc_find_service(ENV_TYPE_FS, &gen))
+			 != envs[i].env_id)
+		panic("service table has fs as %08x", ipc_find_env(ENV_TYPE_FS));
+	if (ipc_find_env(ENV_TYPE_USER) != 0 || ipc_find_env(NSERVICE) != 0)
+		panic("found a server for a non-server type");
+
+	if ((r = sys_service_register(ENV_TYPE_USER)) != -E_INVAL)
+		panic("registering as a user env: %e", r);
+	if ((r = sys_service_register(ENV_TYPE_FS)) != -E_BAD_ENV)
+		panic("registering over a live fs: %e", r);
+	if (ipc_find_service(ENV_TYPE_FS, &gen2) != fsenv || gen2 != gen)
+		panic("fs registration changed");
+
+	// With no ns running, the slot is free, but only the kernel or
+	// a child of the last ns may fill it (check_service, at boot,
+	// has a server's child take over from it)
+	if (ipc_find_env(ENV_TYPE_NS) != 0) {
+		cprintf("ns is running; not testing a free slot\n");
+		cprintf("service table works\n");
+		return;
+	}
+	ipc_find_service(ENV_TYPE_NS, &gen);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = sys_service_register(ENV_TYPE_NS)) != -E_BAD_ENV)
+			panic("registering as an ns: %e", r);
+		exit();
+	}
+	wait(child);
+	if (ipc_find_service(ENV_TYPE_NS, &gen2) != 0 || gen2 != gen)
+		panic("ns registration changed");
+	if ((r = sys_service_register(ENV_TYPE_NS)) != -E_BAD_ENV)
+		panic("registering ourselves as an ns: %e", r);
+
+	cprintf("service table works\n");
+}
@@ -0,0 +1,39 @@
+// test sfork: threads share memory but not their stacks or thisenv
+
+#include <inc/lib.h>
+
+volatile int shared;
+int private THREADLOCAL;
+
+void
+umain(int argc, char **argv)
+{
+	volatile int onstack = 0;
+	envid_t parent = sys_getenvid(), who;
+
+	private = 1;
+	if ((who = sfork()) < 0)
+		panic("sfork: %e", who);
+	if (who == 0) {
+		if (thisenv->env_id == parent)
+			panic("child's thisenv points at the parent");
+		shared = 1;
+		onstack = 1;
+		private = 2;
+		while (shared != 2)
+			sys_yield();
+		exit();
+	}
+
+	while (shared != 1)
+		sys_yield();
+	if (onstack != 0)
+		panic("child's write to its stack was seen by the parent");
+	if (private != 1)
+		panic("child's write to THREADLOCAL data was seen by the parent");
+	if (thisenv->env_id != parent)
+		panic("parent's thisenv was changed by the child");
+	shared = 2;
+	wait(who);
+	cprintf("sfork works\n");
+}
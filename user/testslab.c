@@ -0,0 +1,106 @@
+// test the size-class malloc: slab reuse, large runs, realloc and calloc
+
+#include <inc/lib.h>
+
+#define NOBJ	500
+
+static char *obj[NOBJ];
+
+// An allocation whose call site profiling should find: the return
+// address malloc sees is within the first few bytes of this function.
+static char * __attribute__((noinline))
+site_malloc(size_t n)
+{
+	char *p;
+
+	if ((p = malloc(n)))
+		memset(p, 0, n);
+	return p;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct MallocStats before, after;
+	struct MallocSite site;
+	char *p, *q, *big;
+	int i, j;
+
+	// Objects of every size class, filled and checked
+	for (i = 0; i < NOBJ; i++) {
+		if (!(obj[i] = malloc(i * 3 + 1)))
+			panic("malloc %d failed", i * 3 + 1);
+		memset(obj[i], i, i * 3 + 1);
+	}
+	for (i = 0; i < NOBJ; i++)
+		for (j = 0; j < i * 3 + 1; j++)
+			if (obj[i][j] != (char) i)
+				panic("object %d was overwritten", i);
+
+	// Freed objects are reused by the next allocation of their class
+	p = obj[100];
+	free(p);
+	if ((q = malloc(300)) != p)
+		panic("freed object %08x not reused, got %08x", p, q);
+	obj[100] = q;
+	for (i = 0; i < NOBJ; i++)
+		free(obj[i]);
+
+	// Large chunks freed next to each other coalesce
+	p = malloc(3 * PGSIZE);
+	q = malloc(3 * PGSIZE);
+	free(p);
+	free(q);
+	if (!(big = malloc(6 * PGSIZE)))
+		panic("malloc of a large chunk failed");
+	memset(big, 0xa5, 6 * PGSIZE);
+	free(big);
+	if (!(big = malloc(4 * 1024 * 1024)))
+		panic("malloc of 4MB failed");
+	big[4 * 1024 * 1024 - 1] = 1;
+	free(big);
+
+	// realloc keeps the contents, in place if they still fit
+	p = malloc(20);
+	strcpy(p, "hello, realloc");
+	if (realloc(p, 30) != p)
+		panic("realloc within the size class moved");
+	if (!(q = realloc(p, 5000)) || strcmp(q, "hello, realloc") != 0)
+		panic("realloc lost the contents");
+	free(q);
+
+	// calloc zeroes reused memory and refuses overflowing sizes
+	p = malloc(64);
+	memset(p, 0xff, 64);
+	free(p);
+	q = calloc(8, 8);
+	for (i = 0; i < 64; i++)
+		if (q[i] != 0)
+			panic("calloc memory isn't zeroed");
+	free(q);
+	if (calloc(0x10000, 0x10000) != 0)
+		panic("calloc didn't catch overflow");
+
+	// Statistics follow allocations, and profiling finds site_malloc
+	malloc_stats(&before);
+	malloc_profile(1);
+	p = site_malloc(100);
+	malloc_stats(&after);
+	if (after.ms_live[3] != before.ms_live[3] + 1
+	    || after.ms_in_use != before.ms_in_use + 128)
+		panic("malloc_stats didn't count a 128-byte allocation");
+	free(p);
+	malloc_stats(&after);
+	if (after.ms_live[3] != before.ms_live[3])
+		panic("malloc_stats didn't count a free");
+	if (malloc_sites(&site, 1) != 1 || site.count != 1 || site.bytes != 100)
+		panic("malloc_profile didn't sample the allocation");
+	if (site.pc[0] < (uintptr_t) site_malloc
+	    || site.pc[0] >= (uintptr_t) site_malloc + 64)
+		panic("malloc_profile put the allocation at %08x, not in site_malloc",
+		      site.pc[0]);
+	malloc_stats_dump(-1);
+	malloc_profile(0);
+
+	cprintf("slab malloc works\n");
+}
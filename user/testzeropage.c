@@ -0,0 +1,50 @@
+// test that zero-filled pages share the kernel's zero page until written
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0xA0000000)
+#define NPG	64
+
+char bss[(NPG + 1) * PGSIZE];
+
+static void
+check_lazy(const char *what, char *va)
+{
+	physaddr_t zero;
+	int i;
+
+	zero = PTE_ADDR(uvpt[PGNUM(va)]);
+	for (i = 0; i < NPG; i++) {
+		if (va[i * PGSIZE] != 0 || va[i * PGSIZE + PGSIZE - 1] != 0)
+			panic("%s page %d isn't zeroed", what, i);
+		if (PTE_ADDR(uvpt[PGNUM(va + i * PGSIZE)]) != zero)
+			panic("%s page %d isn't the zero page", what, i);
+	}
+
+	va[5 * PGSIZE] = 'x';
+	if (!(uvpt[PGNUM(va + 5 * PGSIZE)] & PTE_W)
+	    || PTE_ADDR(uvpt[PGNUM(va + 5 * PGSIZE)]) == zero)
+		panic("%s page 5 wasn't given a page of its own on write", what);
+	if (va[4 * PGSIZE] != 0 || va[6 * PGSIZE] != 0
+	    || PTE_ADDR(uvpt[PGNUM(va + 6 * PGSIZE)]) != zero)
+		panic("writing %s page 5 changed its neighbours", what);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	if ((r = sys_page_alloc_range(0, VA, NPG * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc_range: %e", r);
+	check_lazy("allocated", VA);
+	check_lazy(".bss", ROUNDUP((char *) bss, PGSIZE));
+
+	// Shared pages need to be real from the start
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (!(uvpt[PGNUM(UTEMP)] & PTE_W))
+		panic("PTE_SHARE page was mapped copy-on-write");
+
+	cprintf("zero page works\n");
+}